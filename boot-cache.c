@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "boot-cache.h"
+#include "log.h"
+
+#define BOOT_ID_PATH	  "/proc/sys/kernel/random/boot_id"
+#define BOOT_ID_LEN	  36
+#define BOOT_CACHE_MAGIC  0x31434251 // "QBC1"
+
+struct boot_cache_hdr {
+	uint32_t magic;
+	uint32_t len;
+	char boot_id[BOOT_ID_LEN];
+};
+
+static int boot_cache_get_boot_id(char *boot_id)
+{
+	static char cached[BOOT_ID_LEN];
+	int fd, rc;
+
+	if (cached[0]) {
+		memcpy(boot_id, cached, BOOT_ID_LEN);
+		return 0;
+	}
+
+	fd = open(BOOT_ID_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	rc = read(fd, cached, BOOT_ID_LEN);
+	close(fd);
+	if (rc != BOOT_ID_LEN) {
+		cached[0] = '\0';
+		return -EIO;
+	}
+
+	memcpy(boot_id, cached, BOOT_ID_LEN);
+	return 0;
+}
+
+int boot_cache_read(const char *name, void *data, size_t len)
+{
+	char path[sizeof(BOOT_CACHE_DIR) + 64];
+	struct boot_cache_hdr hdr;
+	char boot_id[BOOT_ID_LEN];
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = data, .iov_len = len },
+	};
+	ssize_t rc;
+	int fd;
+
+	if (boot_cache_get_boot_id(boot_id))
+		return -ENOENT;
+
+	snprintf(path, sizeof(path), "%s/%s", BOOT_CACHE_DIR, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	rc = readv(fd, iov, 2);
+	close(fd);
+
+	if (rc != (ssize_t)(sizeof(hdr) + len) || hdr.magic != BOOT_CACHE_MAGIC ||
+	    hdr.len != len || memcmp(hdr.boot_id, boot_id, BOOT_ID_LEN)) {
+		LOGD("%s: ignoring stale cache entry %s\n", __func__, path);
+		return -ESTALE;
+	}
+
+	return 0;
+}
+
+int boot_cache_write(const char *name, const void *data, size_t len)
+{
+	char path[sizeof(BOOT_CACHE_DIR) + 64];
+	char tmp[sizeof(path) + 8];
+	struct boot_cache_hdr hdr = {
+		.magic = BOOT_CACHE_MAGIC,
+		.len = len,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = (void *)data, .iov_len = len },
+	};
+	ssize_t rc;
+	int fd;
+
+	if (boot_cache_get_boot_id(hdr.boot_id))
+		return -ENOENT;
+
+	if (mkdir(BOOT_CACHE_DIR, 0755) && errno != EEXIST) {
+		rc = -errno;
+		LOGD("%s: Failed to create %s: %s\n", __func__, BOOT_CACHE_DIR, strerror(-rc));
+		return rc;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", BOOT_CACHE_DIR, name);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	rc = writev(fd, iov, 2);
+	close(fd);
+	if (rc != (ssize_t)(sizeof(hdr) + len) || rename(tmp, path)) {
+		LOGD("%s: Failed to write %s\n", __func__, path);
+		unlink(tmp);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+void boot_cache_invalidate(const char *name)
+{
+	char path[sizeof(BOOT_CACHE_DIR) + 64];
+
+	snprintf(path, sizeof(path), "%s/%s", BOOT_CACHE_DIR, name);
+	unlink(path);
+}
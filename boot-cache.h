@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BOOT_CACHE_H__
+#define __BOOT_CACHE_H__
+
+#include <stddef.h>
+
+/*
+ * Small binary blobs which are only valid for the current boot, kept
+ * under /run and tagged with the kernel boot_id so a stale entry (e.g.
+ * if /run isn't a tmpfs) is never used.
+ */
+#ifndef BOOT_CACHE_DIR
+#define BOOT_CACHE_DIR "/run/qbootctl"
+#endif
+
+// Returns 0 if the entry exists, was written during this boot and is
+// exactly len bytes long, -errno otherwise.
+int boot_cache_read(const char *name, void *data, size_t len);
+// Atomically replace the entry, returns 0 on success or -errno.
+int boot_cache_write(const char *name, const void *data, size_t len);
+void boot_cache_invalidate(const char *name);
+
+#endif // __BOOT_CACHE_H__
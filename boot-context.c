@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "boot-cache.h"
+#include "boot-context.h"
+#include "log.h"
+
+// Overridable to test without booting
+#ifndef BOOT_CONTEXT_CMDLINE_PATH
+#define BOOT_CONTEXT_CMDLINE_PATH "/proc/cmdline"
+#endif
+#ifndef BOOT_CONTEXT_BOOTCONFIG_PATH
+#define BOOT_CONTEXT_BOOTCONFIG_PATH "/proc/bootconfig"
+#endif
+#ifndef BOOT_CONTEXT_DT_PATH
+#define BOOT_CONTEXT_DT_PATH "/proc/device-tree/chosen/bootargs"
+#endif
+
+#define BOOT_CONTEXT_BUF_SIZE 4096
+
+// In order of preference, androidboot.slot has no leading '_'
+static const char *const slot_keys[] = {
+	"androidboot.slot_suffix",
+	"slot_suffix",
+	"androidboot.slot",
+};
+
+static struct boot_context boot_context;
+static bool boot_context_valid;
+
+const char *boot_context_source_str(enum boot_context_source source)
+{
+	switch (source) {
+	case BOOT_CONTEXT_CMDLINE:
+		return "cmdline";
+	case BOOT_CONTEXT_BOOTCONFIG:
+		return "bootconfig";
+	case BOOT_CONTEXT_DT:
+		return "devicetree";
+	default:
+		return "none";
+	}
+}
+
+// Read all of path into buf and NUL terminate it, returns the length or -errno
+static int read_file(const char *path, char *buf, size_t len)
+{
+	ssize_t rc;
+	size_t off = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	while (off < len - 1) {
+		rc = read(fd, buf + off, len - 1 - off);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+		off += rc;
+	}
+	close(fd);
+	buf[off] = '\0';
+
+	return off;
+}
+
+// "_a", "a", "_b", ... to a slot number
+static int parse_slot(const char *val, size_t len)
+{
+	if (len && val[0] == '_') {
+		val++;
+		len--;
+	}
+
+	if (len != 1 || !islower(val[0]))
+		return -1;
+
+	return val[0] - 'a';
+}
+
+static int slot_key(const char *key, size_t len)
+{
+	for (unsigned int i = 0; i < sizeof(slot_keys) / sizeof(slot_keys[0]); i++)
+		if (strlen(slot_keys[i]) == len && !strncmp(key, slot_keys[i], len))
+			return i;
+
+	return -1;
+}
+
+// Kernel command line syntax, space separated key=value where the
+// value may be double quoted. The devicetree bootargs are the same.
+static int parse_cmdline(char *buf)
+{
+	char *p = buf, *key, *val, *eq;
+	int slot = -1, best = -1, k;
+	size_t len;
+
+	while (*p) {
+		while (isspace(*p))
+			p++;
+		if (!*p)
+			break;
+
+		key = p;
+		while (*p && !isspace(*p) && *p != '=')
+			p++;
+		eq = p;
+		val = p;
+		len = 0;
+		if (*p == '=') {
+			val = ++p;
+			if (*p == '"') {
+				val = ++p;
+				while (*p && *p != '"')
+					p++;
+				len = p - val;
+				if (*p)
+					p++;
+			} else {
+				while (*p && !isspace(*p))
+					p++;
+				len = p - val;
+			}
+		}
+
+		k = slot_key(key, eq - key);
+		if (k >= 0 && (best < 0 || k < best) && parse_slot(val, len) >= 0) {
+			slot = parse_slot(val, len);
+			best = k;
+		}
+	}
+
+	return slot;
+}
+
+// /proc/bootconfig has one 'key = "value"' per line
+static int parse_bootconfig(char *buf)
+{
+	char *line, *save = NULL, *key_end, *val, *end;
+	int slot = -1, best = -1, k;
+
+	for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		key_end = strstr(line, " = ");
+		if (!key_end)
+			continue;
+		val = key_end + 3;
+		if (*val == '"')
+			val++;
+		end = val + strcspn(val, "\"");
+
+		k = slot_key(line, key_end - line);
+		if (k >= 0 && (best < 0 || k < best) && parse_slot(val, end - val) >= 0) {
+			slot = parse_slot(val, end - val);
+			best = k;
+		}
+	}
+
+	return slot;
+}
+
+static void boot_context_resolve(struct boot_context *ctx)
+{
+	static const struct {
+		const char *path;
+		enum boot_context_source source;
+		int (*parse)(char *buf);
+	} sources[] = {
+		{ BOOT_CONTEXT_CMDLINE_PATH, BOOT_CONTEXT_CMDLINE, parse_cmdline },
+		{ BOOT_CONTEXT_BOOTCONFIG_PATH, BOOT_CONTEXT_BOOTCONFIG, parse_bootconfig },
+		{ BOOT_CONTEXT_DT_PATH, BOOT_CONTEXT_DT, parse_cmdline },
+	};
+	char buf[BOOT_CONTEXT_BUF_SIZE];
+	int slot;
+
+	ctx->slot = -1;
+	ctx->source = BOOT_CONTEXT_NONE;
+
+	for (unsigned int i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+		if (read_file(sources[i].path, buf, sizeof(buf)) < 0)
+			continue;
+		slot = sources[i].parse(buf);
+		if (slot < 0)
+			continue;
+
+		ctx->slot = slot;
+		ctx->source = sources[i].source;
+		return;
+	}
+}
+
+void boot_context_invalidate(void)
+{
+	boot_context_valid = false;
+	boot_cache_invalidate(BOOT_CONTEXT_CACHE);
+}
+
+const struct boot_context *boot_context_get(bool use_cache)
+{
+	if (boot_context_valid && use_cache)
+		return &boot_context;
+
+	if (!use_cache ||
+	    boot_cache_read(BOOT_CONTEXT_CACHE, &boot_context, sizeof(boot_context))) {
+		boot_context_resolve(&boot_context);
+		boot_cache_write(BOOT_CONTEXT_CACHE, &boot_context, sizeof(boot_context));
+	}
+	boot_context_valid = true;
+
+	if (boot_context.slot < 0)
+		LOGD("%s: No boot slot in the cmdline, bootconfig or devicetree\n", __func__);
+	else
+		LOGD("%s: Booted slot %c (from %s)\n", __func__, 'a' + boot_context.slot,
+		     boot_context_source_str(boot_context.source));
+
+	return &boot_context;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BOOT_CONTEXT_H__
+#define __BOOT_CONTEXT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * What the bootloader told the kernel about this boot. The booted slot
+ * can't change until the next boot, so it's resolved once and kept in
+ * the boot cache, after that finding the current slot costs no block I/O.
+ */
+#define BOOT_CONTEXT_CACHE "boot-context"
+
+enum boot_context_source {
+	BOOT_CONTEXT_NONE = 0,
+	BOOT_CONTEXT_CMDLINE,
+	BOOT_CONTEXT_BOOTCONFIG,
+	BOOT_CONTEXT_DT,
+};
+
+struct boot_context {
+	// -1 if no source names the booted slot
+	int8_t slot;
+	uint8_t source;
+};
+
+// Find the booted slot from androidboot.slot_suffix (or slot_suffix, or
+// androidboot.slot) on the kernel cmdline, in bootconfig or in the
+// bootargs of the devicetree chosen node, in that order. The result is
+// cached for the rest of the boot, unless use_cache is false in which
+// case it's looked up again and the cache replaced.
+const struct boot_context *boot_context_get(bool use_cache);
+
+// Forget the booted slot, the next boot_context_get() looks it up again
+void boot_context_invalidate(void);
+
+const char *boot_context_source_str(enum boot_context_source source);
+
+#endif // __BOOT_CONTEXT_H__
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "bootctrl.h"
+#include "bootctrl-async.h"
+#include "log.h"
+
+struct bootctl_async_req {
+	struct bootctl_async_result res;
+	bool ignore_missing_bsg;
+};
+
+/*
+ * One ring for both directions: [tail, done) have completed and wait to
+ * be collected, [done, head) wait for the worker. The indices only ever
+ * grow and are taken modulo the ring size.
+ */
+static struct bootctl_async_req async_ring[BOOTCTL_ASYNC_QUEUE];
+static unsigned int async_head, async_done, async_tail;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t async_thread;
+static bool async_running, async_stopping;
+static int async_fd = -1;
+static unsigned int async_window_us;
+
+static bool async_is_attr(enum bootctl_async_op op)
+{
+	return op == BOOTCTL_ASYNC_MARK_SUCCESSFUL || op == BOOTCTL_ASYNC_SET_UNBOOTABLE;
+}
+
+// Called and returns with async_lock held, commits the attribute
+// updates at the front of the queue together
+static void async_run_attrs(void)
+{
+	struct bootctl_attr_req reqs[BOOTCTL_ASYNC_QUEUE];
+	struct bootctl_async_result *res;
+	unsigned int nr = 0;
+
+	if (async_window_us && !async_stopping) {
+		pthread_mutex_unlock(&async_lock);
+		usleep(async_window_us);
+		pthread_mutex_lock(&async_lock);
+	}
+
+	while (async_done + nr != async_head) {
+		res = &async_ring[(async_done + nr) % BOOTCTL_ASYNC_QUEUE].res;
+		if (!async_is_attr(res->op))
+			break;
+		reqs[nr].slot = res->slot;
+		reqs[nr].op = res->op == BOOTCTL_ASYNC_MARK_SUCCESSFUL ?
+				      BOOTCTL_ATTR_MARK_SUCCESSFUL :
+				      BOOTCTL_ATTR_SET_UNBOOTABLE;
+		nr++;
+	}
+	pthread_mutex_unlock(&async_lock);
+
+	bootctl_update_attributes(reqs, nr);
+
+	pthread_mutex_lock(&async_lock);
+	for (unsigned int i = 0; i < nr; i++)
+		async_ring[(async_done + i) % BOOTCTL_ASYNC_QUEUE].res.rc = reqs[i].rc;
+	async_done += nr;
+	LOGD("%s: Committed %u attribute updates at once\n", __func__, nr);
+}
+
+static int async_run(const struct bootctl_async_req *req)
+{
+	unsigned int slot = req->res.slot;
+
+	switch (req->res.op) {
+	case BOOTCTL_ASYNC_SET_ACTIVE:
+		return bootctl.setActiveBootSlot(slot, req->ignore_missing_bsg);
+	case BOOTCTL_ASYNC_MARK_SUCCESSFUL:
+		return bootctl.markBootSuccessful(slot);
+	case BOOTCTL_ASYNC_SET_UNBOOTABLE:
+		return bootctl.setSlotAsUnbootable(slot);
+	case BOOTCTL_ASYNC_GET_ACTIVE:
+		return bootctl.getActiveBootSlot();
+	case BOOTCTL_ASYNC_IS_BOOTABLE:
+		return bootctl.isSlotBootable(slot);
+	case BOOTCTL_ASYNC_IS_SUCCESSFUL:
+		return bootctl.isSlotMarkedSuccessful(slot);
+	}
+
+	return -EINVAL;
+}
+
+static void *async_worker(void *arg)
+{
+	struct bootctl_async_req req;
+	unsigned int done;
+	uint64_t count;
+	int rc;
+
+	(void)arg;
+
+	pthread_mutex_lock(&async_lock);
+	for (;;) {
+		while (async_done == async_head && !async_stopping)
+			pthread_cond_wait(&async_cond, &async_lock);
+		if (async_done == async_head)
+			break;
+
+		done = async_done;
+		// The slot stays ours until async_done moves past it
+		req = async_ring[async_done % BOOTCTL_ASYNC_QUEUE];
+		if (async_is_attr(req.res.op)) {
+			async_run_attrs();
+		} else {
+			pthread_mutex_unlock(&async_lock);
+			rc = async_run(&req);
+			pthread_mutex_lock(&async_lock);
+			async_ring[async_done % BOOTCTL_ASYNC_QUEUE].res.rc = rc;
+			async_done++;
+		}
+
+		count = async_done - done;
+		if (write(async_fd, &count, sizeof(count)) != sizeof(count))
+			LOGW("%s: Failed to signal completion: %s\n", __func__, strerror(errno));
+	}
+	pthread_mutex_unlock(&async_lock);
+
+	return NULL;
+}
+
+int bootctl_async_start(void)
+{
+	int rc;
+
+	if (async_running)
+		return -EALREADY;
+
+	async_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (async_fd < 0) {
+		rc = -errno;
+		LOGE("%s: Failed to create eventfd: %s\n", __func__, strerror(errno));
+		return rc;
+	}
+
+	async_head = async_done = async_tail = 0;
+	async_stopping = false;
+	rc = pthread_create(&async_thread, NULL, async_worker, NULL);
+	if (rc) {
+		LOGE("%s: Failed to start the worker: %s\n", __func__, strerror(rc));
+		close(async_fd);
+		async_fd = -1;
+		return -rc;
+	}
+	pthread_mutex_lock(&async_lock);
+	async_running = true;
+	pthread_mutex_unlock(&async_lock);
+
+	return async_fd;
+}
+
+int bootctl_async_submit(enum bootctl_async_op op, unsigned int slot, bool ignore_missing_bsg,
+			 void *data)
+{
+	struct bootctl_async_req *req;
+
+	if (op > BOOTCTL_ASYNC_IS_SUCCESSFUL)
+		return -EINVAL;
+
+	pthread_mutex_lock(&async_lock);
+	if (!async_running) {
+		pthread_mutex_unlock(&async_lock);
+		return -EINVAL;
+	}
+	if (async_head - async_tail == BOOTCTL_ASYNC_QUEUE) {
+		pthread_mutex_unlock(&async_lock);
+		return -EBUSY;
+	}
+
+	req = &async_ring[async_head % BOOTCTL_ASYNC_QUEUE];
+	req->res.data = data;
+	req->res.op = op;
+	req->res.slot = slot;
+	req->res.rc = 0;
+	req->ignore_missing_bsg = ignore_missing_bsg;
+	async_head++;
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_lock);
+
+	return 0;
+}
+
+int bootctl_async_collect(struct bootctl_async_result *results, unsigned int max)
+{
+	uint64_t count;
+	unsigned int nr = 0;
+
+	if (!async_running)
+		return -EINVAL;
+
+	// Reset the counter first, anything completing after this makes the
+	// fd readable again
+	if (read(async_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		LOGW("%s: Failed to read eventfd: %s\n", __func__, strerror(errno));
+
+	pthread_mutex_lock(&async_lock);
+	while (nr < max && async_tail != async_done)
+		results[nr++] = async_ring[async_tail++ % BOOTCTL_ASYNC_QUEUE].res;
+	pthread_mutex_unlock(&async_lock);
+
+	return nr;
+}
+
+void bootctl_async_set_window(unsigned int usec)
+{
+	async_window_us = usec;
+}
+
+void bootctl_async_stop(void)
+{
+	pthread_mutex_lock(&async_lock);
+	if (!async_running) {
+		pthread_mutex_unlock(&async_lock);
+		return;
+	}
+	// Refuse new requests, the worker still finishes the queued ones
+	async_running = false;
+	async_stopping = true;
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_lock);
+
+	pthread_join(async_thread, NULL);
+	close(async_fd);
+	async_fd = -1;
+}
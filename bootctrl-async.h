@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BOOTCTRL_ASYNC_H__
+#define __BOOTCTRL_ASYNC_H__
+
+#include <stdbool.h>
+
+/*
+ * Runs the boot_control_module operations on a worker thread, for
+ * callers with an event loop. Operations run one at a time in the
+ * order they were submitted; the fd returned by bootctl_async_start()
+ * becomes readable whenever one has completed.
+ *
+ * Queued BOOTCTL_ASYNC_MARK_SUCCESSFUL and BOOTCTL_ASYNC_SET_UNBOOTABLE
+ * operations are group committed through bootctl_update_attributes(),
+ * every one still gets its own result.
+ *
+ * While the worker is running nothing else may call into the HAL or
+ * the GPT code, none of it is thread safe.
+ */
+#define BOOTCTL_ASYNC_QUEUE 16
+
+enum bootctl_async_op {
+	BOOTCTL_ASYNC_SET_ACTIVE,
+	BOOTCTL_ASYNC_MARK_SUCCESSFUL,
+	BOOTCTL_ASYNC_SET_UNBOOTABLE,
+	BOOTCTL_ASYNC_GET_ACTIVE,
+	BOOTCTL_ASYNC_IS_BOOTABLE,
+	BOOTCTL_ASYNC_IS_SUCCESSFUL,
+};
+
+struct bootctl_async_result {
+	void *data;
+	enum bootctl_async_op op;
+	unsigned int slot;
+	// What the synchronous call returned
+	int rc;
+};
+
+// Start the worker, returns a non-blocking eventfd to poll for
+// completions or -errno.
+int bootctl_async_start(void);
+// Queue op on slot, data is handed back with the result. Returns 0,
+// -EBUSY if BOOTCTL_ASYNC_QUEUE operations are already queued or not
+// yet collected, or -EINVAL.
+int bootctl_async_submit(enum bootctl_async_op op, unsigned int slot, bool ignore_missing_bsg,
+			 void *data);
+// Never blocks, returns the number of results stored.
+int bootctl_async_collect(struct bootctl_async_result *results, unsigned int max);
+// How long the worker waits for more attribute updates to commit along
+// with the first one (default: 0, only those already queued)
+void bootctl_async_set_window(unsigned int usec);
+// Finish the queued operations and stop the worker, results that
+// weren't collected are dropped.
+void bootctl_async_stop(void);
+
+#endif // __BOOTCTRL_ASYNC_H__
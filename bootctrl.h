@@ -111,8 +111,51 @@ struct boot_control_module {
 	* the same slot as the one provided in the last setActiveBootSlot() call.
 	*/
 	unsigned (*getActiveBootSlot)();
+
+	/*
+	* (*getBootLun)() returns the UFS LUN the device boots XBL from
+	* (the bBootLunEn attribute), 1 for LUN A and 2 for LUN B.
+	* Returns -EOPNOTSUPP on eMMC devices and -errno on error.
+	*/
+	int (*getBootLun)();
 };
 
 extern const struct boot_control_module bootctl;
 
+enum bootctl_attr_op {
+	BOOTCTL_ATTR_MARK_SUCCESSFUL,
+	BOOTCTL_ATTR_SET_UNBOOTABLE,
+};
+
+struct bootctl_attr_req {
+	unsigned int slot;
+	enum bootctl_attr_op op;
+	// Set to what markBootSuccessful() or setSlotAsUnbootable() would
+	// have returned
+	int rc;
+};
+
+/*
+ * Group commit: apply nr markBootSuccessful() and setSlotAsUnbootable()
+ * calls as one update, so every LUN is written at most once no matter
+ * how many requests there are. The result is the same as making the
+ * calls in order. Returns the number of requests that failed.
+ */
+int bootctl_update_attributes(struct bootctl_attr_req *reqs, unsigned int nr);
+
+/*
+ * Finish a setActiveBootSlot() that was interrupted, e.g. by a power
+ * loss, using its intent record. Only the primary and backup headers
+ * of the LUNs it touched are read to find what's missing. The record
+ * only holds the target state, so the switch is always finished, never
+ * rolled back. Returns 1 if a switch was finished, 0 if there was
+ * nothing to do or -1.
+ */
+int recover_slot_switch(void);
+
+// Look for a setActiveBootSlot() that was interrupted without doing
+// anything about it. Returns 1 and fills in the slot it was switching
+// to, 0 if there is none or -errno.
+int get_pending_slot_switch(unsigned *slot);
+
 #endif // __BOOTCTRL_H__
@@ -44,30 +44,30 @@
  */
 
 #include <assert.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "gpt-utils.h"
+#include "partlabel.h"
+#include "intent.h"
+#include "ptn-profile.h"
 #include "ufs-bsg.h"
-#include "utils.h"
+#include "log.h"
 
+#include "boot-context.h"
 #include "bootctrl.h"
 
-#define BOOTDEV_DIR	  "/dev/disk/by-partlabel"
 #define BOOT_IMG_PTN_NAME "boot_"
 #define LUN_NAME_END_LOC  14
-#define BOOT_SLOT_PROP	  "slot_suffix"
-
-#define MAX_CMDLINE_SIZE  4096
 
 #define SLOT_ACTIVE	  1
 #define SLOT_INACTIVE	  2
@@ -87,39 +87,8 @@ enum part_attr_type {
 	ATTR_SLOT_ACTIVE = 0,
 	ATTR_BOOT_SUCCESSFUL,
 	ATTR_UNBOOTABLE,
-	ATTR_BOOTABLE,
 };
 
-void get_kernel_cmdline_arg(const char *arg, char *buf, const char *def)
-{
-	int fd;
-	char pcmd[MAX_CMDLINE_SIZE];
-	char *val, *found, *ptr = buf;
-	fd = open("/proc/cmdline", O_RDONLY);
-	int rc = read(fd, pcmd, MAX_CMDLINE_SIZE);
-	if (rc < 0) {
-		fprintf(stderr, "Couldn't open /proc/cmdline: %d (%s)\n", rc, strerror(errno));
-		goto error;
-	}
-	close(fd);
-	found = strstr(pcmd, arg);
-	if (!found || !(val = strstr(found, "="))) {
-		fprintf(stderr, "Couldn't find cmdline arg: '%s'\n", arg);
-		goto error;
-	}
-
-	val++;
-	// no this doesn't handle quotes lol
-	while (*val != ' ') {
-		*ptr++ = *val++;
-	}
-
-	return;
-
-error:
-	strcpy(buf, def);
-}
-
 // Get the value of one of the attribute fields for a partition.
 static int get_partition_attribute(struct gpt_disk *disk, const char *partname,
 				   enum part_attr_type part_attr)
@@ -133,14 +102,14 @@ static int get_partition_attribute(struct gpt_disk *disk, const char *partname,
 	// Will initialise the disk if null, or reinitialise it if
 	// it's for a partition on a different disk
 	if (gpt_disk_get_disk_info(partname, disk) < 0) {
-		fprintf(stderr, "%s: gpt_disk_get_disk_info failed\n", __func__);
+		LOGE("%s: gpt_disk_get_disk_info failed\n", __func__);
 		return -1;
 	}
 
 	pentry = gpt_disk_get_pentry(disk, partname, PRIMARY_GPT);
 
 	if (!pentry) {
-		fprintf(stderr, "%s: pentry does not exist in disk struct\n", __func__);
+		LOGE("%s: pentry does not exist in disk struct\n", __func__);
 		return -1;
 	}
 
@@ -166,96 +135,100 @@ static int get_partition_attribute(struct gpt_disk *disk, const char *partname,
 	return retval;
 }
 
-// Set a particular attribute for all the partitions in a
-// slot
-static int update_slot_attribute(struct gpt_disk *disk, unsigned slot,
-				 enum part_attr_type ab_attr)
+// Bits to set and clear in the A/B attribute byte of every partition
+// of each slot, later edits of the same bit win
+struct slot_attr_edit {
+	uint8_t set[2];
+	uint8_t clear[2];
+};
+
+static void slot_attr_edit_add(struct slot_attr_edit *edit, unsigned slot, uint8_t set,
+			       uint8_t clear)
 {
-	unsigned int i = 0;
-	char buf[GPT_PTN_PATH_MAX];
-	struct stat st;
+	edit->set[slot] = (edit->set[slot] & ~clear) | set;
+	edit->clear[slot] = (edit->clear[slot] & ~set) | clear;
+}
+
+struct slot_attr_item {
+	char name[MAX_GPT_NAME_SIZE + 1];
+	char devpath[GPT_PTN_PATH_MAX];
+	unsigned int slot;
+	unsigned int order;
+};
+
+// Group the partitions by LUN, the profile order mixes them up
+static int slot_attr_item_cmp(const void *a, const void *b)
+{
+	const struct slot_attr_item *ia = a, *ib = b;
+	int rc = strcmp(ia->devpath, ib->devpath);
+
+	return rc ?: (int)ia->order - (int)ib->order;
+}
+
+// Apply edit to all the partitions in both slots, committing each LUN
+// once
+static int update_slot_attributes(struct gpt_disk *disk, const struct slot_attr_edit *edit)
+{
+	struct slot_attr_item items[PTN_PROFILE_MAX * 2];
+	unsigned int i = 0, nr = 0;
 	uint8_t *pentry = NULL;
 	uint8_t *pentry_bak = NULL;
 	int rc = -1;
 	uint8_t *attr = NULL;
 	uint8_t *attr_bak = NULL;
 	const char *partName;
-	char devpath[GPT_PTN_PATH_MAX] = { 0 };
 
-	for (i = 0; i < ARRAY_SIZE(g_all_ptns); i++) {
-		memset(buf, '\0', sizeof(buf));
+	for (i = 0; i < ptn_profile_count(); i++) {
 		// Check if A/B versions of this ptn exist
-		rc = snprintf(buf, sizeof(buf) - 1, "%s/%.72s", BOOT_DEV_DIR, g_all_ptns[i]);
-		if (stat(buf, &st) < 0) {
-			// partition does not have _a version
+		if (!ptn_profile_present(i, 0) || !ptn_profile_present(i, 1))
 			continue;
-		}
 
-		buf[strlen(buf) - 1] = 'b';
-		if (stat(buf, &st) < 0) {
-			// partition does not have _b version
-			continue;
-		}
-
-		if (slot == 0)
-			partName = g_all_ptns[i];
-		else
-			partName = buf + strlen(BOOT_DEV_DIR) + 1;
-
-		LOGD("%s: partName = '%s'\n", __func__, partName);
+		for (unsigned slot = 0; slot < 2; slot++) {
+			if (!edit->set[slot] && !edit->clear[slot])
+				continue;
 
-		// If the current partition is for a different disk (e.g. /dev/sde when the current disk is /dev/sda)
-		// Then commit the current disk
-		if (!partition_is_for_disk(disk, partName, devpath, sizeof(devpath))) {
-			if (gpt_disk_commit(disk)) {
-				fprintf(stderr, "%s: Failed to commit disk\n", __func__);
+			snprintf(items[nr].name, sizeof(items[nr].name), "%s", ptn_profile_ptn(i));
+			items[nr].name[strlen(items[nr].name) - 1] = slot == 0 ? 'a' : 'b';
+			if (partlabel_resolve(items[nr].name, NULL, 0, items[nr].devpath,
+					      sizeof(items[nr].devpath))) {
+				LOGE("%s: Failed to find the LUN of %s\n", __func__, items[nr].name);
 				return -1;
 			}
+			items[nr].slot = slot;
+			items[nr].order = nr;
+			nr++;
 		}
+	}
+
+	qsort(items, nr, sizeof(items[0]), slot_attr_item_cmp);
 
+	for (i = 0; i < nr; i++) {
+		partName = items[i].name;
+		LOGD("%s: partName = '%s'\n", __func__, partName);
+
+		// If the partition is on a different disk, this commits
+		// the current one before switching over.
 		rc = gpt_disk_get_disk_info(partName, disk);
 		if (rc != 0) {
-			fprintf(stderr, "%s: Failed to get disk info for %s\n", __func__, partName);
+			LOGE("%s: Failed to get disk info for %s\n", __func__, partName);
 			return -1;
 		}
 
 		pentry = gpt_disk_get_pentry(disk, partName, PRIMARY_GPT);
 		pentry_bak = gpt_disk_get_pentry(disk, partName, SECONDARY_GPT);
 		if (!pentry || !pentry_bak) {
-			fprintf(stderr, "%s: Failed to get pentry/pentry_bak for %s\n", __func__,
-				partName);
+			LOGE("%s: Failed to get pentry/pentry_bak for %s\n", __func__, partName);
 			return -1;
 		}
 
 		attr = pentry + AB_FLAG_OFFSET;
-		// LOGD("%s: got pentry for part '%s': 0x%lx (at flags: 0x%x)\n", __func__, partName,
-		//      *(uint64_t *)pentry, *attr);
 		attr_bak = pentry_bak + AB_FLAG_OFFSET;
-		switch (ab_attr) {
-		case ATTR_BOOT_SUCCESSFUL:
-			*attr = (*attr) | AB_PARTITION_ATTR_BOOT_SUCCESSFUL;
-			*attr_bak = (*attr_bak) | AB_PARTITION_ATTR_BOOT_SUCCESSFUL;
-			break;
-		case ATTR_UNBOOTABLE:
-			*attr = (*attr) | AB_PARTITION_ATTR_UNBOOTABLE;
-			*attr_bak = (*attr_bak) | AB_PARTITION_ATTR_UNBOOTABLE;
-			break;
-		case ATTR_BOOTABLE:
-			*attr = (*attr) ^ AB_PARTITION_ATTR_UNBOOTABLE;
-			*attr_bak = (*attr_bak) ^ AB_PARTITION_ATTR_UNBOOTABLE;
-			break;
-		case ATTR_SLOT_ACTIVE:
-			*attr = (*attr) | AB_PARTITION_ATTR_SLOT_ACTIVE;
-			*attr_bak = (*attr) | AB_PARTITION_ATTR_SLOT_ACTIVE;
-			break;
-		default:
-			fprintf(stderr, "%s: Unrecognized attr\n", __func__);
-			return -1;
-		}
+		*attr = (*attr & ~edit->clear[items[i].slot]) | edit->set[items[i].slot];
+		*attr_bak = (*attr_bak & ~edit->clear[items[i].slot]) | edit->set[items[i].slot];
 	}
 
 	if (gpt_disk_commit(disk)) {
-		fprintf(stderr, "%s: Failed to commit disk %s\n", __func__, disk->devpath);
+		LOGE("%s: Failed to commit disk %s\n", __func__, disk->devpath);
 		return -1;
 	}
 
@@ -269,10 +242,20 @@ static int update_slot_attribute(struct gpt_disk *disk, unsigned slot,
  *
  * This function will never return 1.
  */
+static int count_boot_ptn(const char *label, const char *disk, void *data)
+{
+	int *count = data;
+
+	(void)disk;
+	if (!strncmp(label, BOOT_IMG_PTN_NAME, strlen(BOOT_IMG_PTN_NAME)) &&
+	    !!strncmp(label, "boot_aging\n", strlen("boot_aging")))
+		(*count)++;
+
+	return 0;
+}
+
 unsigned get_number_slots()
 {
-	struct dirent *de = NULL;
-	DIR *dir_bootdev = NULL;
 	static int slot_count = 0;
 
 	// If we've already counted the slots, return the cached value.
@@ -283,27 +266,15 @@ unsigned get_number_slots()
 	assert(AB_SLOT_A_SUFFIX[0] == '_');
 	assert(AB_SLOT_B_SUFFIX[0] == '_');
 
-	dir_bootdev = opendir(BOOTDEV_DIR);
 	// Shouldn't this be an assert?
-	if (!dir_bootdev) {
-		fprintf(stderr, "%s: Failed to open bootdev dir (%s)\n", __func__, strerror(errno));
+	if (partlabel_for_each(count_boot_ptn, &slot_count) < 0) {
+		LOGE("%s: Failed to list partitions\n", __func__);
 		return 0;
 	}
 
-	while ((de = readdir(dir_bootdev))) {
-		if (de->d_name[0] == '.')
-			continue;
-		if (!strncmp(de->d_name, BOOT_IMG_PTN_NAME, strlen(BOOT_IMG_PTN_NAME)) &&
-		    !!strncmp(de->d_name, "boot_aging\n", strlen("boot_aging"))) {
-			slot_count++;
-		}
-	}
-
 	if (slot_count < 0)
 		slot_count = 0;
 
-	closedir(dir_bootdev);
-
 	return slot_count;
 }
 
@@ -311,7 +282,7 @@ static int boot_control_check_slot_sanity(unsigned slot)
 {
 	uint32_t num_slots = get_number_slots();
 	if ((num_slots < 1) || (slot > num_slots - 1)) {
-		fprintf(stderr, "Invalid slot number %u\n", slot);
+		LOGE("Invalid slot number %u\n", slot);
 		return -1;
 	}
 	return 0;
@@ -322,7 +293,7 @@ int get_boot_attr(struct gpt_disk *disk, unsigned slot, enum part_attr_type attr
 	char bootPartition[MAX_GPT_NAME_SIZE + 1] = { 0 };
 
 	if (boot_control_check_slot_sanity(slot) != 0) {
-		fprintf(stderr, "%s: Argument check failed\n", __func__);
+		LOGE("%s: Argument check failed\n", __func__);
 		return -1;
 	}
 
@@ -341,15 +312,18 @@ unsigned get_active_boot_slot()
 		return 0;
 	}
 
+	gpt_utils_lock(false);
 	for (uint32_t i = 0; i < num_slots; i++) {
 		if (get_boot_attr(&disk, i, ATTR_SLOT_ACTIVE)) {
 			gpt_disk_free(&disk);
+			gpt_utils_unlock();
 			return i;
 		}
 	}
 
-	fprintf(stderr, "%s: Failed to find the active boot slot\n", __func__);
+	LOGE("%s: Failed to find the active boot slot\n", __func__);
 	gpt_disk_free(&disk);
+	gpt_utils_unlock();
 	return 0;
 }
 
@@ -360,9 +334,14 @@ unsigned get_active_boot_slot()
  */
 static int get_current_or_active_slot()
 {
+	const struct boot_context *ctx = boot_context_get(true);
 	uint32_t num_slots = 0;
-	char bootSlotProp[MAX_CMDLINE_SIZE] = { '\0' };
-	unsigned i = 0;
+
+	// The bootloader only passes a slot suffix on A/B devices, so
+	// there's no need to count the slots first
+	if (ctx->slot >= 0 && ctx->slot < (int)ARRAY_SIZE(slot_suffix_arr) - 1)
+		return ctx->slot;
+
 	num_slots = get_number_slots();
 	if (num_slots == 0)
 		return -ENOENT;
@@ -371,21 +350,11 @@ static int get_current_or_active_slot()
 		return 0;
 	}
 
-	get_kernel_cmdline_arg(BOOT_SLOT_PROP, bootSlotProp, "N/A");
-	if (!strncmp(bootSlotProp, "N/A\n", strlen("N/A"))) {
-		fprintf(stderr, "%s: Unable to read boot slot property\n", __func__);
+	if (ctx->slot < 0) {
+		LOGW("%s: Unable to read boot slot property\n", __func__);
 		return get_active_boot_slot();
 	}
 
-	// Iterate through a list of partitons named as boot+suffix
-	// and see which one is currently active.
-	for (i = 0; slot_suffix_arr[i] != NULL; i++) {
-		if (!strncmp(bootSlotProp, slot_suffix_arr[i], strlen(slot_suffix_arr[i]))) {
-			// printf("%s current_slot = %d\n", __func__, i);
-			return i;
-		}
-	}
-
 	// The HAL spec requires that we return a number between
 	// 0 to num_slots - 1. Since something went wrong here we
 	// are just going to return the default slot.
@@ -397,47 +366,66 @@ int is_slot_bootable(unsigned slot)
 	int attr = 0;
 	struct gpt_disk disk = { 0 };
 
+	gpt_utils_lock(false);
 	attr = get_boot_attr(&disk, slot, ATTR_UNBOOTABLE);
+	gpt_disk_free(&disk);
+	gpt_utils_unlock();
 	if (attr >= 0)
 		return !attr;
 
 	return -1;
 }
 
-int mark_boot_successful(unsigned slot)
+// Add what marking slot successful changes to edit. Returns 1 if that
+// changes anything on disk, 0 if not and -1 on error.
+static int mark_successful_edit(struct gpt_disk *disk, unsigned slot,
+				struct slot_attr_edit *edit)
 {
-	struct gpt_disk disk = { 0 };
-	int successful = get_boot_attr(&disk, slot, ATTR_BOOT_SUCCESSFUL);
-	int unbootable = get_boot_attr(&disk, slot, ATTR_UNBOOTABLE);
-	int ret = 0;
+	int successful, unbootable;
+
+	if (boot_control_check_slot_sanity(slot) != 0)
+		return -1;
+
+	successful = get_boot_attr(disk, slot, ATTR_BOOT_SUCCESSFUL);
+	unbootable = get_boot_attr(disk, slot, ATTR_UNBOOTABLE);
 
 	if (successful < 0 || unbootable < 0) {
-		fprintf(stderr, "SLOT %s: Failed to read attributes\n", slot_suffix_arr[slot]);
-		ret = -1;
-		goto out;
+		LOGE("SLOT %s: Failed to read attributes\n", slot_suffix_arr[slot]);
+		return -1;
 	}
 
-	if (unbootable) {
+	if (unbootable)
 		printf("SLOT %s: was marked unbootable, fixing this"
 		       " (I hope you know what you're doing...)\n",
 		       slot_suffix_arr[slot]);
-		update_slot_attribute(&disk, slot, ATTR_BOOTABLE);
-	}
 
-	if (successful) {
-		fprintf(stderr, "SLOT %s: already marked successful\n", slot_suffix_arr[slot]);
-		goto out;
-	}
+	if (successful)
+		LOGW("SLOT %s: already marked successful\n", slot_suffix_arr[slot]);
 
-	if (update_slot_attribute(&disk, slot, ATTR_BOOT_SUCCESSFUL)) {
-		fprintf(stderr, "SLOT %s: Failed to mark boot successful\n", slot_suffix_arr[slot]);
+	// Clearing unbootable even if it isn't set on disk overrides an
+	// earlier edit setting it
+	slot_attr_edit_add(edit, slot, AB_PARTITION_ATTR_BOOT_SUCCESSFUL,
+			   AB_PARTITION_ATTR_UNBOOTABLE);
+
+	return !successful || unbootable;
+}
+
+int mark_boot_successful(unsigned slot)
+{
+	struct slot_attr_edit edit = { 0 };
+	struct gpt_disk disk = { 0 };
+	int ret;
+
+	gpt_utils_lock(true);
+	ret = mark_successful_edit(&disk, slot, &edit);
+	if (ret > 0 && update_slot_attributes(&disk, &edit)) {
+		LOGE("SLOT %s: Failed to mark boot successful\n", slot_suffix_arr[slot]);
 		ret = -1;
-		goto out;
 	}
 
-out:
 	gpt_disk_free(&disk);
-	return ret;
+	gpt_utils_unlock();
+	return ret < 0 ? -1 : 0;
 }
 
 const char *get_suffix(unsigned slot)
@@ -454,29 +442,28 @@ const char *get_suffix(unsigned slot)
 static int boot_ctl_set_active_slot_for_partitions(struct gpt_disk *disk,
 						   unsigned slot)
 {
-	char buf[GPT_PTN_PATH_MAX] = { 0 };
 	const char *slotA;
 	char slotB[MAX_GPT_NAME_SIZE] = { 0 };
 	char active_guid[TYPE_GUID_SIZE + 1] = { 0 };
 	char inactive_guid[TYPE_GUID_SIZE + 1] = { 0 };
-	int rc, i;
+	unsigned int i;
 	// Pointer to the partition entry of current 'A' partition
 	uint8_t *pentryA = NULL;
 	uint8_t *pentryA_bak = NULL;
 	// Pointer to partition entry of current 'B' partition
 	uint8_t *pentryB = NULL;
 	uint8_t *pentryB_bak = NULL;
-	struct stat st;
 
 	LOGD("Marking slot %s as active:\n", slot_suffix_arr[slot]);
 
-	for (i = 0, slotA = g_all_ptns[0]; i < ARRAY_SIZE(g_all_ptns); slotA = g_all_ptns[++i]) {
+	for (i = 0; i < ptn_profile_count(); i++) {
+		slotA = ptn_profile_ptn(i);
 		// Chop off the slot suffix from the partition name to
 		// make the string easier to work with.
 		LOGD("Part: %s\n", slotA);
 		int n = strlen(slotA) - strlen(AB_SLOT_A_SUFFIX);
 		if (n + 1 < 3 || n + 1 > MAX_GPT_NAME_SIZE) {
-			fprintf(stderr, "Invalid partition name: %s\n", slotA);
+			LOGE("Invalid partition name: %s\n", slotA);
 			return -1;
 		}
 
@@ -484,21 +471,17 @@ static int boot_ctl_set_active_slot_for_partitions(struct gpt_disk *disk,
 		strncat(slotB, slotA, MAX_GPT_NAME_SIZE - 1);
 		slotB[strlen(slotB) - 1] = 'b';
 
-		rc = snprintf(buf, sizeof(buf) - 1, "%s", BOOT_DEV_DIR);
-		snprintf(buf + rc, GPT_PTN_PATH_MAX - rc, "/%s", slotA);
-		LOGD("Checking for partition %s\n", buf);
-		if (stat(buf, &st)) {
-			if (!strcmp(slotA, "boot_a") || !strcmp(slotA, "dtbo_a")) {
-				fprintf(stderr, "Couldn't find required partition %s\n", slotA);
+		if (!ptn_profile_present(i, 0)) {
+			if (ptn_profile_required(i)) {
+				LOGE("Couldn't find required partition %s\n", slotA);
 				return -1;
 			}
 			// Not every device has every partition
 			continue;
 		}
 
-		buf[strlen(buf) - 1] = 'b';
-		if (stat(buf, &st)) {
-			fprintf(stderr, "Partition %s does not exist\n", buf);
+		if (!ptn_profile_present(i, 1)) {
+			LOGE("Partition %s does not exist\n", slotB);
 			return -1;
 		}
 
@@ -517,7 +500,7 @@ static int boot_ctl_set_active_slot_for_partitions(struct gpt_disk *disk,
 		if (!pentryA || !pentryA_bak || !pentryB || !pentryB_bak) {
 			// None of these should be NULL since we have already
 			// checked for A & B versions earlier.
-			fprintf(stderr, "Slot pentries for %s not found.\n", slotA);
+			LOGE("Slot pentries for %s not found.\n", slotA);
 			return -1;
 		}
 		LOGD("\tAB attr (A): 0x%x (backup: 0x%x)\n", *(uint16_t *)(pentryA + AB_FLAG_OFFSET),
@@ -535,7 +518,7 @@ static int boot_ctl_set_active_slot_for_partitions(struct gpt_disk *disk,
 			memcpy((void *)active_guid, (const void *)pentryB, TYPE_GUID_SIZE);
 			memcpy((void *)inactive_guid, (const void *)pentryA, TYPE_GUID_SIZE);
 		} else {
-			fprintf(stderr, "Both A & B are inactive..Aborting");
+			LOGE("Both A & B are inactive..Aborting\n");
 			return -1;
 		}
 		int a_state = slot == 0 ? SLOT_ACTIVE : SLOT_INACTIVE;
@@ -544,7 +527,7 @@ static int boot_ctl_set_active_slot_for_partitions(struct gpt_disk *disk,
 		// This check *Really* shouldn't be here... But I don't know this codebase
 		// well enough to remove it.
 		if (slot > 1) {
-			fprintf(stderr, "%s: Unknown slot %d!\n", __func__, slot);
+			LOGE("%s: Unknown slot %d!\n", __func__, slot);
 			return -1;
 		}
 
@@ -560,37 +543,79 @@ static int boot_ctl_set_active_slot_for_partitions(struct gpt_disk *disk,
 
 	// write updated content to disk
 	if (gpt_disk_commit(disk)) {
-		fprintf(stderr, "Failed to commit disk entry");
+		LOGE("Failed to commit disk entry\n");
 		return -1;
 	}
 
 	return 0;
 }
 
+static struct gpt_intent slot_intent;
+
+// Work out what switching to slot changes without writing anything,
+// and record it in the intent journal
+static int slot_intent_begin(unsigned slot, bool ignore_missing_bsg)
+{
+	struct gpt_disk disk = { 0 };
+	int rc;
+
+	memset(&slot_intent, 0, sizeof(slot_intent));
+	gpt_utils_set_intent(&slot_intent);
+	rc = boot_ctl_set_active_slot_for_partitions(&disk, slot);
+	gpt_disk_free(&disk);
+	// A LUN that is committed more than once only recorded the headers
+	// of its last commit, work them out from all of its entries
+	for (unsigned int i = 0; !rc && i < slot_intent.nr_luns; i++)
+		rc = gpt_utils_apply_intent(&slot_intent, i);
+	gpt_utils_set_intent(NULL);
+	if (rc)
+		return rc;
+
+	return intent_write(slot, ignore_missing_bsg, &slot_intent);
+}
+
 int set_active_boot_slot(unsigned slot, bool ignore_missing_bsg)
 {
 	enum boot_chain chain = (enum boot_chain)slot;
 	struct gpt_disk disk = { 0 };
+	bool journaled = false;
+	uint8_t boot_lun;
 	int rc;
 	bool ismmc;
 
 	if (boot_control_check_slot_sanity(slot)) {
-		fprintf(stderr, "%s: Bad arguments\n", __func__);
+		LOGE("%s: Bad arguments\n", __func__);
 		return -1;
 	}
 
-	ismmc = gpt_utils_is_partition_backed_by_emmc(PTN_XBL AB_SLOT_A_SUFFIX);
+	ismmc = ptn_profile_is_emmc();
 
 	// Do this *before* updating all the slot attributes
-	// to make sure we can
-	if (!ismmc && !ignore_missing_bsg && ufs_bsg_dev_open() < 0) {
+	// to make sure we can, a query round trip also makes sure
+	// the device is actually responding and not just present.
+	if (!ismmc && !ignore_missing_bsg &&
+	    (ufs_bsg_dev_open() < 0 || get_boot_lun(&boot_lun) < 0)) {
 		return -1;
 	}
 
-	rc = boot_ctl_set_active_slot_for_partitions(&disk, slot);
+	gpt_utils_lock(true);
+	if (!gpt_utils_is_dry_run()) {
+		journaled = !slot_intent_begin(slot, ignore_missing_bsg);
+		if (!journaled)
+			LOGW("%s: Switching without an intent record\n", __func__);
+	}
+
+	if (journaled) {
+		// Each LUN is written once, however many partitions it holds
+		rc = 0;
+		for (unsigned int i = 0; !rc && i < slot_intent.nr_luns; i++)
+			rc = gpt_utils_apply_intent(&slot_intent, i);
+	} else {
+		rc = boot_ctl_set_active_slot_for_partitions(&disk, slot);
+	}
 
 	if (rc) {
-		fprintf(stderr, "%s: Failed to set active slot for partitions \n", __func__);
+		LOGE("%s: Failed to set active slot for partitions \n", __func__);
 		goto out;
 	}
 
@@ -599,7 +624,7 @@ int set_active_boot_slot(unsigned slot, bool ignore_missing_bsg)
 		goto out;
 
 	if (chain > BACKUP_BOOT) {
-		fprintf(stderr, "%s: Unknown slot %d!\n", __func__, slot);
+		LOGE("%s: Unknown slot %d!\n", __func__, slot);
 		rc = -1;
 		goto out;
 	}
@@ -609,28 +634,165 @@ int set_active_boot_slot(unsigned slot, bool ignore_missing_bsg)
 		if (ignore_missing_bsg && rc == -ENODEV)
 			rc = 0;
 		else
-			fprintf(stderr, "%s: Failed to switch xbl boot partition\n", __func__);
+			LOGE("%s: Failed to switch xbl boot partition\n", __func__);
 	}
 
 out:
+	// Left in place on failure, so the next start finishes the switch
+	if (!rc && journaled)
+		intent_clear();
 	gpt_disk_free(&disk);
+	gpt_utils_unlock();
 	return rc;
 }
 
 int set_slot_as_unbootable(unsigned slot)
 {
+	struct slot_attr_edit edit = { 0 };
 	struct gpt_disk disk = { 0 };
 	int ret;
 
 	if (boot_control_check_slot_sanity(slot) != 0)
 		return -1;
 
-	ret = update_slot_attribute(&disk, slot, ATTR_UNBOOTABLE);
+	slot_attr_edit_add(&edit, slot, AB_PARTITION_ATTR_UNBOOTABLE, 0);
+	gpt_utils_lock(true);
+	ret = update_slot_attributes(&disk, &edit);
 
 	gpt_disk_free(&disk);
+	gpt_utils_unlock();
 	return ret;
 }
 
+int get_pending_slot_switch(unsigned *slot)
+{
+	bool ignore_missing_bsg;
+	int rc;
+
+	// A switch that is still running holds the lock exclusively
+	gpt_utils_lock(false);
+	rc = intent_read(slot, &ignore_missing_bsg, &slot_intent);
+	gpt_utils_unlock();
+
+	return rc;
+}
+
+int recover_slot_switch(void)
+{
+	unsigned int slot, incomplete = 0;
+	bool ignore_missing_bsg;
+	uint32_t crc[2];
+	uint8_t boot_lun;
+	int rc;
+
+	// Nothing to do is the common case, don't take the lock for it
+	rc = intent_read(&slot, &ignore_missing_bsg, &slot_intent);
+	if (rc <= 0)
+		return rc;
+
+	// Another process may have finished it meanwhile
+	gpt_utils_lock(true);
+	rc = intent_read(&slot, &ignore_missing_bsg, &slot_intent);
+	if (rc <= 0)
+		goto out;
+	if (boot_control_check_slot_sanity(slot)) {
+		intent_clear();
+		rc = 0;
+		goto out;
+	}
+
+	// A header is written after its entries, so one that matches means
+	// that copy is done. Only the LUNs that aren't are loaded and
+	// brought to what the record says.
+	for (unsigned int i = 0; i < slot_intent.nr_luns; i++) {
+		if (!gpt_utils_read_header_crcs(slot_intent.luns[i].devpath, crc) &&
+		    (!slot_intent.luns[i].hdr_crc[PRIMARY_GPT] ||
+		     crc[PRIMARY_GPT] == slot_intent.luns[i].hdr_crc[PRIMARY_GPT]) &&
+		    (!slot_intent.luns[i].hdr_crc[SECONDARY_GPT] ||
+		     crc[SECONDARY_GPT] == slot_intent.luns[i].hdr_crc[SECONDARY_GPT]))
+			continue;
+
+		LOGW("%s: %s wasn't switched to slot %s\n", __func__, slot_intent.luns[i].devpath,
+		     slot_suffix_arr[slot]);
+		incomplete++;
+		rc = gpt_utils_apply_intent(&slot_intent, i);
+		if (rc)
+			goto fail;
+	}
+
+	// The boot LUN is switched last. Like in set_active_boot_slot(),
+	// a switch started with ignore_missing_bsg is done without it if
+	// there's no UFS device.
+	if (!ptn_profile_is_emmc() && (get_boot_lun(&boot_lun) || boot_lun != slot + 1)) {
+		LOGW("%s: Boot LUN wasn't switched to slot %s\n", __func__, slot_suffix_arr[slot]);
+		rc = gpt_utils_set_xbl_boot_partition((enum boot_chain)slot);
+		if (ignore_missing_bsg && rc == -ENODEV)
+			rc = 0;
+		if (rc)
+			goto fail;
+	}
+
+	intent_clear();
+	LOGI("%s: Finished switching to slot %s, %u of %u LUNs were incomplete\n", __func__,
+	     slot_suffix_arr[slot], incomplete, slot_intent.nr_luns);
+	rc = 1;
+	goto out;
+
+fail:
+	LOGE("%s: Failed to finish switching to slot %s\n", __func__, slot_suffix_arr[slot]);
+	rc = -1;
+out:
+	gpt_utils_unlock();
+	return rc;
+}
+
+int bootctl_update_attributes(struct bootctl_attr_req *reqs, unsigned int nr)
+{
+	struct slot_attr_edit edit = { 0 };
+	struct gpt_disk disk = { 0 };
+	bool changed = false;
+	int rc, failed = 0;
+
+	gpt_utils_lock(true);
+	for (unsigned int i = 0; i < nr; i++) {
+		struct bootctl_attr_req *req = &reqs[i];
+
+		req->rc = -1;
+		switch (req->op) {
+		case BOOTCTL_ATTR_MARK_SUCCESSFUL:
+			rc = mark_successful_edit(&disk, req->slot, &edit);
+			if (rc < 0)
+				continue;
+			changed |= rc;
+			break;
+		case BOOTCTL_ATTR_SET_UNBOOTABLE:
+			if (boot_control_check_slot_sanity(req->slot) != 0)
+				continue;
+			slot_attr_edit_add(&edit, req->slot, AB_PARTITION_ATTR_UNBOOTABLE, 0);
+			changed = true;
+			break;
+		default:
+			continue;
+		}
+		req->rc = 0;
+	}
+
+	if (changed && update_slot_attributes(&disk, &edit)) {
+		LOGE("%s: Failed to commit %u attribute updates\n", __func__, nr);
+		for (unsigned int i = 0; i < nr; i++)
+			reqs[i].rc = -1;
+	}
+
+	gpt_disk_free(&disk);
+	gpt_utils_unlock();
+
+	for (unsigned int i = 0; i < nr; i++)
+		failed += reqs[i].rc < 0;
+	LOGD("%s: %u updates, %d failed\n", __func__, nr, failed);
+
+	return failed;
+}
+
 int is_slot_marked_successful(unsigned slot)
 {
 	int ret;
@@ -639,11 +801,28 @@ int is_slot_marked_successful(unsigned slot)
 	if (boot_control_check_slot_sanity(slot) != 0)
 		return -1;
 
+	gpt_utils_lock(false);
 	ret = get_boot_attr(&disk, slot, ATTR_BOOT_SUCCESSFUL);
 	gpt_disk_free(&disk);
+	gpt_utils_unlock();
 	return ret;
 }
 
+int get_xbl_boot_lun()
+{
+	uint8_t lun_id = 0;
+	int rc;
+
+	if (ptn_profile_is_emmc())
+		return -EOPNOTSUPP;
+
+	rc = get_boot_lun(&lun_id);
+	if (rc)
+		return rc < 0 ? rc : -EIO;
+
+	return lun_id;
+}
+
 const struct boot_control_module bootctl = {
 	.getCurrentSlot = get_current_or_active_slot,
 	.markBootSuccessful = mark_boot_successful,
@@ -653,4 +832,5 @@ const struct boot_control_module bootctl = {
 	.getSuffix = get_suffix,
 	.isSlotMarkedSuccessful = is_slot_marked_successful,
 	.getActiveBootSlot = get_active_boot_slot,
+	.getBootLun = get_xbl_boot_lun,
 };
@@ -28,6 +28,7 @@
  * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE /* O_DIRECT */
 #define _LARGEFILE64_SOURCE /* enable lseek64() */
 
 #include <assert.h>
@@ -43,21 +44,26 @@
 #include <linux/kernel.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "boot-cache.h"
 #include "gpt-utils.h"
-#include "utils.h"
+#include "ufs-bsg.h"
+#include "log.h"
 #include "crc32.h"
+#include "partlabel.h"
 
 /* list the names of the backed-up partitions to be swapped */
 /* extension used for the backup partitions - tzbak, abootbak, etc. */
 #define BAK_PTN_NAME_EXT "bak"
-#define XBL_PRIMARY	 "/dev/disk/by-partlabel/xbl_a" // FIXME
-#define XBL_BACKUP	 "/dev/disk/by-partlabel/xblbak"
-#define XBL_AB_PRIMARY	 "/dev/disk/by-partlabel/xbl_a"
-#define XBL_AB_SECONDARY "/dev/disk/by-partlabel/xbl_b"
+#define XBL_PRIMARY	 "xbl_a" // FIXME
+#define XBL_BACKUP	 "xblbak"
+#define XBL_AB_PRIMARY	 "xbl_a"
+#define XBL_AB_SECONDARY "xbl_b"
 /* GPT defines */
 #define MAX_LUNS 26
 // Size of the buffer that needs to be passed to the UFS ioctl
@@ -92,7 +98,15 @@
 	*((uint8_t *)(ptr) + 2) = ((y) >> 16) & 0xff;                                              \
 	*((uint8_t *)(ptr) + 3) = ((y) >> 24) & 0xff;
 
-enum gpt_state { GPT_OK = 0, GPT_BAD_SIGNATURE, GPT_BAD_CRC };
+#define PUT_8_BYTES(ptr, y)                                                                        \
+	PUT_4_BYTES(ptr, (uint64_t)(y) & 0xffffffff);                                              \
+	PUT_4_BYTES((uint8_t *)(ptr) + 4, (uint64_t)(y) >> 32);
+
+// Largest header we can check and the largest entry array we'll load,
+// 128 entries of 128 bytes is all anyone uses.
+#define GPT_HEADER_SIZE_MAX    4096
+#define GPT_PENTRY_ARR_SIZE_MAX (1024 * 1024)
+
 // List of LUN's containing boot critical images.
 // Required in the case of UFS devices
 struct update_data {
@@ -100,6 +114,35 @@ struct update_data {
 	uint32_t num_valid_entries;
 };
 
+// Block aligned, so the buffers can be used for O_DIRECT
+#define GPT_ARENA_ALIGN 4096
+
+// Used by every disk that doesn't bring its own arena
+static struct gpt_arena gpt_default_arena;
+
+static enum gpt_durability gpt_durability = GPT_DURABILITY_FULL;
+
+// Held by gpt_utils_lock(), gpt_lock_depth counts nested calls
+static int gpt_lock_fd = -1;
+static unsigned int gpt_lock_depth;
+
+// Time spent loading disks, only measured for --bench
+static uint64_t gpt_phase_nsec[GPT_NR_PHASES];
+static bool gpt_phase_timing;
+
+// Everything written to the disks so far, dry runs don't count
+static struct gpt_io_stats gpt_io_stats[MAX_LUNS];
+static unsigned int gpt_nr_io_stats;
+
+// LUNs written with GPT_DURABILITY_NONE that haven't been synced yet
+static char gpt_unsynced[MAX_LUNS][GPT_PTN_PATH_MAX];
+static unsigned int gpt_nr_unsynced;
+
+/* Set by gpt_utils_set_dry_run(), writes are recorded here instead */
+static struct gpt_plan *gpt_plan;
+/* Set by gpt_utils_set_intent(), commits are recorded here instead */
+static struct gpt_intent *gpt_intent;
+
 void DumpHex(const void *data, size_t size)
 {
 	char ascii[17];
@@ -150,8 +193,8 @@ static int blk_rw(int fd, int rw, uint64_t offset, uint8_t *buf, unsigned len)
 	int r;
 
 	if (lseek64(fd, offset, SEEK_SET) < 0) {
-		fprintf(stderr, "block dev lseek64 %" PRIu64 " failed: %s\n", offset,
-			strerror(errno));
+		LOGE("block dev lseek64 %" PRIu64 " failed: %s\n", offset,
+		     strerror(errno));
 		return -1;
 	}
 
@@ -161,13 +204,13 @@ static int blk_rw(int fd, int rw, uint64_t offset, uint8_t *buf, unsigned len)
 		r = read(fd, buf, len);
 
 	if (r < 0) {
-		fprintf(stderr, "block dev %s failed: %s\n", rw ? "write" : "read\n",
-			strerror(errno));
+		LOGE("block dev %s failed: %s\n", rw ? "write" : "read",
+		     strerror(errno));
 	} else {
-		if (rw) {
+		if (rw && gpt_durability == GPT_DURABILITY_FULL) {
 			r = fsync(fd);
 			if (r < 0)
-				fprintf(stderr, "fsync failed: %s\n", strerror(errno));
+				LOGE("fsync failed: %s\n", strerror(errno));
 		} else {
 			r = 0;
 		}
@@ -213,8 +256,266 @@ static uint8_t *gpt_pentry_seek(const char *ptn_name, const uint8_t *pentries_st
 	return NULL;
 }
 
-// Defined in ufs-bsg.cpp
-int32_t set_boot_lun(uint8_t lun_id);
+void gpt_utils_set_dry_run(struct gpt_plan *plan)
+{
+	gpt_plan = plan;
+}
+
+bool gpt_utils_is_dry_run(void)
+{
+	return gpt_plan;
+}
+
+void gpt_utils_set_intent(struct gpt_intent *intent)
+{
+	gpt_intent = intent;
+}
+
+void gpt_utils_set_durability(enum gpt_durability durability)
+{
+	gpt_durability = durability;
+}
+
+int gpt_utils_parse_durability(const char *str)
+{
+	if (!strcmp(str, "full"))
+		return GPT_DURABILITY_FULL;
+	if (!strcmp(str, "barrier"))
+		return GPT_DURABILITY_BARRIER;
+	if (!strcmp(str, "none"))
+		return GPT_DURABILITY_NONE;
+
+	return -1;
+}
+
+static int gpt_sync_path(const char *path)
+{
+	int fd, rc;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		LOGE("%s: Failed to open %s: %s\n", __func__, path, strerror(errno));
+		return -1;
+	}
+
+	rc = fsync(fd);
+	if (rc < 0)
+		LOGE("%s: fsync of %s failed: %s\n", __func__, path, strerror(errno));
+	close(fd);
+
+	return rc;
+}
+
+void gpt_utils_lock(bool exclusive)
+{
+	if (gpt_lock_depth++)
+		return;
+
+	if (mkdir(BOOT_CACHE_DIR, 0755) && errno != EEXIST) {
+		LOGD("%s: Failed to create %s: %s\n", __func__, BOOT_CACHE_DIR, strerror(errno));
+		return;
+	}
+
+	gpt_lock_fd = open(GPT_LOCK_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (gpt_lock_fd < 0) {
+		LOGD("%s: Failed to open %s: %s\n", __func__, GPT_LOCK_PATH, strerror(errno));
+		return;
+	}
+
+	while (flock(gpt_lock_fd, exclusive ? LOCK_EX : LOCK_SH) && errno == EINTR)
+		;
+}
+
+void gpt_utils_unlock(void)
+{
+	if (!gpt_lock_depth || --gpt_lock_depth)
+		return;
+
+	if (gpt_lock_fd >= 0)
+		close(gpt_lock_fd);
+	gpt_lock_fd = -1;
+}
+
+void gpt_utils_set_phase_timing(bool enable)
+{
+	gpt_phase_timing = enable;
+	memset(gpt_phase_nsec, 0, sizeof(gpt_phase_nsec));
+}
+
+void gpt_utils_take_phase_times(uint64_t nsec[GPT_NR_PHASES])
+{
+	memcpy(nsec, gpt_phase_nsec, sizeof(gpt_phase_nsec));
+	memset(gpt_phase_nsec, 0, sizeof(gpt_phase_nsec));
+}
+
+static uint64_t gpt_phase_start(void)
+{
+	struct timespec ts;
+
+	if (!gpt_phase_timing)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void gpt_phase_end(enum gpt_phase phase, uint64_t start)
+{
+	if (gpt_phase_timing)
+		gpt_phase_nsec[phase] += gpt_phase_start() - start;
+}
+
+// The last entry is shared by all LUNs past MAX_LUNS
+static struct gpt_io_stats *gpt_stats_for(const char *devpath)
+{
+	struct gpt_io_stats *stats;
+
+	for (unsigned int i = 0; i < gpt_nr_io_stats; i++)
+		if (!strcmp(gpt_io_stats[i].devpath, devpath))
+			return &gpt_io_stats[i];
+
+	if (gpt_nr_io_stats == MAX_LUNS)
+		return &gpt_io_stats[MAX_LUNS - 1];
+
+	stats = &gpt_io_stats[gpt_nr_io_stats++];
+	snprintf(stats->devpath, sizeof(stats->devpath), "%.*s", (int)sizeof(stats->devpath) - 1,
+		 devpath);
+
+	return stats;
+}
+
+unsigned int gpt_utils_io_stats(const struct gpt_io_stats **stats)
+{
+	*stats = gpt_io_stats;
+	return gpt_nr_io_stats;
+}
+
+uint64_t gpt_utils_bytes_written(void)
+{
+	uint64_t bytes = 0;
+
+	for (unsigned int i = 0; i < gpt_nr_io_stats; i++)
+		bytes += gpt_io_stats[i].bytes;
+
+	return bytes;
+}
+
+int gpt_utils_flush(void)
+{
+	int rc = 0;
+
+	for (unsigned int i = 0; i < gpt_nr_unsynced; i++) {
+		gpt_stats_for(gpt_unsynced[i])->fsyncs++;
+		if (gpt_sync_path(gpt_unsynced[i]))
+			rc = -1;
+	}
+	gpt_nr_unsynced = 0;
+
+	return rc;
+}
+
+// Remember disk for gpt_utils_flush(), or sync it right away if too
+// many LUNs are pending
+static int gpt_defer_sync(struct gpt_disk *disk, int fd)
+{
+	for (unsigned int i = 0; i < gpt_nr_unsynced; i++)
+		if (!strcmp(gpt_unsynced[i], disk->devpath))
+			return 0;
+
+	if (gpt_nr_unsynced == MAX_LUNS) {
+		gpt_stats_for(disk->devpath)->fsyncs++;
+		return fsync(fd);
+	}
+
+	snprintf(gpt_unsynced[gpt_nr_unsynced++], GPT_PTN_PATH_MAX, "%.*s",
+		 (int)GPT_PTN_PATH_MAX - 1, disk->devpath);
+
+	return 0;
+}
+
+// Write len bytes at offset of disk, or only record the write (and the
+// fsync blk_rw() might do after it) when doing a dry run.
+static int gpt_disk_write(struct gpt_disk *disk, int fd, const char *what, uint64_t offset,
+			  uint8_t *buf, unsigned len)
+{
+	struct gpt_plan_write *write;
+	struct gpt_io_stats *stats;
+
+	// O_DIRECT only takes whole blocks, the buffers are padded for it
+	if (disk->direct_io)
+		len = (len + disk->block_size - 1) / disk->block_size * disk->block_size;
+
+	if (!gpt_plan) {
+		stats = gpt_stats_for(disk->devpath);
+		stats->bytes += len;
+		if (gpt_durability == GPT_DURABILITY_FULL)
+			stats->fsyncs++;
+		return blk_rw(fd, 1, offset, buf, len);
+	}
+
+	if (gpt_plan->nr_writes < GPT_PLAN_MAX_WRITES) {
+		write = &gpt_plan->writes[gpt_plan->nr_writes];
+		snprintf(write->devpath, sizeof(write->devpath), "%.*s",
+			 (int)sizeof(write->devpath) - 1, disk->devpath);
+		write->what = what;
+		write->lba = offset / disk->block_size;
+		write->nr_blocks = (len + disk->block_size - 1) / disk->block_size;
+		write->len = len;
+	}
+	gpt_plan->nr_writes++;
+	if (gpt_durability == GPT_DURABILITY_FULL)
+		gpt_plan->nr_fsyncs++;
+	gpt_plan->bytes += len;
+
+	return 0;
+}
+
+// Record every entry of arr whose type GUID or AB attribute byte
+// differs from the on-disk copy. An entry that is planned more than
+// once (e.g. the disk is committed twice) is only listed once.
+static void gpt_plan_diff_entries(struct gpt_disk *disk, enum gpt_instance instance,
+				  const uint8_t *arr, const uint8_t *old_arr)
+{
+	struct gpt_plan_entry *entry;
+	const uint8_t *pentry, *old_pentry;
+	uint32_t i, j, count = disk->pentry_arr_size / disk->pentry_size;
+
+	for (i = 0; i < count; i++) {
+		pentry = arr + i * disk->pentry_size;
+		old_pentry = old_arr + i * disk->pentry_size;
+		if (!memcmp(pentry, old_pentry, TYPE_GUID_SIZE) &&
+		    pentry[AB_FLAG_OFFSET] == old_pentry[AB_FLAG_OFFSET])
+			continue;
+
+		for (j = 0; j < gpt_plan->nr_entries; j++) {
+			entry = &gpt_plan->entries[j];
+			if (entry->index == i && entry->instance == instance &&
+			    !strcmp(entry->devpath, disk->devpath))
+				break;
+		}
+
+		if (j == gpt_plan->nr_entries) {
+			if (j == GPT_PLAN_MAX_ENTRIES) {
+				LOGW("%s: Too many changed entries, not listing %s entry %u\n",
+				     __func__, disk->devpath, i);
+				continue;
+			}
+			entry = &gpt_plan->entries[gpt_plan->nr_entries++];
+			snprintf(entry->devpath, sizeof(entry->devpath), "%.*s",
+				 (int)sizeof(entry->devpath) - 1, disk->devpath);
+			entry->instance = instance;
+			entry->index = i;
+			entry->old_attr = old_pentry[AB_FLAG_OFFSET];
+			/* UTF-16, ignoring the 2nd byte as gpt_pentry_seek() does */
+			for (j = 0; j < sizeof(entry->name) - 1; j++)
+				entry->name[j] = pentry[PARTITION_NAME_OFFSET + j * 2];
+			entry->name[j] = '\0';
+		}
+
+		entry->new_attr = pentry[AB_FLAG_OFFSET];
+		entry->guid_changed |= !!memcmp(pentry, old_pentry, TYPE_GUID_SIZE);
+	}
+}
 
 // Switch between using either the primary or the backup
 // boot LUN for boot. This is required since UFS boot partitions
@@ -235,47 +536,48 @@ int32_t set_boot_lun(uint8_t lun_id);
 // the boot lun to either LUNA or LUNB
 int gpt_utils_set_xbl_boot_partition(enum boot_chain chain)
 {
-	struct stat st;
 	uint8_t boot_lun_id = 0;
-	const char *boot_dev = NULL;
 	int ret = -1;
 
-	(void)st;
-	(void)boot_dev;
-
 	if (chain == BACKUP_BOOT) {
 		boot_lun_id = BOOT_LUN_B_ID;
-		if (!stat(XBL_BACKUP, &st))
-			boot_dev = XBL_BACKUP;
-		else if (!stat(XBL_AB_SECONDARY, &st))
-			boot_dev = XBL_AB_SECONDARY;
-		else {
-			fprintf(stderr, "%s: Failed to locate secondary xbl\n", __func__);
+		if (!partlabel_exists(XBL_BACKUP) && !partlabel_exists(XBL_AB_SECONDARY)) {
+			LOGE("%s: Failed to locate secondary xbl\n", __func__);
 			goto error;
 		}
 	} else if (chain == NORMAL_BOOT) {
 		boot_lun_id = BOOT_LUN_A_ID;
-		if (!stat(XBL_PRIMARY, &st))
-			boot_dev = XBL_PRIMARY;
-		else if (!stat(XBL_AB_PRIMARY, &st))
-			boot_dev = XBL_AB_PRIMARY;
-		else {
-			fprintf(stderr, "%s: Failed to locate primary xbl\n", __func__);
+		if (!partlabel_exists(XBL_PRIMARY) && !partlabel_exists(XBL_AB_PRIMARY)) {
+			LOGE("%s: Failed to locate primary xbl\n", __func__);
 			goto error;
 		}
 	} else {
-		fprintf(stderr, "%s: Invalid boot chain id\n", __func__);
+		LOGE("%s: Invalid boot chain id\n", __func__);
 		goto error;
 	}
 	// We need either both xbl and xblbak or both xbl_a and xbl_b to exist at
 	// the same time. If not the current configuration is invalid.
-	if ((stat(XBL_PRIMARY, &st) || stat(XBL_BACKUP, &st)) &&
-	    (stat(XBL_AB_PRIMARY, &st) || stat(XBL_AB_SECONDARY, &st))) {
-		fprintf(stderr, "%s:primary/secondary XBL prt not found(%s)\n", __func__,
-			strerror(errno));
+	if ((!partlabel_exists(XBL_PRIMARY) || !partlabel_exists(XBL_BACKUP)) &&
+	    (!partlabel_exists(XBL_AB_PRIMARY) || !partlabel_exists(XBL_AB_SECONDARY))) {
+		LOGE("%s:primary/secondary XBL prt not found\n", __func__);
 		goto error;
 	}
-	LOGD("%s: setting %s lun as boot lun\n", __func__, boot_dev);
+	LOGD("%s: setting LUN %u as boot LUN\n", __func__, boot_lun_id);
+
+	if (gpt_plan) {
+		uint8_t cur_lun_id = 0;
+		int rc = get_boot_lun(&cur_lun_id);
+
+		// set_boot_lun() would fail the same way if the device
+		// isn't there, a failed read would still be followed by
+		// the write though.
+		if (rc == -ENODEV)
+			return -ENODEV;
+		gpt_plan->boot_lun_checked = true;
+		gpt_plan->boot_lun_cur = rc ? rc : cur_lun_id;
+		gpt_plan->boot_lun_new = boot_lun_id;
+		return 0;
+	}
 
 	if (set_boot_lun(boot_lun_id)) {
 		ret = -ENODEV;
@@ -293,31 +595,14 @@ error:
 // the path to the LUN from there.
 static int get_dev_path_from_partition_name(const char *partname, char *buf, size_t buflen)
 {
-	char path[GPT_PTN_PATH_MAX] = { 0 };
-	int i;
-
 	if (!partname || !buf || buflen < ((PATH_TRUNCATE_LOC) + 1)) {
-		fprintf(stderr, "%s: Invalid argument\n", __func__);
+		LOGE("%s: Invalid argument\n", __func__);
 		return -1;
 	}
 
 	// Need to find the lun that holds partition partname
-	snprintf(path, sizeof(path), "%s/%s", BOOT_DEV_DIR, partname);
-
-
-	buf = realpath(path, buf);
-	if (!buf) {
+	if (partlabel_resolve(partname, NULL, 0, buf, buflen))
 		return -1;
-	} else {
-		for (i = strlen(buf); i > 0; i--)
-			if (!isdigit(buf[i - 1]))
-				break;
-
-		if (i >= 2 && buf[i - 1] == 'p' && isdigit(buf[i - 2]))
-			i--;
-
-		buf[i] = 0;
-	}
 
 	return 0;
 }
@@ -325,16 +610,29 @@ static int get_dev_path_from_partition_name(const char *partname, char *buf, siz
 // Get the block size of the disk represented by decsriptor fd
 static uint32_t gpt_get_block_size(int fd)
 {
+	static const uint32_t image_sizes[] = { 512, 4096 };
+	char sig[sizeof(GPT_SIGNATURE) - 1];
 	uint32_t block_size = 0;
+	struct stat st;
 
 	if (fd < 0) {
-		fprintf(stderr, "%s: invalid descriptor\n", __func__);
+		LOGE("%s: invalid descriptor\n", __func__);
 		goto error;
 	}
 
+	// Image files have no block size of their own, go by where the
+	// primary header is
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		for (unsigned int i = 0; i < ARRAY_SIZE(image_sizes); i++) {
+			if (pread(fd, sig, sizeof(sig), image_sizes[i]) == sizeof(sig) &&
+			    !memcmp(sig, GPT_SIGNATURE, sizeof(sig)))
+				return image_sizes[i];
+		}
+	}
+
 	if (ioctl(fd, BLKSSZGET, &block_size) != 0) {
-		fprintf(stderr, "%s: Failed to get GPT dev block size : %s\n", __func__,
-			strerror(errno));
+		LOGE("%s: Failed to get GPT dev block size : %s\n", __func__,
+		     strerror(errno));
 		goto error;
 	}
 
@@ -345,20 +643,21 @@ error:
 
 // Write the GPT header present in the passed in buffer back to the
 // disk represented by fd
-static int gpt_set_header(uint8_t *gpt_header, int fd, enum gpt_instance instance)
+static int gpt_set_header(struct gpt_disk *disk, uint8_t *gpt_header, int fd,
+			  enum gpt_instance instance)
 {
 	uint32_t block_size = 0;
 	off_t gpt_header_offset = 0;
 
 	if (!gpt_header || fd < 0) {
-		fprintf(stderr, "%s: Invalid arguments\n", __func__);
+		LOGE("%s: Invalid arguments\n", __func__);
 		goto error;
 	}
 
 	block_size = gpt_get_block_size(fd);
 	LOGD("%s: Block size is : %d\n", __func__, block_size);
 	if (block_size == 0) {
-		fprintf(stderr, "%s: Failed to get block size\n", __func__);
+		LOGE("%s: Failed to get block size\n", __func__);
 		goto error;
 	}
 
@@ -367,13 +666,14 @@ static int gpt_set_header(uint8_t *gpt_header, int fd, enum gpt_instance instanc
 	else
 		gpt_header_offset = lseek64(fd, 0, SEEK_END) - block_size;
 	if (gpt_header_offset <= 0) {
-		fprintf(stderr, "%s: Failed to get gpt header offset\n", __func__);
+		LOGE("%s: Failed to get gpt header offset\n", __func__);
 		goto error;
 	}
 
 	LOGD("%s: Writing back header to offset %ld\n", __func__, gpt_header_offset);
-	if (blk_rw(fd, 1, gpt_header_offset, gpt_header, block_size)) {
-		fprintf(stderr, "%s: Failed to write back GPT header\n", __func__);
+	if (gpt_disk_write(disk, fd, instance == PRIMARY_GPT ? "primary header" : "backup header",
+			   gpt_header_offset, gpt_header, block_size)) {
+		LOGE("%s: Failed to write back GPT header\n", __func__);
 		goto error;
 	}
 
@@ -383,152 +683,138 @@ error:
 	return -1;
 }
 
-// Read out the GPT headers for the disk that contains the partition partname
-static int gpt_get_headers(const char *partname, uint8_t **primary, uint8_t **backup)
+// Read both GPT headers of the disk behind fd into primary and backup,
+// which are a block each
+static int gpt_get_headers(int fd, uint32_t block_size, uint8_t *primary, uint8_t *backup)
 {
-	uint8_t *hdr = NULL;
-	char devpath[GPT_PTN_PATH_MAX] = { 0 };
-	off_t hdr_offset = 0;
-	uint32_t block_size = 0;
-	int instance;
-	int fd = -1;
+	off_t hdr_offset;
 
-	if (!partname) {
-		fprintf(stderr, "%s: Invalid partition name\n", __func__);
-		goto error;
+	if (blk_rw(fd, 0, block_size, primary, block_size)) {
+		LOGE("%s: Failed to read primary GPT header from device\n", __func__);
+		return -1;
 	}
 
-	if (get_dev_path_from_partition_name(partname, devpath, sizeof(devpath)) != 0) {
-		fprintf(stderr, "%s: Failed to resolve path for %s\n", __func__, partname);
-		goto error;
+	hdr_offset = lseek64(fd, 0, SEEK_END) - block_size;
+	if (hdr_offset <= 0) {
+		LOGE("%s: Failed to get gpt header offset\n", __func__);
+		return -1;
+	}
+	if (blk_rw(fd, 0, hdr_offset, backup, block_size)) {
+		LOGE("%s: Failed to read backup GPT header from device\n", __func__);
+		return -1;
 	}
 
-	fd = open(devpath, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "%s: Failed to open %s : %s\n", __func__, devpath, strerror(errno));
+	return 0;
+}
+
+// Read the partition entry array described by the header hdr into
+// buf, which has to hold len bytes. The fd here is the descriptor
+// for the 'disk' which holds the partition
+static int gpt_get_pentry_arr(uint8_t *hdr, int fd, uint32_t block_size, uint8_t *buf,
+			      uint32_t len)
+{
+	uint64_t pentries_start = GET_8_BYTES(hdr + PENTRIES_OFFSET) * block_size;
+
+	if (blk_rw(fd, 0, pentries_start, buf, len)) {
+		LOGE("%s: Failed to read partition entry array\n", __func__);
 		return -1;
 	}
 
-	block_size = gpt_get_block_size(fd);
-	if (block_size == 0) {
-		fprintf(stderr, "%s: Failed to get gpt block size for %s\n", __func__, partname);
+	return 0;
+}
+
+// Write the blocks of the partition entry array arr whose CRC in crcs
+// differs from the one last read or written, coalescing adjacent
+// blocks into a single write.
+static int gpt_set_pentry_arr(struct gpt_disk *disk, uint8_t *hdr, int fd, uint8_t *arr,
+			      enum gpt_instance instance, const uint32_t *crcs)
+{
+	const char *what = instance == PRIMARY_GPT ? "primary entries" : "backup entries";
+	uint32_t *disk_crcs = disk->pentry_blk_crc[instance];
+	uint64_t pentries_start = 0;
+	uint32_t start, end, len;
+	int rc = 0;
+	if (!hdr || fd < 0 || !arr) {
+		LOGE("%s: Invalid argument\n", __func__);
 		goto error;
 	}
+	pentries_start = GET_8_BYTES(hdr + PENTRIES_OFFSET) * disk->block_size;
 
-	for (instance = PRIMARY_GPT; instance <= SECONDARY_GPT; instance++) {
-		hdr = (uint8_t *)calloc(block_size, 1);
-		if (!hdr) {
-			fprintf(stderr, "%s: Failed to allocate memory for gpt header\n", __func__);
-		}
-		if (instance == PRIMARY_GPT)
-			hdr_offset = block_size;
-		else {
-			hdr_offset = lseek64(fd, 0, SEEK_END) - block_size;
-		}
-		if (hdr_offset < 0) {
-			fprintf(stderr, "%s: Failed to get gpt header offset\n", __func__);
+	if (!disk->nr_pentry_blks) {
+		LOGD("%s: Writing partition entry array of size %d to offset %" PRIu64 "\n",
+		     __func__, disk->pentry_arr_size, pentries_start);
+		rc = gpt_disk_write(disk, fd, what, pentries_start, arr, disk->pentry_arr_size);
+		if (rc)
 			goto error;
+		disk_crcs[0] = crcs[0];
+		return 0;
+	}
+
+	for (start = 0; start < disk->nr_pentry_blks; start = end) {
+		for (end = start; end < disk->nr_pentry_blks && crcs[end] != disk_crcs[end]; end++)
+			;
+		if (end == start) {
+			end++;
+			continue;
 		}
-		if (blk_rw(fd, 0, hdr_offset, hdr, block_size)) {
-			fprintf(stderr, "%s: Failed to read GPT header from device\n", __func__);
+
+		len = (end - start) * disk->block_size;
+		if (start * disk->block_size + len > disk->pentry_arr_size)
+			len = disk->pentry_arr_size - start * disk->block_size;
+		LOGD("%s: Writing entry blocks %u-%u of %s\n", __func__, start, end - 1,
+		     disk->devpath);
+		rc = gpt_disk_write(disk, fd, what, pentries_start + start * disk->block_size,
+				    arr + start * disk->block_size, len);
+		if (rc)
 			goto error;
-		}
-		if (instance == PRIMARY_GPT)
-			*primary = hdr;
-		else
-			*backup = hdr;
+		memcpy(&disk_crcs[start], &crcs[start], (end - start) * sizeof(*crcs));
 	}
 
-	close(fd);
 	return 0;
-
 error:
-	close(fd);
-	if (hdr)
-		free(hdr);
+	LOGE("%s: Failed to write partition entry array\n", __func__);
 	return -1;
 }
 
-// Returns the partition entry array based on the
-// passed in buffer which contains the gpt header.
-// The fd here is the descriptor for the 'disk' which
-// holds the partition
-static uint8_t *gpt_get_pentry_arr(uint8_t *hdr, int fd)
+// Calculate the CRC of every block of the entry array arr. Returns
+// the number of blocks that differ from what's on disk.
+static uint32_t gpt_disk_dirty_blocks(struct gpt_disk *disk, enum gpt_instance instance,
+				      const uint8_t *arr, uint32_t *crcs)
 {
-	uint64_t pentries_start = 0;
-	uint32_t pentry_size = 0;
-	uint32_t block_size = 0;
-	uint32_t pentries_arr_size = 0;
-	uint8_t *pentry_arr = NULL;
-	int rc = 0;
-	if (!hdr) {
-		fprintf(stderr, "%s: Invalid header\n", __func__);
-		goto error;
-	}
-	if (fd < 0) {
-		fprintf(stderr, "%s: Invalid fd\n", __func__);
-		goto error;
-	}
-	block_size = gpt_get_block_size(fd);
-	if (!block_size) {
-		fprintf(stderr, "%s: Failed to get gpt block size for\n", __func__);
-		goto error;
-	}
-	pentries_start = GET_8_BYTES(hdr + PENTRIES_OFFSET) * block_size;
-	pentry_size = GET_4_BYTES(hdr + PENTRY_SIZE_OFFSET);
-	pentries_arr_size = GET_4_BYTES(hdr + PARTITION_COUNT_OFFSET) * pentry_size;
-	pentry_arr = (uint8_t *)calloc(1, pentries_arr_size);
-	if (!pentry_arr) {
-		fprintf(stderr, "%s: Failed to allocate memory for partition array\n", __func__);
-		goto error;
+	uint32_t i, len, dirty = 0;
+
+	// Not tracked per block, the first CRC covers the whole array
+	if (!disk->nr_pentry_blks) {
+		crcs[0] = efi_crc32(arr, disk->pentry_arr_size);
+		return crcs[0] != disk->pentry_blk_crc[instance][0];
 	}
-	rc = blk_rw(fd, 0, pentries_start, pentry_arr, pentries_arr_size);
-	if (rc) {
-		fprintf(stderr, "%s: Failed to read partition entry array\n", __func__);
-		goto error;
+
+	for (i = 0; i < disk->nr_pentry_blks; i++) {
+		len = disk->block_size;
+		if ((i + 1) * disk->block_size > disk->pentry_arr_size)
+			len = disk->pentry_arr_size - i * disk->block_size;
+		crcs[i] = efi_crc32(arr + i * disk->block_size, len);
+		if (crcs[i] != disk->pentry_blk_crc[instance][i])
+			dirty++;
 	}
-	return pentry_arr;
-error:
-	if (pentry_arr)
-		free(pentry_arr);
-	return NULL;
+
+	return dirty;
 }
 
-static int gpt_set_pentry_arr(uint8_t *hdr, int fd, uint8_t *arr)
+// Make the next commit rewrite every block of the instance array
+static void gpt_disk_mark_dirty(struct gpt_disk *disk, enum gpt_instance instance)
 {
-	uint32_t block_size = 0;
-	uint64_t pentries_start = 0;
-	uint32_t pentry_size = 0;
-	uint32_t pentries_arr_size = 0;
-	int rc = 0;
-	if (!hdr || fd < 0 || !arr) {
-		fprintf(stderr, "%s: Invalid argument\n", __func__);
-		goto error;
-	}
-	block_size = gpt_get_block_size(fd);
-	if (!block_size) {
-		fprintf(stderr, "%s: Failed to get gpt block size for\n", __func__);
-		goto error;
-	}
-	LOGD("%s : Block size is %d\n", __func__, block_size);
-	pentries_start = GET_8_BYTES(hdr + PENTRIES_OFFSET) * block_size;
-	pentry_size = GET_4_BYTES(hdr + PENTRY_SIZE_OFFSET);
-	pentries_arr_size = GET_4_BYTES(hdr + PARTITION_COUNT_OFFSET) * pentry_size;
-	LOGD("%s: Writing partition entry array of size %d to offset %" PRIu64 "\n", __func__,
-	     pentries_arr_size, pentries_start);
-	LOGD("pentries_start: %lu\n", pentries_start);
-	rc = blk_rw(fd, 1, pentries_start, arr, pentries_arr_size);
-	if (rc) {
-		fprintf(stderr, "%s: Failed to read partition entry array\n", __func__);
-		goto error;
-	}
-	return 0;
-error:
-	return -1;
+	uint8_t *arr = instance == PRIMARY_GPT ? disk->pentry_arr : disk->pentry_arr_bak;
+	uint32_t crcs[GPT_MAX_PENTRY_BLOCKS];
+
+	gpt_disk_dirty_blocks(disk, instance, arr, crcs);
+	for (uint32_t i = 0; i < (disk->nr_pentry_blks ?: 1); i++)
+		disk->pentry_blk_crc[instance][i] = ~crcs[i];
 }
 
 /*
- * Free previously allocated/initialized handle
+ * Drop the contents of a previously initialized handle. The buffers
+ * belong to the arena, which stays around for the next LUN.
  * This function is always safe and must be called
  * before discarding the handle.
  * it is called automatically by gpt_disk_get_disk_info()
@@ -538,26 +824,84 @@ void gpt_disk_free(struct gpt_disk *disk)
 	if (!disk)
 		return;
 
-	if (disk->hdr) {
-		free(disk->hdr);
-		disk->hdr = NULL;
-	}
-	if (disk->hdr_bak) {
-		free(disk->hdr_bak);
-		disk->hdr_bak = NULL;
-	}
-	if (disk->pentry_arr) {
-		free(disk->pentry_arr);
-		disk->pentry_arr = NULL;
+	disk->hdr = NULL;
+	disk->hdr_bak = NULL;
+	disk->pentry_arr = NULL;
+	disk->pentry_arr_bak = NULL;
+	// Don't let partition_is_for_disk() match a freed handle
+	disk->devpath[0] = '\0';
+	disk->is_initialized = 0;
+
+	return;
+}
+
+void gpt_arena_release(struct gpt_arena *arena)
+{
+	if (!arena)
+		arena = &gpt_default_arena;
+
+	free(arena->base);
+	memset(arena, 0, sizeof(*arena));
+}
+
+// Size of the entry array rounded up to whole blocks, which is how much
+// room it gets in the arena and how much is read from disk
+static uint32_t gpt_disk_arr_span(const struct gpt_disk *disk)
+{
+	return (disk->pentry_arr_size + disk->block_size - 1) / disk->block_size *
+	       disk->block_size;
+}
+
+// Open the disk, bypassing the page cache if it's a block device so
+// reads always see what's on the media. Image files (and block devices
+// that refuse O_DIRECT) go through the page cache as before.
+static int gpt_disk_open(struct gpt_disk *disk, int flags)
+{
+	struct stat st;
+	int fd;
+
+	disk->direct_io = !stat(disk->devpath, &st) && S_ISBLK(st.st_mode);
+	if (disk->direct_io) {
+		fd = open(disk->devpath, flags | O_DIRECT);
+		if (fd >= 0 || errno != EINVAL)
+			return fd;
+		LOGD("%s: %s doesn't support O_DIRECT\n", __func__, disk->devpath);
+		disk->direct_io = false;
 	}
-	if (disk->pentry_arr_bak) {
-		free(disk->pentry_arr_bak);
-		disk->pentry_arr_bak = NULL;
+
+	return open(disk->devpath, flags);
+}
+
+// Make sure arena holds at least size bytes aligned to align. The first
+// keep bytes are carried over if it has to grow.
+static int gpt_arena_reserve(struct gpt_arena *arena, size_t size, size_t align, size_t keep)
+{
+	void *buf;
+	int rc;
+
+	if (arena->base && size <= arena->size && align <= arena->align)
+		return 0;
+
+	if (size < arena->size)
+		size = arena->size;
+	if (align < arena->align)
+		align = arena->align;
+
+	rc = posix_memalign(&buf, align, size);
+	if (rc) {
+		LOGE("%s: Failed to allocate %zu bytes: %s\n", __func__, size, strerror(rc));
+		return -rc;
 	}
+	LOGD("%s: Grew GPT arena from %zu to %zu bytes\n", __func__, arena->size, size);
 
-	disk->is_initialized = 0;
+	if (keep)
+		memcpy(buf, arena->base, keep);
+	free(arena->base);
+	arena->base = buf;
+	arena->size = size;
+	arena->align = align;
 
-	return;
+	return 0;
 }
 
 bool gpt_disk_is_valid(struct gpt_disk *disk)
@@ -565,6 +909,121 @@ bool gpt_disk_is_valid(struct gpt_disk *disk)
 	return disk->is_initialized == GPT_DISK_INIT_MAGIC;
 }
 
+const char *gpt_state_str(enum gpt_state state)
+{
+	switch (state) {
+	case GPT_OK:
+		return "ok";
+	case GPT_BAD_SIGNATURE:
+		return "bad signature";
+	case GPT_BAD_CRC:
+		return "bad header";
+	case GPT_BAD_PENTRY_CRC:
+		return "bad entry array CRC";
+	}
+
+	return "unknown";
+}
+
+// CRC of a GPT header, calculated with its own CRC field set to 0
+static uint32_t gpt_header_crc(const uint8_t *hdr, uint32_t size)
+{
+	uint8_t buf[GPT_HEADER_SIZE_MAX];
+
+	memcpy(buf, hdr, size);
+	PUT_4_BYTES(buf + HEADER_CRC_OFFSET, 0);
+	return efi_crc32(buf, size);
+}
+
+static enum gpt_state gpt_check_header(const uint8_t *hdr, uint32_t block_size)
+{
+	uint32_t size = GET_4_BYTES(hdr + HEADER_SIZE_OFFSET);
+	uint32_t pentry_size = GET_4_BYTES(hdr + PENTRY_SIZE_OFFSET);
+	uint32_t count = GET_4_BYTES(hdr + PARTITION_COUNT_OFFSET);
+
+	if (memcmp(hdr, GPT_SIGNATURE, strlen(GPT_SIGNATURE)))
+		return GPT_BAD_SIGNATURE;
+
+	if (size < PARTITION_CRC_OFFSET + 4 || size > block_size || size > GPT_HEADER_SIZE_MAX ||
+	    gpt_header_crc(hdr, size) != GET_4_BYTES(hdr + HEADER_CRC_OFFSET))
+		return GPT_BAD_CRC;
+
+	// A matching CRC over nonsense is still nonsense
+	if (pentry_size < PTN_ENTRY_SIZE || pentry_size % 8 || !count ||
+	    (uint64_t)count * pentry_size > GPT_PENTRY_ARR_SIZE_MAX)
+		return GPT_BAD_CRC;
+
+	return GPT_OK;
+}
+
+int gpt_utils_read_header_crcs(const char *devpath, uint32_t crc[2])
+{
+	struct gpt_disk disk = { 0 };
+	uint8_t *hdrs = NULL;
+	int fd, rc = -1;
+
+	snprintf(disk.devpath, sizeof(disk.devpath), "%s", devpath);
+	fd = gpt_disk_open(&disk, O_RDONLY);
+	if (fd < 0) {
+		LOGE("%s: Failed to open %s: %s\n", __func__, devpath, strerror(errno));
+		return -1;
+	}
+
+	disk.block_size = gpt_get_block_size(fd);
+	if (!disk.block_size || posix_memalign((void **)&hdrs, GPT_ARENA_ALIGN, 2 * disk.block_size))
+		goto out;
+	if (gpt_get_headers(fd, disk.block_size, hdrs, hdrs + disk.block_size))
+		goto out;
+
+	for (int i = PRIMARY_GPT; i <= SECONDARY_GPT; i++) {
+		uint8_t *hdr = hdrs + i * disk.block_size;
+
+		crc[i] = gpt_check_header(hdr, disk.block_size) == GPT_OK ?
+				 GET_4_BYTES(hdr + HEADER_CRC_OFFSET) :
+				 0;
+	}
+	rc = 0;
+out:
+	free(hdrs);
+	close(fd);
+	return rc;
+}
+
+// Rebuild the header of instance from the other (valid) one. The
+// primary entries follow the primary header, the backup entries
+// precede the backup header in the last block of the disk.
+static int gpt_rebuild_header(struct gpt_disk *disk, enum gpt_instance instance, int fd)
+{
+	uint8_t *good = instance == PRIMARY_GPT ? disk->hdr_bak : disk->hdr;
+	uint8_t *hdr = instance == PRIMARY_GPT ? disk->hdr : disk->hdr_bak;
+	uint32_t arr_size = GET_4_BYTES(good + PARTITION_COUNT_OFFSET) *
+			    GET_4_BYTES(good + PENTRY_SIZE_OFFSET);
+	uint32_t arr_blocks = (arr_size + disk->block_size - 1) / disk->block_size;
+	uint32_t size = GET_4_BYTES(good + HEADER_SIZE_OFFSET);
+	off_t disk_size = lseek64(fd, 0, SEEK_END);
+	uint64_t last_lba;
+
+	if (disk_size <= 0) {
+		LOGE("%s: Failed to get the size of %s\n", __func__, disk->devpath);
+		return -1;
+	}
+	last_lba = disk_size / disk->block_size - 1;
+
+	memcpy(hdr, good, disk->block_size);
+	if (instance == PRIMARY_GPT) {
+		PUT_8_BYTES(hdr + PRIMARY_HEADER_OFFSET, 1);
+		PUT_8_BYTES(hdr + BACKUP_HEADER_OFFSET, last_lba);
+		PUT_8_BYTES(hdr + PENTRIES_OFFSET, 2);
+	} else {
+		PUT_8_BYTES(hdr + PRIMARY_HEADER_OFFSET, last_lba);
+		PUT_8_BYTES(hdr + BACKUP_HEADER_OFFSET, 1);
+		PUT_8_BYTES(hdr + PENTRIES_OFFSET, last_lba - arr_blocks);
+	}
+	PUT_4_BYTES(hdr + HEADER_CRC_OFFSET, gpt_header_crc(hdr, size));
+
+	return 0;
+}
+
 /*
  * Check if a partition by-path is for the disk we have info for
  * and populate the blockdev path.
@@ -576,7 +1035,7 @@ int partition_is_for_disk(const struct gpt_disk *disk, const char *part, char *b
 
 	ret = get_dev_path_from_partition_name(part, blockdev, blockdev_len);
 	if (ret) {
-		fprintf(stderr, "%s: Failed to resolve path for %s\n", __func__, part);
+		LOGE("%s: Failed to resolve path for %s\n", __func__, part);
 		return -1;
 	}
 
@@ -591,31 +1050,179 @@ int partition_is_for_disk(const struct gpt_disk *disk, const char *part, char *b
  * fills up the passed in gpt_disk struct with information about the
  * disk represented by path dev. Returns 0 on success and -1 on error.
  */
+// Read the GPT of the LUN devpath into disk
+static int gpt_disk_load(const char *devpath, struct gpt_disk *disk)
+{
+	int fd = -1, inst;
+	struct gpt_arena *arena;
+	uint32_t align, arr_span;
+	uint64_t start;
+
+	snprintf(disk->devpath, sizeof(disk->devpath), "%.*s", (int)sizeof(disk->devpath) - 1,
+		 devpath);
+
+	start = gpt_phase_start();
+	fd = gpt_disk_open(disk, O_RDONLY);
+	if (fd < 0) {
+		LOGE("%s: Failed to open %s: %s\n", __func__, disk->devpath,
+		     strerror(errno));
+		goto error;
+	}
+
+	disk->block_size = gpt_get_block_size(fd);
+	if (!disk->block_size)
+		goto error;
+
+	// Both headers go first, the entry arrays follow once their size
+	// is known
+	arena = disk->arena ? disk->arena : &gpt_default_arena;
+	align = disk->block_size > GPT_ARENA_ALIGN ? disk->block_size : GPT_ARENA_ALIGN;
+	if (gpt_arena_reserve(arena, 2 * disk->block_size, align, 0))
+		goto error;
+	disk->hdr = arena->base;
+	disk->hdr_bak = arena->base + disk->block_size;
+
+	if (gpt_get_headers(fd, disk->block_size, disk->hdr, disk->hdr_bak)) {
+		LOGE("%s: Failed to get GPT headers\n", __func__);
+		goto error;
+	}
+	gpt_phase_end(GPT_PHASE_HEADER, start);
+
+	start = gpt_phase_start();
+	disk->state[PRIMARY_GPT] = gpt_check_header(disk->hdr, disk->block_size);
+	disk->state[SECONDARY_GPT] = gpt_check_header(disk->hdr_bak, disk->block_size);
+	gpt_phase_end(GPT_PHASE_CRC, start);
+	// Two valid headers describing different arrays, trust the primary
+	if (!disk->state[PRIMARY_GPT] && !disk->state[SECONDARY_GPT] &&
+	    (GET_4_BYTES(disk->hdr + PARTITION_COUNT_OFFSET) !=
+		     GET_4_BYTES(disk->hdr_bak + PARTITION_COUNT_OFFSET) ||
+	     GET_4_BYTES(disk->hdr + PENTRY_SIZE_OFFSET) !=
+		     GET_4_BYTES(disk->hdr_bak + PENTRY_SIZE_OFFSET)))
+		disk->state[SECONDARY_GPT] = GPT_BAD_CRC;
+	if (disk->state[PRIMARY_GPT] && disk->state[SECONDARY_GPT]) {
+		LOGE("%s: No valid GPT header on %s (%s/%s)\n", __func__, disk->devpath,
+		     gpt_state_str(disk->state[PRIMARY_GPT]),
+		     gpt_state_str(disk->state[SECONDARY_GPT]));
+		goto error;
+	}
+
+	// Rebuild a damaged header from the good one, so the entry
+	// array can be read from where it is supposed to be.
+	for (inst = PRIMARY_GPT; inst <= SECONDARY_GPT; inst++) {
+		if (!disk->state[inst])
+			continue;
+		LOGW("%s: %s GPT header is damaged (%s), using the %s one\n", disk->devpath,
+		     inst == PRIMARY_GPT ? "Primary" : "Backup", gpt_state_str(disk->state[inst]),
+		     inst == PRIMARY_GPT ? "backup" : "primary");
+		if (gpt_rebuild_header(disk, inst, fd))
+			goto error;
+	}
+
+	disk->hdr_crc = GET_4_BYTES(disk->hdr + HEADER_CRC_OFFSET);
+	disk->hdr_bak_crc = GET_4_BYTES(disk->hdr_bak + HEADER_CRC_OFFSET);
+
+	disk->pentry_size = GET_4_BYTES(disk->hdr + PENTRY_SIZE_OFFSET);
+	disk->pentry_arr_size = GET_4_BYTES(disk->hdr + PARTITION_COUNT_OFFSET) * disk->pentry_size;
+	disk->pentry_arr_crc = GET_4_BYTES(disk->hdr + PARTITION_CRC_OFFSET);
+	disk->pentry_arr_bak_crc = GET_4_BYTES(disk->hdr_bak + PARTITION_CRC_OFFSET);
+
+	arr_span = gpt_disk_arr_span(disk);
+	if (gpt_arena_reserve(arena, 2 * disk->block_size + 2 * arr_span, align,
+			      2 * disk->block_size))
+		goto error;
+	disk->hdr = arena->base;
+	disk->hdr_bak = arena->base + disk->block_size;
+	disk->pentry_arr = arena->base + 2 * disk->block_size;
+	disk->pentry_arr_bak = disk->pentry_arr + arr_span;
+
+	start = gpt_phase_start();
+	if (gpt_get_pentry_arr(disk->hdr, fd, disk->block_size, disk->pentry_arr, arr_span)) {
+		LOGE("%s: Failed to obtain partition entry array\n", __func__);
+		goto error;
+	}
+
+	if (gpt_get_pentry_arr(disk->hdr_bak, fd, disk->block_size, disk->pentry_arr_bak,
+			       arr_span)) {
+		LOGE("%s: Failed to obtain backup partition entry array\n", __func__);
+		goto error;
+	}
+	close(fd);
+	fd = -1;
+	gpt_phase_end(GPT_PHASE_ENTRIES, start);
+
+	start = gpt_phase_start();
+	if (!disk->state[PRIMARY_GPT] &&
+	    efi_crc32(disk->pentry_arr, disk->pentry_arr_size) != disk->pentry_arr_crc)
+		disk->state[PRIMARY_GPT] = GPT_BAD_PENTRY_CRC;
+	if (!disk->state[SECONDARY_GPT] &&
+	    efi_crc32(disk->pentry_arr_bak, disk->pentry_arr_size) != disk->pentry_arr_bak_crc)
+		disk->state[SECONDARY_GPT] = GPT_BAD_PENTRY_CRC;
+	gpt_phase_end(GPT_PHASE_CRC, start);
+
+	if (disk->state[PRIMARY_GPT] && !disk->state[SECONDARY_GPT]) {
+		if (disk->state[PRIMARY_GPT] == GPT_BAD_PENTRY_CRC)
+			LOGW("%s: Primary GPT entries are damaged, using the backup ones\n",
+			     disk->devpath);
+		memcpy(disk->pentry_arr, disk->pentry_arr_bak, disk->pentry_arr_size);
+	} else if (disk->state[SECONDARY_GPT] && !disk->state[PRIMARY_GPT]) {
+		if (disk->state[SECONDARY_GPT] == GPT_BAD_PENTRY_CRC)
+			LOGW("%s: Backup GPT entries are damaged, using the primary ones\n",
+			     disk->devpath);
+		memcpy(disk->pentry_arr_bak, disk->pentry_arr, disk->pentry_arr_size);
+	} else if (disk->state[PRIMARY_GPT]) {
+		// Neither entry array matches its CRC, carry on with
+		// what we have like we always did.
+		LOGW("%s: Both GPT entry arrays are damaged\n", disk->devpath);
+	}
+
+	// Taken after replacing a bad array, so loading a LUN never leaves
+	// anything to commit. Writing a damaged copy back is up to
+	// gpt_disk_commit() and gpt_disk_repair().
+	start = gpt_phase_start();
+	disk->nr_pentry_blks = (disk->pentry_arr_size + disk->block_size - 1) / disk->block_size;
+	if (disk->nr_pentry_blks > GPT_MAX_PENTRY_BLOCKS)
+		disk->nr_pentry_blks = 0;
+	gpt_disk_dirty_blocks(disk, PRIMARY_GPT, disk->pentry_arr, disk->pentry_blk_crc[PRIMARY_GPT]);
+	gpt_disk_dirty_blocks(disk, SECONDARY_GPT, disk->pentry_arr_bak,
+			      disk->pentry_blk_crc[SECONDARY_GPT]);
+	gpt_phase_end(GPT_PHASE_CRC, start);
+
+	disk->is_initialized = GPT_DISK_INIT_MAGIC;
+	return 0;
+error:
+	if (fd >= 0)
+		close(fd);
+	gpt_disk_free(disk);
+	return -1;
+}
+
 int gpt_disk_get_disk_info(const char *dev, struct gpt_disk *disk)
 {
-	int fd = -1, rc;
-	uint32_t gpt_header_size = 0;
 	char devpath[GPT_PTN_PATH_MAX] = { 0 };
+	uint64_t start;
+	int rc;
 
 	if (!disk || !dev) {
-		fprintf(stderr, "%s: Invalid arguments\n", __func__);
-		goto error;
+		LOGE("%s: Invalid arguments\n", __func__);
+		return -1;
 	}
 
+	start = gpt_phase_start();
 	rc = partition_is_for_disk(disk, dev, devpath, sizeof(devpath));
+	gpt_phase_end(GPT_PHASE_RESOLVE, start);
 
 	if (rc > 0)
 		return 0;
 
 	if (rc < 0) {
-		fprintf(stderr, "%s: Failed to resolve path for %s\n", __func__, dev);
+		LOGE("%s: Failed to resolve path for %s\n", __func__, dev);
 		return -1;
 	}
 
 	if (disk->is_initialized == GPT_DISK_INIT_MAGIC) {
 		/* Commit any changes to the disk */
 		if (gpt_disk_commit(disk)) {
-			fprintf(stderr, "Failed to commit disk entry");
+			LOGE("Failed to commit disk entry\n");
 			return -1;
 		}
 		// We already have a valid disk handle. Free it.
@@ -626,56 +1233,7 @@ int gpt_disk_get_disk_info(const char *dev, struct gpt_disk *disk)
 	LOGD("%s: Initializing disk handle for %s... -> %s\n", __func__, disk->devpath, devpath);
 
 	// devpath popualted by partition_is_for_disk
-	strncpy(disk->devpath, devpath, sizeof(disk->devpath));
-
-	if (gpt_get_headers(dev, &disk->hdr, &disk->hdr_bak)) {
-		fprintf(stderr, "%s: Failed to get GPT headers\n", __func__);
-		goto error;
-	}
-
-	assert(disk->hdr != NULL);
-	assert(disk->hdr_bak != NULL);
-
-	gpt_header_size = GET_4_BYTES(disk->hdr + HEADER_SIZE_OFFSET);
-
-	// FIXME: pointer offsets crc bleh
-	disk->hdr_crc = efi_crc32(disk->hdr, gpt_header_size);
-
-	disk->hdr_bak_crc = efi_crc32(disk->hdr_bak, gpt_header_size);
-
-	fd = open(disk->devpath, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "%s: Failed to open %s: %s\n", __func__, disk->devpath,
-			strerror(errno));
-		goto error;
-	}
-
-	assert(disk->pentry_arr == NULL);
-	disk->pentry_arr = gpt_get_pentry_arr(disk->hdr, fd);
-	if (!disk->pentry_arr) {
-		fprintf(stderr, "%s: Failed to obtain partition entry array\n", __func__);
-		goto error;
-	}
-
-	assert(disk->pentry_arr_bak == NULL);
-	disk->pentry_arr_bak = gpt_get_pentry_arr(disk->hdr_bak, fd);
-	if (!disk->pentry_arr_bak) {
-		fprintf(stderr, "%s: Failed to obtain backup partition entry array\n", __func__);
-		goto error;
-	}
-
-	disk->pentry_size = GET_4_BYTES(disk->hdr + PENTRY_SIZE_OFFSET);
-	disk->pentry_arr_size = GET_4_BYTES(disk->hdr + PARTITION_COUNT_OFFSET) * disk->pentry_size;
-	disk->pentry_arr_crc = GET_4_BYTES(disk->hdr + PARTITION_CRC_OFFSET);
-	disk->pentry_arr_bak_crc = GET_4_BYTES(disk->hdr_bak + PARTITION_CRC_OFFSET);
-	disk->block_size = gpt_get_block_size(fd);
-	close(fd);
-	disk->is_initialized = GPT_DISK_INIT_MAGIC;
-	return 0;
-error:
-	if (fd >= 0)
-		close(fd);
-	return -1;
+	return gpt_disk_load(devpath, disk);
 }
 
 // Get pointer to partition entry from a allocated gpt_disk structure
@@ -683,7 +1241,7 @@ uint8_t *gpt_disk_get_pentry(struct gpt_disk *disk, const char *partname, enum g
 {
 	uint8_t *ptn_arr = NULL;
 	if (!disk || !partname || disk->is_initialized != GPT_DISK_INIT_MAGIC) {
-		fprintf(stderr, "%s: disk handle not initialised\n", __func__);
+		LOGE("%s: disk handle not initialised\n", __func__);
 		return NULL;
 	}
 	ptn_arr = (instance == PRIMARY_GPT) ? disk->pentry_arr : disk->pentry_arr_bak;
@@ -699,13 +1257,13 @@ static int gpt_disk_update_crc(struct gpt_disk *disk)
 {
 	uint32_t gpt_header_size = 0;
 	if (!disk || (disk->is_initialized != GPT_DISK_INIT_MAGIC)) {
-		fprintf(stderr, "%s: disk not initialised!\n", __func__);
+		LOGE("%s: disk not initialised!\n", __func__);
 		return -1;
 	}
 
-#ifdef DEBUG
 	uint32_t old_crc = disk->pentry_arr_crc;
-#endif
+	uint32_t old_bak_crc = disk->pentry_arr_bak_crc;
+
 	// Recalculate the CRC of the primary partiton array
 	disk->pentry_arr_crc = efi_crc32(disk->pentry_arr, disk->pentry_arr_size);
 	LOGD("%s() disk %8s GPT pentry len %u crc: %08x -> %08x\n", __func__, disk->devpath,
@@ -716,7 +1274,7 @@ static int gpt_disk_update_crc(struct gpt_disk *disk)
 	// Recalculate the CRC of the backup partition array
 	disk->pentry_arr_bak_crc = efi_crc32(disk->pentry_arr_bak, disk->pentry_arr_size);
 	LOGD("%s() disk %8s GPT pentry_bak len %u crc: %08x -> %08x\n", __func__, disk->devpath,
-	     disk->pentry_arr_size, old_crc, disk->pentry_arr_crc);
+	     disk->pentry_arr_size, old_bak_crc, disk->pentry_arr_bak_crc);
 
 	// Update the partition CRC value in the primary GPT header
 	PUT_4_BYTES(disk->hdr + PARTITION_CRC_OFFSET, disk->pentry_arr_crc);
@@ -737,68 +1295,419 @@ static int gpt_disk_update_crc(struct gpt_disk *disk)
 	return 0;
 }
 
+// Work out which entries a commit would change by comparing against
+// what's currently on the disk.
+static int gpt_plan_commit(struct gpt_disk *disk, int fd)
+{
+	uint32_t span = gpt_disk_arr_span(disk);
+	void *old_arr;
+	int rc = -1;
+
+	gpt_plan->nr_commits++;
+
+	// Aligned in case fd is O_DIRECT
+	if (posix_memalign(&old_arr, disk->arena ? disk->arena->align : gpt_default_arena.align,
+			   span)) {
+		LOGE("%s: Failed to allocate memory for partition array\n", __func__);
+		return -1;
+	}
+
+	if (gpt_get_pentry_arr(disk->hdr, fd, disk->block_size, old_arr, span))
+		goto out;
+	gpt_plan_diff_entries(disk, PRIMARY_GPT, disk->pentry_arr, old_arr);
+
+	if (gpt_get_pentry_arr(disk->hdr_bak, fd, disk->block_size, old_arr, span))
+		goto out;
+	gpt_plan_diff_entries(disk, SECONDARY_GPT, disk->pentry_arr_bak, old_arr);
+
+	rc = 0;
+out:
+	free(old_arr);
+	return rc;
+}
+
+// Record the type GUID and AB attribute byte of every entry that
+// differs from the on-disk copy, and the headers the commit leaves
+// behind. Committing a LUN again overrides what it recorded before.
+static int gpt_intent_commit(struct gpt_disk *disk, bool dirty, bool dirty_bak)
+{
+	uint32_t i, j, span = gpt_disk_arr_span(disk);
+	uint32_t count = disk->pentry_arr_size / disk->pentry_size;
+	const uint8_t *arr, *pentry, *old_pentry;
+	uint8_t *old_arr = NULL;
+	unsigned int lun;
+	int fd, inst, rc = -1;
+
+	for (lun = 0; lun < gpt_intent->nr_luns; lun++) {
+		if (!strcmp(gpt_intent->luns[lun].devpath, disk->devpath))
+			break;
+	}
+	if (lun == gpt_intent->nr_luns) {
+		if (lun == GPT_INTENT_MAX_LUNS) {
+			LOGE("%s: Too many LUNs\n", __func__);
+			return -1;
+		}
+		snprintf(gpt_intent->luns[lun].devpath, GPT_PTN_PATH_MAX, "%s", disk->devpath);
+		gpt_intent->nr_luns++;
+	}
+	gpt_intent->luns[lun].hdr_crc[PRIMARY_GPT] = dirty ? disk->hdr_crc : 0;
+	gpt_intent->luns[lun].hdr_crc[SECONDARY_GPT] = dirty_bak ? disk->hdr_bak_crc : 0;
+
+	fd = gpt_disk_open(disk, O_RDONLY);
+	if (fd < 0) {
+		LOGE("%s: Failed to open %s: %s\n", __func__, disk->devpath, strerror(errno));
+		return -1;
+	}
+
+	// Aligned in case fd is O_DIRECT
+	if (posix_memalign((void **)&old_arr,
+			   disk->arena ? disk->arena->align : gpt_default_arena.align, span)) {
+		LOGE("%s: Failed to allocate memory for partition array\n", __func__);
+		goto out;
+	}
+
+	for (inst = PRIMARY_GPT; inst <= SECONDARY_GPT; inst++) {
+		arr = inst == PRIMARY_GPT ? disk->pentry_arr : disk->pentry_arr_bak;
+		if (gpt_get_pentry_arr(inst == PRIMARY_GPT ? disk->hdr : disk->hdr_bak, fd,
+				       disk->block_size, old_arr, span))
+			goto out;
+
+		for (i = 0; i < count; i++) {
+			pentry = arr + i * disk->pentry_size;
+			old_pentry = old_arr + i * disk->pentry_size;
+			if (!memcmp(pentry, old_pentry, TYPE_GUID_SIZE) &&
+			    pentry[AB_FLAG_OFFSET] == old_pentry[AB_FLAG_OFFSET])
+				continue;
+
+			for (j = 0; j < gpt_intent->nr_entries; j++) {
+				if (gpt_intent->entries[j].lun == lun &&
+				    gpt_intent->entries[j].instance == inst &&
+				    gpt_intent->entries[j].index == i)
+					break;
+			}
+			if (j == gpt_intent->nr_entries) {
+				if (j == GPT_INTENT_MAX_ENTRIES) {
+					LOGE("%s: Too many changed entries\n", __func__);
+					goto out;
+				}
+				gpt_intent->entries[j].lun = lun;
+				gpt_intent->entries[j].instance = inst;
+				gpt_intent->entries[j].index = i;
+				gpt_intent->nr_entries++;
+			}
+			gpt_intent->entries[j].attr = pentry[AB_FLAG_OFFSET];
+			memcpy(gpt_intent->entries[j].type_guid, pentry + TYPE_GUID_OFFSET,
+			       TYPE_GUID_SIZE);
+		}
+	}
+
+	rc = 0;
+out:
+	free(old_arr);
+	close(fd);
+	return rc;
+}
+
 // Write the contents of struct gpt_disk back to the actual disk
 int gpt_disk_commit(struct gpt_disk *disk)
 {
+	uint32_t crcs[2][GPT_MAX_PENTRY_BLOCKS];
+	uint32_t dirty, dirty_bak;
 	int fd = -1;
 
 	if (!disk || (disk->is_initialized != GPT_DISK_INIT_MAGIC)) {
-		fprintf(stderr, "%s: Invalid args\n", __func__);
+		LOGE("%s: Invalid args\n", __func__);
 		goto error;
 	}
 
-	if (gpt_disk_update_crc(disk)) {
-		fprintf(stderr, "%s: Failed to update CRC values\n", __func__);
-		goto error;
+	dirty = gpt_disk_dirty_blocks(disk, PRIMARY_GPT, disk->pentry_arr, crcs[PRIMARY_GPT]);
+	dirty_bak = gpt_disk_dirty_blocks(disk, SECONDARY_GPT, disk->pentry_arr_bak,
+					  crcs[SECONDARY_GPT]);
+	if (!dirty && !dirty_bak) {
+		LOGD("%s: No changes to %s\n", __func__, disk->devpath);
+		return 0;
 	}
 
-	fd = open(disk->devpath, O_RDWR);
-	if (fd < 0) {
-		fprintf(stderr, "%s: Failed to open %s: %s\n", __func__, disk->devpath,
-			strerror(errno));
+	// A copy that was damaged when the LUN was loaded is written back
+	// in full along with the first change
+	for (int inst = PRIMARY_GPT; inst <= SECONDARY_GPT; inst++) {
+		if (!disk->state[inst] || disk->state[!inst])
+			continue;
+		gpt_disk_mark_dirty(disk, inst);
+		if (inst == PRIMARY_GPT)
+			dirty = gpt_disk_dirty_blocks(disk, inst, disk->pentry_arr, crcs[inst]);
+		else
+			dirty_bak = gpt_disk_dirty_blocks(disk, inst, disk->pentry_arr_bak,
+							  crcs[inst]);
+	}
+
+	if (gpt_disk_update_crc(disk)) {
+		LOGE("%s: Failed to update CRC values\n", __func__);
 		goto error;
 	}
 
-	LOGD("%s: Writing back primary GPT header\n", __func__);
+	if (gpt_intent)
+		return gpt_intent_commit(disk, dirty, dirty_bak);
 
-	// Write the primary header
-	if (gpt_set_header(disk->hdr, fd, PRIMARY_GPT) != 0) {
-		fprintf(stderr, "%s: Failed to update primary GPT header\n", __func__);
+	fd = gpt_disk_open(disk, gpt_plan ? O_RDONLY : O_RDWR);
+	if (fd < 0) {
+		LOGE("%s: Failed to open %s: %s\n", __func__, disk->devpath,
+		     strerror(errno));
 		goto error;
 	}
-	LOGD("%s: Writing back primary partition array\n", __func__);
 
-	// Write back the primary partition array
-	if (gpt_set_pentry_arr(disk->hdr, fd, disk->pentry_arr)) {
-		fprintf(stderr, "%s: Failed to write primary GPT partition arr\n", __func__);
+	if (gpt_plan && gpt_plan_commit(disk, fd)) {
+		LOGE("%s: Failed to compare against %s\n", __func__, disk->devpath);
 		goto error;
 	}
 
-	// Write the backup header
-	if (gpt_set_header(disk->hdr_bak, fd, SECONDARY_GPT) != 0) {
-		fprintf(stderr, "%s: Failed to update backup GPT header\n", __func__);
-		goto error;
+	if (dirty) {
+		LOGD("%s: Writing back primary GPT header and %u entry blocks\n", __func__, dirty);
+
+		// Write back the primary partition array
+		if (gpt_set_pentry_arr(disk, disk->hdr, fd, disk->pentry_arr, PRIMARY_GPT,
+				       crcs[PRIMARY_GPT])) {
+			LOGE("%s: Failed to write primary GPT partition arr\n", __func__);
+			goto error;
+		}
+
+		// Then the primary header, which makes the entries valid
+		if (gpt_set_header(disk, disk->hdr, fd, PRIMARY_GPT) != 0) {
+			LOGE("%s: Failed to update primary GPT header\n", __func__);
+			goto error;
+		}
 	}
-	LOGD("%s: Writing back backup partition array\n", __func__);
 
-	// Write back the backup partition array
-	if (gpt_set_pentry_arr(disk->hdr_bak, fd, disk->pentry_arr_bak)) {
-		fprintf(stderr, "%s: Failed to write backup GPT partition arr\n", __func__);
-		goto error;
+	if (dirty_bak) {
+		LOGD("%s: Writing back backup GPT header and %u entry blocks\n", __func__,
+		     dirty_bak);
+
+		// Write back the backup partition array
+		if (gpt_set_pentry_arr(disk, disk->hdr_bak, fd, disk->pentry_arr_bak,
+				       SECONDARY_GPT, crcs[SECONDARY_GPT])) {
+			LOGE("%s: Failed to write backup GPT partition arr\n", __func__);
+			goto error;
+		}
+
+		// Write the backup header
+		if (gpt_set_header(disk, disk->hdr_bak, fd, SECONDARY_GPT) != 0) {
+			LOGE("%s: Failed to update backup GPT header\n", __func__);
+			goto error;
+		}
 	}
 
 	LOGD("%s: Done\n", __func__);
 
-	fsync(fd);
+	if (!gpt_plan) {
+		gpt_stats_for(disk->devpath)->commits++;
+		// Both copies are intact on disk now
+		if (!disk->state[PRIMARY_GPT] || !disk->state[SECONDARY_GPT])
+			disk->state[PRIMARY_GPT] = disk->state[SECONDARY_GPT] = GPT_OK;
+	}
+
+	if (gpt_plan) {
+		if (gpt_durability != GPT_DURABILITY_NONE)
+			gpt_plan->nr_fsyncs++;
+	} else if (gpt_durability == GPT_DURABILITY_NONE) {
+		if (gpt_defer_sync(disk, fd))
+			goto sync_error;
+	} else {
+		gpt_stats_for(disk->devpath)->fsyncs++;
+		if (fsync(fd))
+			goto sync_error;
+	}
 	close(fd);
 	return 0;
 
+sync_error:
+	LOGE("%s: fsync of %s failed: %s\n", __func__, disk->devpath, strerror(errno));
 error:
 	if (fd >= 0)
 		close(fd);
 	return -1;
 }
 
+// Compare two partition entries 16 bytes at a time
+typedef uint64_t gpt_vec __attribute__((vector_size(16)));
+
+static bool gpt_pentry_equal(const uint8_t *a, const uint8_t *b, uint32_t size)
+{
+	gpt_vec diff = { 0 }, va, vb;
+	uint32_t i;
+
+	// Entry sizes are a multiple of 128 bytes
+	for (i = 0; i + sizeof(gpt_vec) <= size; i += sizeof(gpt_vec)) {
+		memcpy(&va, a + i, sizeof(va));
+		memcpy(&vb, b + i, sizeof(vb));
+		diff |= va ^ vb;
+	}
+
+	return !(diff[0] | diff[1]);
+}
+
+bool gpt_disk_verify(struct gpt_disk *disk, struct gpt_verify_result *result)
+{
+	const uint8_t *pentry, *pentry_bak;
+
+	memset(result, 0, sizeof(*result));
+	result->state[PRIMARY_GPT] = disk->state[PRIMARY_GPT];
+	result->state[SECONDARY_GPT] = disk->state[SECONDARY_GPT];
+	result->nr_entries = disk->pentry_arr_size / disk->pentry_size;
+
+	// A damaged copy was already replaced with the good one in
+	// memory, there is nothing to compare.
+	if (disk->state[PRIMARY_GPT] || disk->state[SECONDARY_GPT])
+		return false;
+
+	// Nearly always the case
+	if (!memcmp(disk->pentry_arr, disk->pentry_arr_bak, disk->pentry_arr_size))
+		return true;
+
+	for (uint32_t i = 0; i < result->nr_entries; i++) {
+		pentry = disk->pentry_arr + i * disk->pentry_size;
+		pentry_bak = disk->pentry_arr_bak + i * disk->pentry_size;
+		if (gpt_pentry_equal(pentry, pentry_bak, disk->pentry_size))
+			continue;
+		if (result->nr_divergent < GPT_VERIFY_MAX_DIVERGENT)
+			result->divergent[result->nr_divergent] = i;
+		result->nr_divergent++;
+	}
+
+	return !result->nr_divergent;
+}
+
+int gpt_disk_repair(struct gpt_disk *disk, const struct gpt_verify_result *result)
+{
+	uint8_t *pentry, *pentry_bak;
+	int repaired = 0;
+
+	// Without a good copy there is nothing to go by
+	if (result->state[PRIMARY_GPT] && result->state[SECONDARY_GPT]) {
+		LOGE("%s: Both GPT copies are damaged, not repairing\n", disk->devpath);
+		return -EIO;
+	}
+
+	for (int inst = PRIMARY_GPT; inst <= SECONDARY_GPT; inst++) {
+		if (!result->state[inst])
+			continue;
+		LOGI("%s: Rewriting %s GPT (%s)\n", disk->devpath,
+		     inst == PRIMARY_GPT ? "primary" : "backup", gpt_state_str(result->state[inst]));
+		gpt_disk_mark_dirty(disk, inst);
+		repaired++;
+	}
+
+	if (!result->nr_divergent)
+		return repaired;
+
+	for (uint32_t i = 0; i < result->nr_entries; i++) {
+		pentry = disk->pentry_arr + i * disk->pentry_size;
+		pentry_bak = disk->pentry_arr_bak + i * disk->pentry_size;
+		if (gpt_pentry_equal(pentry, pentry_bak, disk->pentry_size))
+			continue;
+		LOGI("%s: Copying entry %u to the backup GPT\n", disk->devpath, i);
+		memcpy(pentry_bak, pentry, disk->pentry_size);
+		repaired++;
+	}
+
+	return repaired;
+}
+
+int gpt_utils_apply_intent(struct gpt_intent *intent, unsigned int lun)
+{
+	struct gpt_disk disk = { 0 };
+	uint8_t *pentry;
+	uint32_t count;
+	int rc = -1;
+
+	if (lun >= intent->nr_luns) {
+		LOGE("%s: Invalid args\n", __func__);
+		return -1;
+	}
+
+	if (gpt_disk_load(intent->luns[lun].devpath, &disk))
+		return -1;
+
+	// A copy whose header wasn't written after its entries only looks
+	// damaged, rewrite it whether or not its entries change
+	for (int inst = PRIMARY_GPT; inst <= SECONDARY_GPT; inst++) {
+		if (disk.state[inst])
+			gpt_disk_mark_dirty(&disk, inst);
+	}
+
+	count = disk.pentry_arr_size / disk.pentry_size;
+	for (unsigned int i = 0; i < intent->nr_entries; i++) {
+		if (intent->entries[i].lun != lun)
+			continue;
+		if (intent->entries[i].index >= count) {
+			LOGE("%s: %s has no entry %u\n", __func__, disk.devpath,
+			     intent->entries[i].index);
+			goto out;
+		}
+		pentry = intent->entries[i].instance == PRIMARY_GPT ? disk.pentry_arr :
+								      disk.pentry_arr_bak;
+		pentry += intent->entries[i].index * disk.pentry_size;
+		memcpy(pentry + TYPE_GUID_OFFSET, intent->entries[i].type_guid, TYPE_GUID_SIZE);
+		pentry[AB_FLAG_OFFSET] = intent->entries[i].attr;
+	}
+
+	// Nothing is committed if the LUN already is as intended
+	if (gpt_intent == intent) {
+		intent->luns[lun].hdr_crc[PRIMARY_GPT] = 0;
+		intent->luns[lun].hdr_crc[SECONDARY_GPT] = 0;
+	}
+	rc = gpt_disk_commit(&disk);
+out:
+	gpt_disk_free(&disk);
+	return rc;
+}
+
+static int gpt_lun_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct gpt_lun *)a)->devpath, ((const struct gpt_lun *)b)->devpath);
+}
+
+struct gpt_lun_list {
+	struct gpt_lun *luns;
+	int nr;
+	int max;
+};
+
+static int gpt_lun_add(const char *label, const char *devpath, void *data)
+{
+	struct gpt_lun_list *list = data;
+	struct gpt_lun *lun;
+	int i;
+
+	for (i = 0; i < list->nr; i++)
+		if (!strcmp(list->luns[i].devpath, devpath))
+			return 0;
+
+	if (list->nr == list->max) {
+		LOGW("%s: More than %d LUNs, ignoring %s\n", __func__, list->max, devpath);
+		return 0;
+	}
+	lun = &list->luns[list->nr++];
+	snprintf(lun->devpath, sizeof(lun->devpath), "%.*s", (int)sizeof(lun->devpath) - 1,
+		 devpath);
+	snprintf(lun->part, sizeof(lun->part), "%.*s", (int)sizeof(lun->part) - 1, label);
+
+	return 0;
+}
+
+int gpt_utils_get_luns(struct gpt_lun *luns, int max)
+{
+	struct gpt_lun_list list = { .luns = luns, .max = max };
+	int rc;
+
+	rc = partlabel_for_each(gpt_lun_add, &list);
+	if (rc < 0)
+		return rc;
+
+	qsort(luns, list.nr, sizeof(*luns), gpt_lun_cmp);
+
+	return list.nr;
+}
+
 // Determine whether to handle the given partition as eMMC or UFS, using the
 // name of the backing device.
 //
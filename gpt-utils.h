@@ -74,18 +74,11 @@ extern "C" {
 #define AB_SLOT_A_SUFFIX		  "_a"
 #define AB_SLOT_B_SUFFIX		  "_b"
 #define PTN_XBL				  "xbl"
-// XBL is not included because the slot attributes are meaningless there
-// *which* XBL partition is active is determined via the UFS bBootLunEn field
-// as it needs to be handled by PBL
-#define PTN_SWAP_LIST \
-	"abl_a", "aop_a", "apdp_a", "cmnlib_a", "cmnlib64_a", "devcfg_a", "dtbo_a", \
-	"hyp_a", "keymaster_a", "msadp_a", "qupfw_a", "storsec_a", "tz_a", \
-	"vbmeta_a", "vbmeta_system_a"
-
-static const char g_all_ptns[][MAX_GPT_NAME_SIZE + 1] = {
-	PTN_SWAP_LIST, "boot_a", "system_a",
-	"vendor_a", "modem_a", "system_ext_a", "product_a"
-};
+// The A/B partitions to switch come from the partition profiles in
+// profiles/, see ptn-profile.h. XBL is never one of them because the
+// slot attributes are meaningless there: *which* XBL partition is active
+// is determined via the UFS bBootLunEn field as it needs to be handled
+// by PBL
 
 // No more than /dev/sdk
 #define MAX_BLOCK_DEVICES 10
@@ -100,8 +93,26 @@ static const char g_all_ptns[][MAX_GPT_NAME_SIZE + 1] = {
 
 enum gpt_instance { PRIMARY_GPT = 0, SECONDARY_GPT };
 
+enum gpt_state { GPT_OK = 0, GPT_BAD_SIGNATURE, GPT_BAD_CRC, GPT_BAD_PENTRY_CRC };
+
 enum boot_chain { NORMAL_BOOT = 0, BACKUP_BOOT };
 
+// 16K entry array with 512 byte blocks, larger arrays are always
+// written back in full
+#define GPT_MAX_PENTRY_BLOCKS 32
+
+/*
+ * Backing store for the headers and entry arrays of a gpt_disk: a single
+ * block aligned allocation that only ever grows and is reused for every
+ * LUN that's loaded, so switching LUNs doesn't allocate. Only one disk
+ * may use an arena at a time.
+ */
+struct gpt_arena {
+	uint8_t *base;
+	size_t size;
+	size_t align;
+};
+
 struct gpt_disk {
 	// GPT primary header
 	uint8_t *hdr;
@@ -124,16 +135,189 @@ struct gpt_disk {
 	// CRC of the backup partition entry array
 	uint32_t pentry_arr_bak_crc;
 	// Path to block dev representing the disk
-	char devpath[PATH_MAX];
+	char devpath[GPT_PTN_PATH_MAX];
 	// Block size of disk
 	uint32_t block_size;
+	// CRC of every block of the primary and backup entry arrays as
+	// they are on disk, so only changed blocks have to be written
+	uint32_t pentry_blk_crc[2][GPT_MAX_PENTRY_BLOCKS];
+	// Number of blocks in pentry_blk_crc, 0 if they aren't tracked
+	uint32_t nr_pentry_blks;
+	// State of the primary and backup copy as read from disk. A bad
+	// copy is replaced in memory by the good one, the next commit
+	// writes it back if its entries changed.
+	enum gpt_state state[2];
+	// Where the buffers above live, the shared arena if NULL
+	struct gpt_arena *arena;
+	// The disk is a block device opened with O_DIRECT, every read
+	// and write is a whole number of blocks
+	bool direct_io;
 	uint32_t is_initialized;
 };
 
+#define GPT_PLAN_MAX_ENTRIES 128
+#define GPT_PLAN_MAX_WRITES  64
+
+// A partition entry whose type GUID or AB attribute byte would change
+struct gpt_plan_entry {
+	char devpath[GPT_PTN_PATH_MAX];
+	char name[MAX_GPT_NAME_SIZE / 2 + 1];
+	enum gpt_instance instance;
+	uint32_t index;
+	uint8_t old_attr;
+	uint8_t new_attr;
+	bool guid_changed;
+};
+
+// A single write to a disk, in units of the disk's block size
+struct gpt_plan_write {
+	char devpath[GPT_PTN_PATH_MAX];
+	const char *what;
+	uint64_t lba;
+	uint32_t nr_blocks;
+	uint32_t len;
+};
+
+// Everything a modification would have written to the disks. Only the
+// first GPT_PLAN_MAX_* entries/writes are kept, the counters are always
+// complete.
+struct gpt_plan {
+	struct gpt_plan_entry entries[GPT_PLAN_MAX_ENTRIES];
+	unsigned int nr_entries;
+	struct gpt_plan_write writes[GPT_PLAN_MAX_WRITES];
+	unsigned int nr_writes;
+	unsigned int nr_commits;
+	unsigned int nr_fsyncs;
+	uint64_t bytes;
+
+	// UFS bBootLunEn, boot_lun_cur is -errno if it couldn't be read
+	bool boot_lun_checked;
+	int boot_lun_cur;
+	int boot_lun_new;
+};
+
+// How hard a commit works to get the GPT onto stable storage
+enum gpt_durability {
+	// fsync after every single write
+	GPT_DURABILITY_FULL = 0,
+	// One fsync per LUN once both copies are written
+	GPT_DURABILITY_BARRIER,
+	// No fsync at all, written LUNs are synced by gpt_utils_flush()
+	GPT_DURABILITY_NONE,
+};
+
+void gpt_utils_set_durability(enum gpt_durability durability);
+// Parse "full", "barrier" or "none", returns -1 for anything else
+int gpt_utils_parse_durability(const char *str);
+// fsync every LUN written with GPT_DURABILITY_NONE since the last flush
+int gpt_utils_flush(void);
+// Bytes of GPT headers and entry arrays written by this process
+uint64_t gpt_utils_bytes_written(void);
+
+// What this process wrote to one LUN, dry runs don't count
+struct gpt_io_stats {
+	char devpath[GPT_PTN_PATH_MAX];
+	uint32_t commits;
+	uint32_t fsyncs;
+	uint64_t bytes;
+};
+
+// Point stats at the per-LUN counters, returns the number of LUNs
+unsigned int gpt_utils_io_stats(const struct gpt_io_stats **stats);
+
+#ifndef GPT_LOCK_PATH
+#define GPT_LOCK_PATH "/run/qbootctl/gpt.lock"
+#endif
+
+// Serialise slot operations between processes, so that concurrent ones
+// always leave a state one of their serial orders would have. Writers
+// take the lock exclusively, readers shared. Calls nest; if the lock
+// file can't be created (no /run) this carries on unlocked.
+void gpt_utils_lock(bool exclusive);
+void gpt_utils_unlock(void);
+
+// Steps of gpt_disk_get_disk_info()
+enum gpt_phase {
+	// Partition label to disk
+	GPT_PHASE_RESOLVE = 0,
+	// Opening the disk and reading both headers
+	GPT_PHASE_HEADER,
+	// Reading both entry arrays
+	GPT_PHASE_ENTRIES,
+	// Checking the header and entry array CRCs
+	GPT_PHASE_CRC,
+	GPT_NR_PHASES,
+};
+
+// Measure the time spent in every phase from now on (or stop)
+void gpt_utils_set_phase_timing(bool enable);
+// Copy the time spent in every phase since the last call and reset it
+void gpt_utils_take_phase_times(uint64_t nsec[GPT_NR_PHASES]);
+
+// Record all writes (and the UFS boot LUN switch) in plan instead of
+// doing them. Pass NULL to go back to writing.
+void gpt_utils_set_dry_run(struct gpt_plan *plan);
+bool gpt_utils_is_dry_run(void);
+
+#define GPT_INTENT_MAX_LUNS 16
+#define GPT_INTENT_MAX_ENTRIES 256
+
+// What a set of commits will leave behind: the type GUID and AB
+// attribute byte of every entry they change, and the header CRCs of
+// every LUN. A CRC of 0 means that copy isn't written.
+struct gpt_intent {
+	struct {
+		char devpath[GPT_PTN_PATH_MAX];
+		uint32_t hdr_crc[2];
+	} luns[GPT_INTENT_MAX_LUNS];
+	unsigned int nr_luns;
+	struct {
+		uint8_t lun;
+		uint8_t instance;
+		uint16_t index;
+		uint8_t attr;
+		uint8_t type_guid[TYPE_GUID_SIZE];
+	} entries[GPT_INTENT_MAX_ENTRIES];
+	unsigned int nr_entries;
+};
+
+// Record every commit in intent instead of writing anything. Pass NULL
+// to go back to writing.
+void gpt_utils_set_intent(struct gpt_intent *intent);
+// Load LUN lun of intent, set every entry recorded for it and commit.
+// Applying it again changes nothing, so it also finishes a commit that
+// was interrupted. In intent mode this works out the header CRCs of
+// the LUN instead. Returns 0 or -1.
+int gpt_utils_apply_intent(struct gpt_intent *intent, unsigned int lun);
+// Read the CRC of both headers of the LUN devpath, a header that's
+// damaged reads as 0. Returns 0 or -1.
+int gpt_utils_read_header_crcs(const char *devpath, uint32_t crc[2]);
+
+#define GPT_VERIFY_MAX_DIVERGENT 16
+
+// Result of checking both GPT copies of a disk against each other
+struct gpt_verify_result {
+	enum gpt_state state[2];
+	uint32_t nr_entries;
+	// Entries that differ between the primary and backup array, only
+	// the first GPT_VERIFY_MAX_DIVERGENT indices are kept
+	uint32_t nr_divergent;
+	uint32_t divergent[GPT_VERIFY_MAX_DIVERGENT];
+};
+
+// A LUN with a GPT and one of the partitions on it
+struct gpt_lun {
+	char devpath[GPT_PTN_PATH_MAX];
+	char part[MAX_GPT_NAME_SIZE + 1];
+};
+
 // GPT disk methods
 bool gpt_disk_is_valid(struct gpt_disk *disk);
-// Free previously allocated gpt_disk struct
+// Drop the contents of disk, its arena is kept for the next load
 void gpt_disk_free(struct gpt_disk *disk);
+// Free the memory of arena (the shared one if NULL). No disk may be
+// using it.
+void gpt_arena_release(struct gpt_arena *arena);
 // Get the details of the disk holding the partition whose name
 // is passed in via dev
 int gpt_disk_get_disk_info(const char *dev, struct gpt_disk *disk);
@@ -144,9 +328,30 @@ int partition_is_for_disk(const struct gpt_disk *disk, const char *part, char *b
 uint8_t *gpt_disk_get_pentry(struct gpt_disk *disk, const char *partname,
 			     enum gpt_instance instance);
 
-// Write the contents of struct gpt_disk back to the actual disk
+// Write the contents of struct gpt_disk back to the actual disk, or
+// add them to the plan in dry-run mode. Only the changed blocks of the
+// entry arrays and their headers are written, nothing at all if the
+// disk wasn't changed. Each header is written after its entries, so a
+// header that checks out means its copy was written completely.
 int gpt_disk_commit(struct gpt_disk *disk);
 
+// Compare the primary and backup copy of disk. Returns true if both
+// are intact and identical.
+bool gpt_disk_verify(struct gpt_disk *disk, struct gpt_verify_result *result);
+
+// Fix up everything gpt_disk_verify() found: a damaged copy is rewritten
+// in full from the good one, divergent entries are copied from the
+// primary to the backup array. The changes are written by the next
+// gpt_disk_commit(). Returns the number of repaired items, or -EIO
+// without changing anything if neither copy is intact.
+int gpt_disk_repair(struct gpt_disk *disk, const struct gpt_verify_result *result);
+
+const char *gpt_state_str(enum gpt_state state);
+
+// Find every disk that has a labelled partition, sorted by path.
+// Returns the number of LUNs or -errno.
+int gpt_utils_get_luns(struct gpt_lun *luns, int max);
+
 // Swtich betwieen using either the primary or the backup
 // boot LUN for boot. This is required since UFS boot partitions
 // cannot have a backup GPT which is what we use for failsafe
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "intent.h"
+#include "log.h"
+
+#define INTENT_MAGIC 0x314e4951 // "QIN1"
+
+#define INTENT_IGNORE_MISSING_BSG (1 << 0)
+
+struct intent_record {
+	uint32_t magic;
+	// Over everything after this field
+	uint32_t crc;
+	uint32_t slot;
+	// INTENT_* flags
+	uint32_t flags;
+	uint32_t nr_luns;
+	struct {
+		char dev[64];
+		uint32_t hdr_crc[2];
+	} luns[GPT_INTENT_MAX_LUNS];
+	uint32_t nr_entries;
+	struct {
+		uint8_t lun;
+		uint8_t instance;
+		uint16_t index;
+		uint8_t attr;
+		uint8_t type_guid[TYPE_GUID_SIZE];
+	} entries[GPT_INTENT_MAX_ENTRIES];
+};
+
+static uint32_t intent_crc(const struct intent_record *rec)
+{
+	return efi_crc32(&rec->slot, sizeof(*rec) - offsetof(struct intent_record, slot));
+}
+
+// The file is emptied rather than removed once a switch is done, so
+// only creating it needs the directory synced
+static int intent_open(void)
+{
+	char dir[sizeof(INTENT_PATH)];
+	struct stat st;
+	int fd, dfd;
+
+	if (!stat(INTENT_PATH, &st))
+		return open(INTENT_PATH, O_WRONLY | O_TRUNC | O_CLOEXEC);
+
+	strcpy(dir, INTENT_PATH);
+	if (mkdir(dirname(dir), 0755) && errno != EEXIST)
+		return -1;
+
+	fd = open(INTENT_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd >= 0) {
+		fsync(dfd);
+		close(dfd);
+	}
+
+	return fd;
+}
+
+int intent_write(unsigned int slot, bool ignore_missing_bsg, const struct gpt_intent *intent)
+{
+	struct intent_record rec = { 0 };
+	int fd, rc = 0;
+
+	rec.slot = slot;
+	if (ignore_missing_bsg)
+		rec.flags |= INTENT_IGNORE_MISSING_BSG;
+	rec.nr_luns = intent->nr_luns;
+	for (unsigned int i = 0; i < intent->nr_luns; i++) {
+		if (strlen(intent->luns[i].devpath) >= sizeof(rec.luns[i].dev)) {
+			LOGE("%s: %s is too long\n", __func__, intent->luns[i].devpath);
+			return -ENAMETOOLONG;
+		}
+		strcpy(rec.luns[i].dev, intent->luns[i].devpath);
+		rec.luns[i].hdr_crc[0] = intent->luns[i].hdr_crc[0];
+		rec.luns[i].hdr_crc[1] = intent->luns[i].hdr_crc[1];
+	}
+	rec.nr_entries = intent->nr_entries;
+	for (unsigned int i = 0; i < intent->nr_entries; i++) {
+		rec.entries[i].lun = intent->entries[i].lun;
+		rec.entries[i].instance = intent->entries[i].instance;
+		rec.entries[i].index = intent->entries[i].index;
+		rec.entries[i].attr = intent->entries[i].attr;
+		memcpy(rec.entries[i].type_guid, intent->entries[i].type_guid, TYPE_GUID_SIZE);
+	}
+	rec.magic = INTENT_MAGIC;
+	rec.crc = intent_crc(&rec);
+
+	// A record torn by a power loss fails the CRC, and nothing was
+	// written to the LUNs yet in that case
+	fd = intent_open();
+	if (fd < 0) {
+		rc = -errno;
+		LOGW("%s: Failed to open %s: %s\n", __func__, INTENT_PATH, strerror(-rc));
+		return rc;
+	}
+	errno = 0;
+	if (write(fd, &rec, sizeof(rec)) != sizeof(rec) || fsync(fd)) {
+		rc = errno ? -errno : -EIO;
+		LOGW("%s: Failed to write %s: %s\n", __func__, INTENT_PATH, strerror(-rc));
+	}
+	close(fd);
+
+	return rc;
+}
+
+int intent_read(unsigned int *slot, bool *ignore_missing_bsg, struct gpt_intent *intent)
+{
+	struct intent_record rec;
+	ssize_t len;
+	int fd;
+
+	fd = open(INTENT_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -errno;
+	len = read(fd, &rec, sizeof(rec));
+	close(fd);
+	if (len < 0)
+		return -errno;
+	if (!len)
+		return 0;
+
+	if (len != sizeof(rec) || rec.magic != INTENT_MAGIC || rec.crc != intent_crc(&rec) ||
+	    rec.nr_luns > GPT_INTENT_MAX_LUNS || rec.nr_entries > GPT_INTENT_MAX_ENTRIES) {
+		LOGW("%s: Ignoring a damaged record\n", INTENT_PATH);
+		return 0;
+	}
+
+	*slot = rec.slot;
+	*ignore_missing_bsg = rec.flags & INTENT_IGNORE_MISSING_BSG;
+	intent->nr_luns = rec.nr_luns;
+	for (unsigned int i = 0; i < rec.nr_luns; i++) {
+		rec.luns[i].dev[sizeof(rec.luns[i].dev) - 1] = '\0';
+		snprintf(intent->luns[i].devpath, sizeof(intent->luns[i].devpath), "%s",
+			 rec.luns[i].dev);
+		intent->luns[i].hdr_crc[0] = rec.luns[i].hdr_crc[0];
+		intent->luns[i].hdr_crc[1] = rec.luns[i].hdr_crc[1];
+	}
+	intent->nr_entries = 0;
+	for (unsigned int i = 0; i < rec.nr_entries; i++) {
+		if (rec.entries[i].lun >= rec.nr_luns || rec.entries[i].instance > SECONDARY_GPT)
+			continue;
+		intent->entries[intent->nr_entries].lun = rec.entries[i].lun;
+		intent->entries[intent->nr_entries].instance = rec.entries[i].instance;
+		intent->entries[intent->nr_entries].index = rec.entries[i].index;
+		intent->entries[intent->nr_entries].attr = rec.entries[i].attr;
+		memcpy(intent->entries[intent->nr_entries].type_guid, rec.entries[i].type_guid,
+		       TYPE_GUID_SIZE);
+		intent->nr_entries++;
+	}
+
+	return 1;
+}
+
+void intent_clear(void)
+{
+	if (truncate(INTENT_PATH, 0) && errno != ENOENT)
+		LOGW("%s: Failed to clear %s: %s\n", __func__, INTENT_PATH, strerror(errno));
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __INTENT_H__
+#define __INTENT_H__
+
+#include <stdbool.h>
+
+#include "gpt-utils.h"
+
+/*
+ * A slot switch in progress: the target slot, the entries it changes
+ * and the header CRCs every LUN it touches will end up with. It's written and synced before the
+ * first LUN is, and emptied once the switch is complete, so a record
+ * found at startup means the switch was interrupted.
+ */
+#ifndef INTENT_PATH
+#define INTENT_PATH "/var/lib/qbootctl/intent"
+#endif
+
+// ignore_missing_bsg is what the switch was started with, recovery
+// has to treat a missing UFS device the same way.
+// Returns 0 once the record is on disk, or -errno.
+int intent_write(unsigned int slot, bool ignore_missing_bsg, const struct gpt_intent *intent);
+// Returns 1 and fills in slot, ignore_missing_bsg and intent if there
+// is a valid record, 0 if there's none and -errno if it can't be read.
+int intent_read(unsigned int *slot, bool *ignore_missing_bsg, struct gpt_intent *intent);
+void intent_clear(void);
+
+#endif // __INTENT_H__
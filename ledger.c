@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "gpt-utils.h"
+#include "ledger.h"
+#include "log.h"
+#include "ufs-bsg.h"
+
+#define LEDGER_MAGIC 0x314c4251 // "QBL1"
+// Past this the ledger is rewritten with one record per device
+#define LEDGER_COMPACT_SIZE (64 * 1024)
+#define LEDGER_MAX_DEVS	    (MAX_BLOCK_DEVICES * 4 + 1)
+
+struct ledger_record {
+	uint32_t magic;
+	// Over everything after this field
+	uint32_t crc;
+	// CLOCK_REALTIME seconds of the first run covered
+	uint64_t time;
+	char dev[32];
+	uint32_t runs;
+	uint32_t commits;
+	uint32_t fsyncs;
+	uint32_t ufs_writes;
+	uint64_t bytes;
+};
+
+// What this process has already appended, so a later append (or one in
+// a child after fork()) only adds what was written since
+static struct gpt_io_stats ledger_done[LEDGER_MAX_DEVS];
+static unsigned int ledger_ufs_done;
+
+static void ledger_record_seal(struct ledger_record *rec)
+{
+	rec->magic = LEDGER_MAGIC;
+	rec->crc = efi_crc32(&rec->time, sizeof(*rec) - offsetof(struct ledger_record, time));
+}
+
+static bool ledger_record_valid(const struct ledger_record *rec)
+{
+	return rec->magic == LEDGER_MAGIC &&
+	       rec->crc == efi_crc32(&rec->time,
+				     sizeof(*rec) - offsetof(struct ledger_record, time));
+}
+
+static void ledger_record_init(struct ledger_record *rec, const char *dev)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->time = time(NULL);
+	rec->runs = 1;
+	snprintf(rec->dev, sizeof(rec->dev), "%.*s", (int)sizeof(rec->dev) - 1, dev);
+}
+
+// Add rec to the matching total, or start a new one
+static int ledger_sum(struct ledger_total *totals, int nr, int max,
+		      const struct ledger_record *rec)
+{
+	struct ledger_total *t;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (!strncmp(totals[i].dev, rec->dev, sizeof(rec->dev)))
+			break;
+	if (i == nr) {
+		if (nr == max)
+			return nr;
+		t = &totals[nr++];
+		memset(t, 0, sizeof(*t));
+		memcpy(t->dev, rec->dev, sizeof(t->dev));
+		t->dev[sizeof(t->dev) - 1] = '\0';
+		t->since = rec->time;
+	}
+
+	t = &totals[i];
+	if (rec->time < t->since)
+		t->since = rec->time;
+	t->runs += rec->runs;
+	t->commits += rec->commits;
+	t->fsyncs += rec->fsyncs;
+	t->ufs_writes += rec->ufs_writes;
+	t->bytes += rec->bytes;
+
+	return nr;
+}
+
+int ledger_read(struct ledger_total *totals, int max)
+{
+	struct ledger_record recs[64];
+	ssize_t rc;
+	int fd, nr = 0;
+
+	fd = open(LEDGER_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -errno;
+
+	// Anything else that's damaged fails the CRC
+	while ((rc = read(fd, recs, sizeof(recs))) > 0)
+		for (size_t i = 0; i < rc / sizeof(recs[0]); i++)
+			if (ledger_record_valid(&recs[i]))
+				nr = ledger_sum(totals, nr, max, &recs[i]);
+			else
+				LOGW("%s: Skipping a damaged record\n", LEDGER_PATH);
+	close(fd);
+
+	return rc < 0 ? -errno : nr;
+}
+
+// Replace the ledger by its totals, so it never grows without bound
+static void ledger_compact(void)
+{
+	static struct ledger_total totals[LEDGER_MAX_DEVS];
+	struct ledger_record rec;
+	char tmp[sizeof(LEDGER_PATH) + 4];
+	int nr, fd;
+
+	nr = ledger_read(totals, LEDGER_MAX_DEVS);
+	if (nr < 0)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", LEDGER_PATH);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+
+	for (int i = 0; i < nr; i++) {
+		ledger_record_init(&rec, totals[i].dev);
+		rec.time = totals[i].since;
+		rec.runs = totals[i].runs;
+		rec.commits = totals[i].commits;
+		rec.fsyncs = totals[i].fsyncs;
+		rec.ufs_writes = totals[i].ufs_writes;
+		rec.bytes = totals[i].bytes;
+		ledger_record_seal(&rec);
+		if (write(fd, &rec, sizeof(rec)) != sizeof(rec))
+			goto error;
+	}
+
+	// The old ledger stays in place unless the new one made it to disk
+	if (fsync(fd) || close(fd) || rename(tmp, LEDGER_PATH)) {
+		fd = -1;
+		goto error;
+	}
+	LOGD("%s: Compacted to %d records\n", __func__, nr);
+	return;
+
+error:
+	LOGW("%s: Failed to compact %s\n", __func__, LEDGER_PATH);
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+}
+
+// Open and lock the ledger for appending, the lock also covers compaction
+static int ledger_open_locked(void)
+{
+	struct stat st, path_st;
+	int fd;
+
+	for (;;) {
+		fd = open(LEDGER_PATH, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return -errno;
+		if (flock(fd, LOCK_EX)) {
+			close(fd);
+			return -errno;
+		}
+
+		// Another run may have compacted (replaced) it while we waited
+		if (!fstat(fd, &st) && !stat(LEDGER_PATH, &path_st) && st.st_ino == path_st.st_ino)
+			return fd;
+		close(fd);
+	}
+}
+
+int ledger_append(void)
+{
+	struct ledger_record recs[LEDGER_MAX_DEVS];
+	const struct gpt_io_stats *stats;
+	char dir[sizeof(LEDGER_PATH)];
+	unsigned int nr_stats, nr = 0;
+	struct stat st;
+	ssize_t len;
+	int fd, rc;
+
+	nr_stats = gpt_utils_io_stats(&stats);
+	if (nr_stats > LEDGER_MAX_DEVS - 1)
+		nr_stats = LEDGER_MAX_DEVS - 1;
+	for (unsigned int i = 0; i < nr_stats; i++) {
+		if (stats[i].commits == ledger_done[i].commits &&
+		    stats[i].fsyncs == ledger_done[i].fsyncs && stats[i].bytes == ledger_done[i].bytes)
+			continue;
+		ledger_record_init(&recs[nr], stats[i].devpath);
+		recs[nr].commits = stats[i].commits - ledger_done[i].commits;
+		recs[nr].fsyncs = stats[i].fsyncs - ledger_done[i].fsyncs;
+		recs[nr].bytes = stats[i].bytes - ledger_done[i].bytes;
+		ledger_record_seal(&recs[nr++]);
+	}
+
+	if (ufs_bsg_attr_writes() != ledger_ufs_done) {
+		ledger_record_init(&recs[nr], ufs_bsg_discover(true));
+		recs[nr].ufs_writes = ufs_bsg_attr_writes() - ledger_ufs_done;
+		ledger_record_seal(&recs[nr++]);
+	}
+
+	if (!nr)
+		return 0;
+
+	strcpy(dir, LEDGER_PATH);
+	if (mkdir(dirname(dir), 0755) && errno != EEXIST) {
+		rc = -errno;
+		LOGW("%s: Failed to create %s: %s\n", __func__, dir, strerror(-rc));
+		return rc;
+	}
+
+	fd = ledger_open_locked();
+	if (fd < 0) {
+		LOGW("%s: Failed to open %s: %s\n", __func__, LEDGER_PATH, strerror(-fd));
+		return fd;
+	}
+
+	// Drop a record torn by a power loss, so the ones after it line up
+	if (!fstat(fd, &st) && st.st_size % sizeof(recs[0]) &&
+	    ftruncate(fd, st.st_size - st.st_size % sizeof(recs[0])))
+		LOGW("%s: Failed to drop a torn record: %s\n", __func__, strerror(errno));
+
+	len = write(fd, recs, nr * sizeof(recs[0]));
+	if (len != (ssize_t)(nr * sizeof(recs[0]))) {
+		LOGW("%s: Failed to append to %s\n", __func__, LEDGER_PATH);
+		close(fd);
+		return -EIO;
+	}
+
+	memcpy(ledger_done, stats, nr_stats * sizeof(*stats));
+	ledger_ufs_done = ufs_bsg_attr_writes();
+
+	if (!fstat(fd, &st) && st.st_size > LEDGER_COMPACT_SIZE)
+		ledger_compact();
+	close(fd);
+
+	return 0;
+}
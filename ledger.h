@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LEDGER_H__
+#define __LEDGER_H__
+
+#include <stdint.h>
+
+/*
+ * Everything qbootctl ever wrote, per LUN. Each run that wrote anything
+ * appends one fixed size record per LUN (and one for the UFS device);
+ * the totals are the sum of all valid records.
+ */
+#ifndef LEDGER_PATH
+#define LEDGER_PATH "/var/lib/qbootctl/ledger"
+#endif
+
+struct ledger_total {
+	char dev[32];
+	uint64_t since;
+	uint32_t runs;
+	uint32_t commits;
+	uint32_t fsyncs;
+	uint32_t ufs_writes;
+	uint64_t bytes;
+};
+
+// Append what this process wrote since the last call (or since it
+// started), does nothing if it didn't write. Returns 0 or -errno.
+int ledger_append(void);
+
+// Sum up the ledger per device, returns the number of devices or -errno.
+int ledger_read(struct ledger_total *totals, int max);
+
+#endif // __LEDGER_H__
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_JOURNAL
+#include <systemd/sd-journal.h>
+#endif
+
+#include "log.h"
+
+/*
+ * Info and debug records are queued in a fixed ring and only written
+ * out when the ring fills up or at exit, so the boot path doesn't pay
+ * for an unbuffered stderr write per line. Errors and warnings flush
+ * the ring right away, so they show up next to the output they relate
+ * to and aren't lost if the process is killed. The ring is shared with
+ * the bootctrl-async.c worker thread, log_lock covers it.
+ */
+#define LOG_RING_SIZE 64
+#define LOG_MSG_MAX   192
+
+struct log_record {
+	uint64_t ts_usec;
+	const char *func;
+	int level;
+	char msg[LOG_MSG_MAX];
+};
+
+int log_level = LOG_LEVEL_DEFAULT;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_record log_ring[LOG_RING_SIZE];
+static unsigned int log_count;
+static uint64_t log_start_usec;
+static bool log_registered;
+#ifdef HAVE_JOURNAL
+static bool log_journal;
+#endif
+
+static uint64_t log_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int log_parse_level(const char *str)
+{
+	static const struct {
+		const char *name;
+		int level;
+	} names[] = {
+		{ "err", LOG_ERR },	    { "error", LOG_ERR }, { "warn", LOG_WARNING },
+		{ "warning", LOG_WARNING }, { "info", LOG_INFO }, { "debug", LOG_DEBUG },
+	};
+	char *end;
+	long val;
+
+	for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+		if (!strcasecmp(str, names[i].name))
+			return names[i].level;
+
+	val = strtol(str, &end, 10);
+	if (end == str || *end)
+		return -1;
+
+	return val < LOG_ERR ? LOG_ERR : val > LOG_DEBUG ? LOG_DEBUG : (int)val;
+}
+
+static void log_register(void)
+{
+	if (log_registered)
+		return;
+
+	log_registered = true;
+	if (!log_start_usec)
+		log_start_usec = log_now_usec();
+	atexit(log_flush);
+}
+
+void log_init(int verbosity)
+{
+	const char *env;
+	int level;
+
+	// Skip LOG_NOTICE, it isn't used
+	log_level = verbosity <= 0 ? LOG_LEVEL_DEFAULT : verbosity == 1 ? LOG_INFO : LOG_DEBUG;
+
+	env = getenv(LOG_LEVEL_ENV);
+	if (env && *env) {
+		level = log_parse_level(env);
+		if (level < 0)
+			LOGW("Ignoring invalid %s='%s'\n", LOG_LEVEL_ENV, env);
+		else
+			log_level = level;
+	}
+
+	env = getenv(LOG_JOURNAL_ENV);
+#ifdef HAVE_JOURNAL
+	log_journal = env && *env && strcmp(env, "0");
+#else
+	if (env && *env && strcmp(env, "0"))
+		LOGW("Built without journal support, ignoring %s\n", LOG_JOURNAL_ENV);
+#endif
+
+	log_register();
+}
+
+static void log_flush_locked(void);
+
+void log_write(int level, const char *func, const char *fmt, ...)
+{
+	struct log_record *rec;
+	int len, saved_errno = errno;
+	va_list ap;
+
+	pthread_mutex_lock(&log_lock);
+	log_register();
+
+	if (log_count == LOG_RING_SIZE)
+		log_flush_locked();
+
+	rec = &log_ring[log_count++];
+	rec->ts_usec = log_now_usec();
+	rec->func = func;
+	rec->level = level;
+
+	va_start(ap, fmt);
+	len = vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+	va_end(ap);
+
+	if (len < 0)
+		len = 0;
+	else if (len >= (int)sizeof(rec->msg))
+		len = sizeof(rec->msg) - 1;
+
+	// Messages carry their own newline, strip it so every
+	// sink can terminate records the same way.
+	while (len > 0 && rec->msg[len - 1] == '\n')
+		rec->msg[--len] = '\0';
+
+	if (level <= LOG_WARNING)
+		log_flush_locked();
+	pthread_mutex_unlock(&log_lock);
+
+	// Callers often log before returning -errno
+	errno = saved_errno;
+}
+
+#ifdef HAVE_JOURNAL
+static void log_flush_journal(void)
+{
+	uint64_t prev = log_start_usec;
+
+	for (unsigned int i = 0; i < log_count; i++) {
+		struct log_record *rec = &log_ring[i];
+
+		sd_journal_send("MESSAGE=%s", rec->msg, "PRIORITY=%d", rec->level,
+				"CODE_FUNC=%s", rec->func, "SYSLOG_IDENTIFIER=qbootctl",
+				"QBOOTCTL_ELAPSED_USEC=%llu",
+				(unsigned long long)(rec->ts_usec - log_start_usec),
+				"QBOOTCTL_DELTA_USEC=%llu", (unsigned long long)(rec->ts_usec - prev),
+				NULL);
+		prev = rec->ts_usec;
+	}
+}
+#endif
+
+static void log_flush_locked(void)
+{
+	char buf[LOG_RING_SIZE * 32 + sizeof(log_ring[0].msg) * LOG_RING_SIZE];
+	size_t off = 0;
+
+	if (!log_count)
+		return;
+
+	for (unsigned int i = 0; i < log_count; i++) {
+		struct log_record *rec = &log_ring[i];
+		uint64_t elapsed = rec->ts_usec - log_start_usec;
+
+		// Timestamps are only interesting when debugging
+		if (log_level >= LOG_DEBUG)
+			off += snprintf(buf + off, sizeof(buf) - off, "[%4llu.%06llu] ",
+					(unsigned long long)(elapsed / 1000000),
+					(unsigned long long)(elapsed % 1000000));
+		off += snprintf(buf + off, sizeof(buf) - off, "%s\n", rec->msg);
+	}
+
+	fflush(stdout);
+	if (write(STDERR_FILENO, buf, off) < 0) {
+		// Nowhere left to report this
+	}
+
+#ifdef HAVE_JOURNAL
+	if (log_journal)
+		log_flush_journal();
+#endif
+
+	log_count = 0;
+}
+
+void log_flush(void)
+{
+	pthread_mutex_lock(&log_lock);
+	log_flush_locked();
+	pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdbool.h>
+#include <syslog.h>
+
+/*
+ * Log levels are the syslog priorities so that they can be handed to the
+ * journal as-is. Only LOG_ERR, LOG_WARNING, LOG_INFO and LOG_DEBUG are used.
+ */
+#define LOG_LEVEL_DEFAULT LOG_WARNING
+#define LOG_LEVEL_ENV	  "QBOOTCTL_LOG_LEVEL"
+#define LOG_JOURNAL_ENV	  "QBOOTCTL_LOG_JOURNAL"
+
+extern int log_level;
+
+// Raise the log level from LOG_LEVEL_DEFAULT by verbosity steps (info,
+// then debug), $QBOOTCTL_LOG_LEVEL takes precedence if set. Also enables
+// the journal sink if $QBOOTCTL_LOG_JOURNAL is set and journal support
+// was built in.
+void log_init(int verbosity);
+
+// Queue a record in the log ring, errors and warnings are written out
+// right away. Don't call this directly, use the LOG* macros so the level
+// check happens before any formatting. Preserves errno.
+void log_write(int level, const char *func, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+// Write out all queued records. Registered with atexit() on the first
+// log_write(), so callers usually don't need this.
+void log_flush(void);
+
+static inline bool log_enabled(int level)
+{
+	return level <= log_level;
+}
+
+#define LOG(level, fmt, ...)                                                                       \
+	do {                                                                                       \
+		if (log_enabled(level))                                                            \
+			log_write(level, __func__, fmt, ##__VA_ARGS__);                            \
+	} while (0)
+
+#define LOGE(fmt, ...) LOG(LOG_ERR, fmt, ##__VA_ARGS__)
+#define LOGW(fmt, ...) LOG(LOG_WARNING, fmt, ##__VA_ARGS__)
+#define LOGI(fmt, ...) LOG(LOG_INFO, fmt, ##__VA_ARGS__)
+#define LOGD(fmt, ...) LOG(LOG_DEBUG, fmt, ##__VA_ARGS__)
+
+#endif // __LOG_H__
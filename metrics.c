@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "boot-cache.h"
+#include "boot-context.h"
+#include "gpt-utils.h"
+#include "log.h"
+#include "metrics.h"
+#include "slot-audit.h"
+
+struct metrics_last_op {
+	char op[16];
+	int32_t rc;
+	uint32_t nr_ops;
+	// CLOCK_REALTIME seconds when the operation finished
+	uint64_t time;
+	uint64_t nsec;
+	uint64_t bytes;
+	// Summed over every operation of this boot
+	uint64_t bytes_total;
+};
+
+static struct timespec metrics_op_start;
+
+static uint64_t elapsed_nsec(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec - start->tv_nsec;
+}
+
+void metrics_op_begin(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &metrics_op_start);
+}
+
+void metrics_op_end(const char *op, int rc)
+{
+	struct metrics_last_op last = { 0 };
+	struct timespec end;
+	uint64_t bytes_total = 0;
+	uint32_t nr_ops = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	// Concurrent runs each add to the totals, so the read and the write
+	// back must not interleave
+	gpt_utils_lock(true);
+	if (!boot_cache_read(METRICS_LAST_OP_CACHE, &last, sizeof(last))) {
+		bytes_total = last.bytes_total;
+		nr_ops = last.nr_ops;
+	}
+
+	memset(&last, 0, sizeof(last));
+	snprintf(last.op, sizeof(last.op), "%s", op);
+	last.rc = rc < 0 ? rc : 0;
+	last.nr_ops = nr_ops + 1;
+	last.time = time(NULL);
+	last.nsec = elapsed_nsec(&metrics_op_start, &end);
+	last.bytes = gpt_utils_bytes_written();
+	last.bytes_total = bytes_total + last.bytes;
+
+	if (boot_cache_write(METRICS_LAST_OP_CACHE, &last, sizeof(last)))
+		LOGD("%s: Failed to record %s\n", __func__, op);
+	gpt_utils_unlock();
+}
+
+static void metric_header(FILE *f, const char *name, const char *type, const char *help)
+{
+	fprintf(f, "# TYPE qbootctl_%s %s\n# HELP qbootctl_%s %s\n", name, type, name, help);
+}
+
+static void metrics_write_slots(FILE *f, const struct slot_audit *audit)
+{
+	static const struct {
+		const char *name, *help;
+		uint8_t bit;
+		bool invert;
+	} slot_metrics[] = {
+		{ "slot_active", "Whether the slot is marked active.",
+		  AB_PARTITION_ATTR_SLOT_ACTIVE, false },
+		{ "slot_bootable", "Whether the slot is not marked unbootable.",
+		  AB_PARTITION_ATTR_UNBOOTABLE, true },
+		{ "slot_successful", "Whether the slot is marked as booted successfully.",
+		  AB_PARTITION_ATTR_BOOT_SUCCESSFUL, false },
+	};
+	static const char *const flags[] = { "active", "successful", "unbootable" };
+	static const uint8_t flag_bits[] = { AB_PARTITION_ATTR_SLOT_ACTIVE,
+					     AB_PARTITION_ATTR_BOOT_SUCCESSFUL,
+					     AB_PARTITION_ATTR_UNBOOTABLE };
+	const struct boot_context *ctx = boot_context_get(true);
+	unsigned int boot = audit->nr_pairs;
+	uint8_t attr;
+
+	// The slot state is the state of its boot partition
+	for (unsigned int i = 0; i < audit->nr_pairs; i++)
+		if (!strcmp(audit->name[i], "boot"))
+			boot = i;
+
+	for (unsigned int m = 0; boot < audit->nr_pairs && m < ARRAY_SIZE(slot_metrics); m++) {
+		metric_header(f, slot_metrics[m].name, "gauge", slot_metrics[m].help);
+		for (unsigned int s = 0; s < 2; s++) {
+			attr = audit->attr[s][boot];
+			fprintf(f, "qbootctl_%s{slot=\"_%c\"} %d\n", slot_metrics[m].name, 'a' + s,
+				!!(attr & slot_metrics[m].bit) ^ slot_metrics[m].invert);
+		}
+	}
+
+	if (ctx->slot >= 0) {
+		metric_header(f, "slot_current", "gauge", "Whether the slot was booted.");
+		for (unsigned int s = 0; s < 2; s++)
+			fprintf(f, "qbootctl_slot_current{slot=\"_%c\"} %d\n", 'a' + s,
+				ctx->slot == (int)s);
+	}
+
+	metric_header(f, "partition_flag", "gauge",
+		      "A/B attribute bits of the A and B partition of every managed pair.");
+	for (unsigned int i = 0; i < audit->nr_pairs; i++)
+		for (unsigned int s = 0; s < 2; s++)
+			for (unsigned int b = 0; b < ARRAY_SIZE(flags); b++)
+				fprintf(f,
+					"qbootctl_partition_flag{partition=\"%s\",slot=\"_%c\","
+					"lun=\"%s\",flag=\"%s\"} %d\n",
+					audit->name[i], 'a' + s, audit->devpath[i], flags[b],
+					!!(audit->attr[s][i] & flag_bits[b]));
+
+	metric_header(f, "partition_disagrees", "gauge",
+		      "Whether the pair disagrees with the rest of the slot, see --audit.");
+	for (unsigned int i = 0; i < audit->nr_pairs; i++)
+		fprintf(f, "qbootctl_partition_disagrees{partition=\"%s\",lun=\"%s\"} %d\n",
+			audit->name[i], audit->devpath[i], !!audit->bad[i]);
+}
+
+static void metrics_write_gpt(FILE *f, const struct slot_audit *audit)
+{
+	metric_header(f, "gpt_valid", "gauge",
+		      "Whether the header and entry array CRCs of the GPT copy are valid.");
+	for (unsigned int i = 0; i < audit->nr_luns; i++) {
+		fprintf(f, "qbootctl_gpt_valid{lun=\"%s\",copy=\"primary\"} %d\n", audit->lun[i],
+			audit->lun_state[i][PRIMARY_GPT] == GPT_OK);
+		fprintf(f, "qbootctl_gpt_valid{lun=\"%s\",copy=\"backup\"} %d\n", audit->lun[i],
+			audit->lun_state[i][SECONDARY_GPT] == GPT_OK);
+	}
+}
+
+static void metrics_write_last_op(FILE *f)
+{
+	struct metrics_last_op last;
+
+	if (boot_cache_read(METRICS_LAST_OP_CACHE, &last, sizeof(last)))
+		return;
+	last.op[sizeof(last.op) - 1] = '\0';
+
+	metric_header(f, "last_operation_timestamp_seconds", "gauge",
+		      "When the last write operation of this boot finished.");
+	fprintf(f, "qbootctl_last_operation_timestamp_seconds{op=\"%s\"} %" PRIu64 "\n", last.op,
+		last.time);
+	metric_header(f, "last_operation_duration_seconds", "gauge",
+		      "How long the last write operation of this boot took.");
+	fprintf(f, "qbootctl_last_operation_duration_seconds{op=\"%s\"} %.6f\n", last.op,
+		last.nsec / 1e9);
+	metric_header(f, "last_operation_written_bytes", "gauge",
+		      "GPT bytes written by the last write operation of this boot.");
+	fprintf(f, "qbootctl_last_operation_written_bytes{op=\"%s\"} %" PRIu64 "\n", last.op,
+		last.bytes);
+	metric_header(f, "last_operation_success", "gauge",
+		      "Whether the last write operation of this boot succeeded.");
+	fprintf(f, "qbootctl_last_operation_success{op=\"%s\"} %d\n", last.op, !last.rc);
+
+	metric_header(f, "operations", "counter", "Write operations in this boot.");
+	fprintf(f, "qbootctl_operations_total %" PRIu32 "\n", last.nr_ops);
+	metric_header(f, "written_bytes", "counter", "GPT bytes written in this boot.");
+	fprintf(f, "qbootctl_written_bytes_total %" PRIu64 "\n", last.bytes_total);
+}
+
+int metrics_write(FILE *f, int boot_lun)
+{
+	static struct slot_audit audit;
+	int rc;
+
+	rc = slot_audit_run(&audit);
+	if (rc < 0) {
+		LOGE("Failed to load the slot state: %s\n", strerror(-rc));
+		return rc;
+	}
+
+	metrics_write_slots(f, &audit);
+
+	// Not applicable on eMMC
+	if (boot_lun != -EOPNOTSUPP) {
+		metric_header(f, "boot_lun", "gauge",
+			      "UFS LUN XBL is booted from, 1 for A, 2 for B, -1 if unknown.");
+		fprintf(f, "qbootctl_boot_lun %d\n", boot_lun < 0 ? -1 : boot_lun);
+	}
+
+	metrics_write_gpt(f, &audit);
+	metrics_write_last_op(f);
+	fprintf(f, "# EOF\n");
+
+	return ferror(f) ? -EIO : 0;
+}
+
+int metrics_write_file(const char *path, int boot_lun)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+	int rc;
+
+	// The textfile collector only reads *.prom, so it never sees tmp
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "we");
+	if (!f) {
+		rc = -errno;
+		LOGE("Failed to open %s: %s\n", tmp, strerror(-rc));
+		return rc;
+	}
+
+	rc = metrics_write(f, boot_lun);
+	if (!rc && (fflush(f) || fsync(fileno(f))))
+		rc = -errno;
+	if (fclose(f) && !rc)
+		rc = -errno;
+	if (!rc && rename(tmp, path))
+		rc = -errno;
+
+	if (rc) {
+		LOGE("Failed to write %s: %s\n", path, strerror(-rc));
+		unlink(tmp);
+	}
+
+	return rc;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdio.h>
+
+/*
+ * OpenMetrics exposition of the slot state, the boot LUN, the GPT
+ * integrity of every LUN and the last write operation of this boot.
+ */
+#define METRICS_LAST_OP_CACHE "last-op"
+
+// Start timing a write operation
+void metrics_op_begin(void);
+// Record the operation started by metrics_op_begin() as the last one of
+// this boot, rc is its result.
+void metrics_op_end(const char *op, int rc);
+
+// Load every LUN once and print all metrics to f. boot_lun is what
+// getBootLun() returned. Returns 0 or -errno.
+int metrics_write(FILE *f, int boot_lun);
+// Like metrics_write(), but atomically replace the file at path, for
+// the node_exporter textfile collector.
+int metrics_write_file(const char *path, int boot_lun);
+
+#endif // __METRICS_H__
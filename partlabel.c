@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "gpt-utils.h"
+#include "log.h"
+#include "partlabel.h"
+
+// Overridable to run against disk images
+#ifndef PARTLABEL_SYS_BLOCK
+#define PARTLABEL_SYS_BLOCK "/sys/block"
+#endif
+#ifndef PARTLABEL_DEV_DIR
+#define PARTLABEL_DEV_DIR "/dev"
+#endif
+
+#define PARTLABEL_DISKS_MAX   32
+#define PARTLABEL_ENTRIES_MAX 256
+#define PARTLABEL_BLOCK_MAX   4096
+
+struct partlabel_entry {
+	char label[MAX_GPT_NAME_SIZE / 2 + 1];
+	uint8_t disk;
+	uint16_t partno;
+};
+
+#ifdef PARTLABEL_DEFAULT_SCAN
+static enum partlabel_source partlabel_source = PARTLABEL_SCAN;
+#else
+static enum partlabel_source partlabel_source = PARTLABEL_AUTO;
+#endif
+
+// Filled in by partlabel_scan()
+static char partlabel_disks[PARTLABEL_DISKS_MAX][GPT_PTN_PATH_MAX];
+static unsigned int partlabel_nr_disks;
+static struct partlabel_entry partlabel_entries[PARTLABEL_ENTRIES_MAX];
+static unsigned int partlabel_nr_entries;
+static bool partlabel_scanned;
+
+void partlabel_set_source(enum partlabel_source source)
+{
+	partlabel_source = source;
+}
+
+static enum partlabel_source partlabel_get_source(void)
+{
+	if (partlabel_source == PARTLABEL_AUTO) {
+		partlabel_source = access(BOOT_DEV_DIR, F_OK) ? PARTLABEL_SCAN : PARTLABEL_UDEV;
+		LOGD("%s: Finding partitions %s\n", __func__,
+		     partlabel_source == PARTLABEL_SCAN ? "by scanning disks" : "through udev");
+	}
+
+	return partlabel_source;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+// Read the entry array of the GPT whose header is at lba, if both the
+// header and the array are intact. The array is returned in *arr.
+static int partlabel_read_gpt(int fd, uint32_t block_size, uint64_t lba, uint8_t **arr,
+			      uint32_t *count, uint32_t *entry_size)
+{
+	uint8_t hdr[PARTLABEL_BLOCK_MAX];
+	uint32_t size, crc, len;
+
+	if (pread(fd, hdr, block_size, lba * block_size) != (ssize_t)block_size ||
+	    memcmp(hdr, GPT_SIGNATURE, strlen(GPT_SIGNATURE)))
+		return -EINVAL;
+
+	size = get_le32(hdr + HEADER_SIZE_OFFSET);
+	if (size < PARTITION_CRC_OFFSET + 4 || size > block_size)
+		return -EINVAL;
+	crc = get_le32(hdr + HEADER_CRC_OFFSET);
+	memset(hdr + HEADER_CRC_OFFSET, 0, 4);
+	if (efi_crc32(hdr, size) != crc)
+		return -EINVAL;
+
+	*count = get_le32(hdr + PARTITION_COUNT_OFFSET);
+	*entry_size = get_le32(hdr + PENTRY_SIZE_OFFSET);
+	if (*entry_size < PTN_ENTRY_SIZE || (uint64_t)*count * *entry_size > 1024 * 1024)
+		return -EINVAL;
+	len = *count * *entry_size;
+
+	*arr = malloc(len);
+	if (!*arr)
+		return -ENOMEM;
+	if (pread(fd, *arr, len, get_le64(hdr + PENTRIES_OFFSET) * block_size) != len ||
+	    efi_crc32(*arr, len) != get_le32(hdr + PARTITION_CRC_OFFSET)) {
+		free(*arr);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+// Add the labels of every partition on the disk called name
+static void partlabel_scan_disk(const char *name)
+{
+	char path[PATH_MAX];
+	uint32_t block_size = 0, count, entry_size;
+	struct partlabel_entry *entry;
+	uint8_t *arr = NULL, *pentry;
+	static const uint8_t unused[TYPE_GUID_SIZE];
+	off_t disk_size;
+	unsigned int j;
+	int fd, rc;
+
+	if (partlabel_source == PARTLABEL_SCAN_LOOP) {
+		if (strncmp(name, "loop", 4))
+			return;
+	} else {
+		// Loop, zram and device mapper devices have no device link
+		snprintf(path, sizeof(path), "%s/%s/device", PARTLABEL_SYS_BLOCK, name);
+		if (access(path, F_OK))
+			return;
+	}
+
+	if (partlabel_nr_disks == PARTLABEL_DISKS_MAX) {
+		LOGW("%s: More than %d disks, ignoring %s\n", __func__, PARTLABEL_DISKS_MAX, name);
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", PARTLABEL_DEV_DIR, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOGD("%s: Failed to open %s: %s\n", __func__, path, strerror(errno));
+		return;
+	}
+
+	if (ioctl(fd, BLKSSZGET, &block_size) || block_size < 512 ||
+	    block_size > PARTLABEL_BLOCK_MAX)
+		block_size = 512;
+
+	// Fall back to the backup GPT at the end of the disk
+	rc = partlabel_read_gpt(fd, block_size, 1, &arr, &count, &entry_size);
+	disk_size = lseek(fd, 0, SEEK_END);
+	if (rc && disk_size > (off_t)block_size)
+		rc = partlabel_read_gpt(fd, block_size, disk_size / block_size - 1, &arr, &count,
+					&entry_size);
+	close(fd);
+	if (rc) {
+		LOGD("%s: No usable GPT on %s\n", __func__, path);
+		return;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		pentry = arr + i * entry_size;
+		if (!memcmp(pentry + TYPE_GUID_OFFSET, unused, TYPE_GUID_SIZE))
+			continue;
+		if (partlabel_nr_entries == PARTLABEL_ENTRIES_MAX) {
+			LOGW("%s: More than %d partitions, ignoring the rest\n", __func__,
+			     PARTLABEL_ENTRIES_MAX);
+			break;
+		}
+
+		entry = &partlabel_entries[partlabel_nr_entries++];
+		// UTF-16, ignoring the 2nd byte like gpt_pentry_seek()
+		for (j = 0; j < sizeof(entry->label) - 1; j++)
+			entry->label[j] = pentry[PARTITION_NAME_OFFSET + j * 2];
+		entry->label[j] = '\0';
+		entry->disk = partlabel_nr_disks;
+		entry->partno = i + 1;
+	}
+	free(arr);
+
+	snprintf(partlabel_disks[partlabel_nr_disks++], GPT_PTN_PATH_MAX, "%.*s",
+		 (int)GPT_PTN_PATH_MAX - 1, path);
+}
+
+static int partlabel_disk_cmp(const void *a, const void *b)
+{
+	return strcmp(a, b);
+}
+
+// Read the GPT of every disk once, udev isn't needed for this
+static void partlabel_scan(void)
+{
+	char names[PARTLABEL_DISKS_MAX * 2][32];
+	unsigned int nr = 0;
+	struct dirent *de;
+	DIR *dir;
+
+	if (partlabel_scanned)
+		return;
+	partlabel_scanned = true;
+
+	dir = opendir(PARTLABEL_SYS_BLOCK);
+	if (!dir) {
+		LOGE("%s: Failed to open %s: %s\n", __func__, PARTLABEL_SYS_BLOCK,
+		     strerror(errno));
+		return;
+	}
+
+	while ((de = readdir(dir)) && nr < ARRAY_SIZE(names)) {
+		if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(names[0]))
+			continue;
+		strcpy(names[nr++], de->d_name);
+	}
+	closedir(dir);
+
+	// Same order on every boot, so duplicate labels resolve the same way
+	qsort(names, nr, sizeof(names[0]), partlabel_disk_cmp);
+	for (unsigned int i = 0; i < nr; i++)
+		partlabel_scan_disk(names[i]);
+
+	LOGD("%s: Found %u partitions on %u disks\n", __func__, partlabel_nr_entries,
+	     partlabel_nr_disks);
+}
+
+static const struct partlabel_entry *partlabel_find(const char *label)
+{
+	partlabel_scan();
+
+	for (unsigned int i = 0; i < partlabel_nr_entries; i++)
+		if (!strcmp(partlabel_entries[i].label, label))
+			return &partlabel_entries[i];
+
+	return NULL;
+}
+
+// From /dev/sda12 or /dev/mmcblk0p12 get /dev/sda or /dev/mmcblk0
+static void partlabel_trim_partno(char *path)
+{
+	int i;
+
+	for (i = strlen(path); i > 0; i--)
+		if (!isdigit(path[i - 1]))
+			break;
+
+	if (i >= 2 && path[i - 1] == 'p' && isdigit(path[i - 2]))
+		i--;
+
+	path[i] = '\0';
+}
+
+int partlabel_resolve(const char *label, char *part, size_t part_len, char *disk,
+		      size_t disk_len)
+{
+	const struct partlabel_entry *entry;
+	char path[PATH_MAX], real[PATH_MAX];
+	const char *disk_path;
+	size_t n;
+
+	if (partlabel_get_source() == PARTLABEL_UDEV) {
+		snprintf(path, sizeof(path), "%s/%s", BOOT_DEV_DIR, label);
+		if (!realpath(path, real))
+			return -errno;
+		if (part)
+			snprintf(part, part_len, "%s", real);
+		if (disk) {
+			partlabel_trim_partno(real);
+			snprintf(disk, disk_len, "%s", real);
+		}
+		return 0;
+	}
+
+	entry = partlabel_find(label);
+	if (!entry)
+		return -ENOENT;
+
+	disk_path = partlabel_disks[entry->disk];
+	if (part) {
+		// Partitions of disks ending in a digit get a 'p' separator
+		n = strlen(disk_path);
+		snprintf(part, part_len, "%s%s%u", disk_path,
+			 n && isdigit(disk_path[n - 1]) ? "p" : "", entry->partno);
+	}
+	if (disk)
+		snprintf(disk, disk_len, "%s", disk_path);
+
+	return 0;
+}
+
+bool partlabel_exists(const char *label)
+{
+	char path[GPT_PTN_PATH_MAX];
+	struct stat st;
+
+	if (partlabel_get_source() != PARTLABEL_UDEV)
+		return partlabel_find(label) != NULL;
+
+	snprintf(path, sizeof(path), "%s/%.*s", BOOT_DEV_DIR, MAX_GPT_NAME_SIZE, label);
+	return !stat(path, &st);
+}
+
+int partlabel_for_each(int (*fn)(const char *label, const char *disk, void *data), void *data)
+{
+	char disk[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+	int rc = 0;
+
+	if (partlabel_get_source() != PARTLABEL_UDEV) {
+		partlabel_scan();
+		for (unsigned int i = 0; i < partlabel_nr_entries && !rc; i++)
+			rc = fn(partlabel_entries[i].label,
+				partlabel_disks[partlabel_entries[i].disk], data);
+		return rc;
+	}
+
+	dir = opendir(BOOT_DEV_DIR);
+	if (!dir) {
+		rc = -errno;
+		LOGE("%s: Failed to open %s: %s\n", __func__, BOOT_DEV_DIR, strerror(-rc));
+		return rc;
+	}
+
+	while (!rc && (de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (partlabel_resolve(de->d_name, NULL, 0, disk, sizeof(disk)))
+			continue;
+		rc = fn(de->d_name, disk, data);
+	}
+	closedir(dir);
+
+	return rc;
+}
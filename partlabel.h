@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PARTLABEL_H__
+#define __PARTLABEL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Partitions are found by their GPT label, either through the udev
+ * symlinks in BOOT_DEV_DIR or, in early boot before udev has settled,
+ * by reading the GPT of every disk the kernel lists in /sys/block.
+ */
+enum partlabel_source {
+	// udev if BOOT_DEV_DIR exists, otherwise scan
+	PARTLABEL_AUTO = 0,
+	PARTLABEL_UDEV,
+	PARTLABEL_SCAN,
+	// Scan loop devices only, for testing on copies of the partition
+	// tables
+	PARTLABEL_SCAN_LOOP,
+};
+
+void partlabel_set_source(enum partlabel_source source);
+
+// Find the partition labelled label, filling in the path of the
+// partition and/or the disk holding it (either may be NULL).
+// Returns 0 or -errno.
+int partlabel_resolve(const char *label, char *part, size_t part_len, char *disk,
+		      size_t disk_len);
+
+bool partlabel_exists(const char *label);
+
+// Call fn for every partition label and the disk it's on, until fn
+// returns non-zero. Returns what fn returned, 0 or -errno.
+int partlabel_for_each(int (*fn)(const char *label, const char *disk, void *data), void *data);
+
+#endif // __PARTLABEL_H__
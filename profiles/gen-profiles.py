@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Turn the partition profiles in profiles/*.profile into the static tables
+# used by ptn-profile.c. Every line of a profile is a keyword followed by
+# its arguments, '#' starts a comment:
+#
+#   name NAME          name used with --profile
+#   xbl auto|ufs|emmc  how the XBL slot is switched, auto probes for eMMC
+#   fallback           only pick this one when nothing else matches
+#   required PTN...    A/B partitions that have to exist
+#   ab PTN...          A/B partitions to switch, without the slot suffix
+
+import argparse
+import sys
+
+MAX_PTNS = 48
+MAX_NAME = 33
+XBL = {"auto": "PTN_XBL_AUTO", "ufs": "PTN_XBL_UFS", "emmc": "PTN_XBL_EMMC"}
+
+
+def fail(path, lineno, msg):
+    sys.exit(f"{path}:{lineno}: {msg}")
+
+
+def parse(path):
+    prof = {"name": None, "xbl": "auto", "fallback": False, "ab": [], "required": set()}
+
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            words = line.split("#", 1)[0].split()
+            if not words:
+                continue
+            key, args = words[0], words[1:]
+            if key == "name" and len(args) == 1:
+                prof["name"] = args[0]
+            elif key == "xbl" and len(args) == 1 and args[0] in XBL:
+                prof["xbl"] = args[0]
+            elif key == "fallback" and not args:
+                prof["fallback"] = True
+            elif key in ("ab", "required") and args:
+                for ptn in args:
+                    if len(ptn) > MAX_NAME or not ptn.isprintable():
+                        fail(path, lineno, f"bad partition name '{ptn}'")
+                    if key == "required":
+                        prof["required"].add(ptn)
+                    elif ptn in prof["ab"]:
+                        fail(path, lineno, f"'{ptn}' listed twice")
+                    else:
+                        prof["ab"].append(ptn)
+            else:
+                fail(path, lineno, f"can't parse '{line.strip()}'")
+
+    if not prof["name"]:
+        fail(path, 0, "no name")
+    if not prof["ab"] or len(prof["ab"]) > MAX_PTNS:
+        fail(path, 0, f"needs 1 to {MAX_PTNS} A/B partitions")
+    missing = prof["required"] - set(prof["ab"])
+    if missing:
+        fail(path, 0, f"required but not A/B: {' '.join(sorted(missing))}")
+
+    return prof
+
+
+def c_string(s):
+    return s.replace("\\", "\\\\").replace('"', '\\"')
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-o", "--output", required=True)
+    parser.add_argument("profiles", nargs="+")
+    args = parser.parse_args()
+
+    profiles = [parse(p) for p in args.profiles]
+    names = [p["name"] for p in profiles]
+    if len(set(names)) != len(names):
+        sys.exit("duplicate profile names")
+    # Auto detection prefers the first match, fallbacks go last
+    profiles.sort(key=lambda p: (p["fallback"], p["name"]))
+
+    # Every partition name is stored once, with its _a suffix
+    pool, offsets = [], {}
+    for prof in profiles:
+        for ptn in prof["ab"]:
+            if ptn not in offsets:
+                offsets[ptn] = sum(len(s) + 3 for s in pool)
+                pool.append(ptn)
+
+    out = []
+    out.append("/* Generated by gen-profiles.py, do not edit */\n")
+    out.append('#include "ptn-profile.h"\n')
+    out.append("const char ptn_pool[] =")
+    for ptn in pool:
+        out.append(f'\t"{c_string(ptn)}_a\\0"')
+    out[-1] += ";\n"
+
+    out.append("const struct ptn_profile_ptn ptn_entries[] = {")
+    first = []
+    for prof in profiles:
+        first.append(sum(len(p["ab"]) for p in profiles[: len(first)]))
+        out.append(f"\t/* {prof['name']} */")
+        for ptn in prof["ab"]:
+            flags = "PTN_PROFILE_REQUIRED" if ptn in prof["required"] else "0"
+            out.append(f"\t{{ {offsets[ptn]}, {flags} }},")
+    out.append("};\n")
+
+    out.append("const struct ptn_profile ptn_profiles[] = {")
+    for prof, start in zip(profiles, first):
+        flags = "PTN_PROFILE_FALLBACK" if prof["fallback"] else "0"
+        out.append(
+            f'\t{{ "{c_string(prof["name"])}", {XBL[prof["xbl"]]}, {flags}, '
+            f'{len(prof["ab"])}, {start} }},'
+        )
+    out.append("};\n")
+    out.append(f"const unsigned int ptn_nr_profiles = {len(profiles)};")
+
+    with open(args.output, "w") as f:
+        f.write("\n".join(out) + "\n")
+
+
+if __name__ == "__main__":
+    main()
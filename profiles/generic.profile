@@ -0,0 +1,8 @@
+# Every A/B partition qbootctl knows about, for devices without a more
+# specific profile. Partitions that don't exist are skipped.
+name generic
+xbl auto
+fallback
+required boot dtbo
+ab abl aop apdp cmnlib cmnlib64 devcfg dtbo hyp keymaster msadp qupfw storsec tz
+ab vbmeta vbmeta_system boot system vendor modem system_ext product
@@ -0,0 +1,7 @@
+# Snapdragon 845 phones (OnePlus 6/6T, Pixel 3, Poco F1, ...), booting
+# from UFS with xbl_a/xbl_b on separate boot LUNs.
+name sdm845
+xbl ufs
+required boot dtbo
+ab abl aop cmnlib cmnlib64 devcfg dtbo hyp keymaster qupfw storsec tz vbmeta
+ab boot system vendor modem product
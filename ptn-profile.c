@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpt-utils.h"
+#include "log.h"
+#include "partlabel.h"
+#include "ptn-profile.h"
+
+// More partition labels than any device has
+#define PTN_LABELS_MAX 256
+
+static char ptn_labels[PTN_LABELS_MAX][MAX_GPT_NAME_SIZE / 2 + 1];
+static unsigned int ptn_nr_labels;
+static bool ptn_scanned;
+
+static const struct ptn_profile *ptn_selected;
+// Bit 0 is set if the _a partition of an entry of the selected
+// profile exists, bit 1 for the _b one
+static uint8_t ptn_present[PTN_PROFILE_MAX];
+
+static int ptn_label_cmp(const void *a, const void *b)
+{
+	return strcmp(a, b);
+}
+
+static int ptn_add_label(const char *label, const char *disk, void *data)
+{
+	(void)disk;
+	(void)data;
+
+	if (strlen(label) >= sizeof(ptn_labels[0]))
+		return 0;
+	if (ptn_nr_labels == PTN_LABELS_MAX) {
+		LOGW("%s: More than %d partitions, ignoring the rest\n", __func__,
+		     PTN_LABELS_MAX);
+		return 1;
+	}
+	strcpy(ptn_labels[ptn_nr_labels++], label);
+
+	return 0;
+}
+
+// Read all partition labels once, rather than stat()ing every
+// partition of every profile
+static void ptn_scan(void)
+{
+	if (ptn_scanned)
+		return;
+	ptn_scanned = true;
+
+	partlabel_for_each(ptn_add_label, NULL);
+
+	qsort(ptn_labels, ptn_nr_labels, sizeof(ptn_labels[0]), ptn_label_cmp);
+}
+
+static bool ptn_label_exists(const char *name)
+{
+	return bsearch(name, ptn_labels, ptn_nr_labels, sizeof(ptn_labels[0]), ptn_label_cmp);
+}
+
+static uint8_t ptn_presence(const struct ptn_profile_ptn *ptn)
+{
+	char name[sizeof(ptn_labels[0])];
+
+	snprintf(name, sizeof(name), "%s", ptn_pool + ptn->name);
+	if (!name[0])
+		return 0;
+
+	name[strlen(name) - 1] = 'b';
+	return ptn_label_exists(ptn_pool + ptn->name) | ptn_label_exists(name) << 1;
+}
+
+static bool ptn_profile_lists(const struct ptn_profile *prof, uint16_t name)
+{
+	for (unsigned int i = 0; i < prof->nr_ptns; i++)
+		if (ptn_entries[prof->first + i].name == name)
+			return true;
+
+	return false;
+}
+
+// How well prof fits this device: -1 if a required partition is missing
+// or it leaves out an A/B partition some other profile would switch,
+// otherwise higher for fewer missing partitions.
+static int ptn_profile_score(const struct ptn_profile *prof)
+{
+	const struct ptn_profile_ptn *ptn;
+	int score = PTN_PROFILE_MAX;
+
+	for (unsigned int i = 0; i < prof->nr_ptns; i++) {
+		ptn = &ptn_entries[prof->first + i];
+		if (ptn_presence(ptn) == 3)
+			continue;
+		if (ptn->flags & PTN_PROFILE_REQUIRED)
+			return -1;
+		score--;
+	}
+
+	// Names are stored only once, so the offsets can be compared
+	for (unsigned int p = 0; p < ptn_nr_profiles; p++) {
+		for (unsigned int i = 0; i < ptn_profiles[p].nr_ptns; i++) {
+			ptn = &ptn_entries[ptn_profiles[p].first + i];
+			if (ptn_presence(ptn) == 3 && !ptn_profile_lists(prof, ptn->name))
+				return -1;
+		}
+	}
+
+	return score;
+}
+
+static const struct ptn_profile *ptn_profile_detect(void)
+{
+	const struct ptn_profile *best = NULL, *prof;
+	int score, best_score = -1;
+
+	for (unsigned int p = 0; p < ptn_nr_profiles; p++) {
+		prof = &ptn_profiles[p];
+		score = ptn_profile_score(prof);
+		LOGD("%s: Profile %s scores %d\n", __func__, prof->name, score);
+		if (score < 0)
+			continue;
+		// Fallbacks are sorted last, only use them if nothing
+		// else matched
+		if (best && (prof->flags & PTN_PROFILE_FALLBACK) &&
+		    !(best->flags & PTN_PROFILE_FALLBACK))
+			break;
+		if (score > best_score) {
+			best = prof;
+			best_score = score;
+		}
+	}
+
+	if (best)
+		return best;
+
+	// Not an A/B device (or a broken one), carry on with the catch-all
+	// profile and let the caller report what's missing
+	for (unsigned int p = 0; p < ptn_nr_profiles; p++)
+		if (ptn_profiles[p].flags & PTN_PROFILE_FALLBACK)
+			return &ptn_profiles[p];
+
+	return &ptn_profiles[ptn_nr_profiles - 1];
+}
+
+int ptn_profile_select(const char *name)
+{
+	const struct ptn_profile *prof = NULL;
+
+	ptn_scan();
+
+	if (!name || !strcmp(name, "auto")) {
+		prof = ptn_profile_detect();
+	} else {
+		for (unsigned int p = 0; p < ptn_nr_profiles; p++)
+			if (!strcmp(ptn_profiles[p].name, name))
+				prof = &ptn_profiles[p];
+		if (!prof) {
+			LOGE("Unknown partition profile '%s'\n", name);
+			return -ENOENT;
+		}
+	}
+
+	for (unsigned int i = 0; i < prof->nr_ptns; i++)
+		ptn_present[i] = ptn_presence(&ptn_entries[prof->first + i]);
+	ptn_selected = prof;
+	LOGI("Using partition profile %s\n", prof->name);
+
+	return 0;
+}
+
+const struct ptn_profile *ptn_profile_get(void)
+{
+	if (!ptn_selected)
+		ptn_profile_select(NULL);
+
+	return ptn_selected;
+}
+
+unsigned int ptn_profile_count(void)
+{
+	return ptn_profile_get()->nr_ptns;
+}
+
+const char *ptn_profile_ptn(unsigned int i)
+{
+	return ptn_pool + ptn_entries[ptn_profile_get()->first + i].name;
+}
+
+bool ptn_profile_required(unsigned int i)
+{
+	return ptn_entries[ptn_profile_get()->first + i].flags & PTN_PROFILE_REQUIRED;
+}
+
+bool ptn_profile_present(unsigned int i, unsigned int slot)
+{
+	ptn_profile_get();
+
+	return ptn_present[i] & (1 << slot);
+}
+
+bool ptn_profile_is_emmc(void)
+{
+	switch (ptn_profile_get()->xbl) {
+	case PTN_XBL_UFS:
+		return false;
+	case PTN_XBL_EMMC:
+		return true;
+	default:
+		return gpt_utils_is_partition_backed_by_emmc(PTN_XBL AB_SLOT_A_SUFFIX);
+	}
+}
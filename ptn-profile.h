@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PTN_PROFILE_H__
+#define __PTN_PROFILE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Most A/B partitions a profile may list, enforced by gen-profiles.py
+#define PTN_PROFILE_MAX 48
+
+// How the XBL slot is switched
+enum ptn_xbl_scheme {
+	// Probe for eMMC, otherwise switch the UFS boot LUN
+	PTN_XBL_AUTO = 0,
+	PTN_XBL_UFS,
+	// Nothing to switch
+	PTN_XBL_EMMC,
+};
+
+#define PTN_PROFILE_REQUIRED (1 << 0)
+#define PTN_PROFILE_FALLBACK (1 << 0)
+
+struct ptn_profile_ptn {
+	// Offset of the name (with _a suffix) in ptn_pool
+	uint16_t name;
+	uint8_t flags;
+};
+
+struct ptn_profile {
+	const char *name;
+	uint8_t xbl;
+	uint8_t flags;
+	uint8_t nr_ptns;
+	// Index of the first partition in ptn_entries
+	uint16_t first;
+};
+
+// Generated from profiles/*.profile by gen-profiles.py
+extern const char ptn_pool[];
+extern const struct ptn_profile_ptn ptn_entries[];
+extern const struct ptn_profile ptn_profiles[];
+extern const unsigned int ptn_nr_profiles;
+
+// Use the profile called name, or detect one from the partitions that
+// exist if name is NULL or "auto". Returns -ENOENT for unknown names.
+int ptn_profile_select(const char *name);
+
+// The selected profile, detected on first use if none was selected
+const struct ptn_profile *ptn_profile_get(void);
+
+// The A/B partitions of the selected profile, names have the _a suffix
+unsigned int ptn_profile_count(void);
+const char *ptn_profile_ptn(unsigned int i);
+bool ptn_profile_required(unsigned int i);
+// Whether the slot (0 for _a, 1 for _b) of partition i exists
+bool ptn_profile_present(unsigned int i, unsigned int slot);
+
+// The XBL slot is picked by PBL from eMMC, there's no boot LUN to switch
+bool ptn_profile_is_emmc(void);
+
+#endif // __PTN_PROFILE_H__
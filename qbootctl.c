@@ -16,17 +16,96 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
 
+#include <getopt.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+
+#include "boot-context.h"
 #include "bootctrl.h"
+#include "bootctrl-async.h"
+#include "gpt-utils.h"
+#include "ledger.h"
+#include "log.h"
+#include "metrics.h"
+#include "partlabel.h"
+#include "ptn-profile.h"
+#include "slot-audit.h"
+#include "slot-snapshot.h"
+#include "ufs-bsg.h"
 
 const struct boot_control_module *impl = &bootctl;
 
+// Long options without a short equivalent
+enum {
+	OPT_UFS_INFO = 0x100,
+	OPT_NO_CACHE,
+	OPT_UFS_TIMEOUT,
+	OPT_UFS_RETRIES,
+	OPT_UFS_HOST,
+	OPT_DRY_RUN,
+	OPT_SNAPSHOT,
+	OPT_RESTORE,
+	OPT_VERIFY,
+	OPT_REPAIR,
+	OPT_AUDIT,
+	OPT_DURABILITY,
+	OPT_PROFILE,
+	OPT_NO_UDEV,
+	OPT_LOOP,
+	OPT_METRICS,
+	OPT_METRICS_FILE,
+	OPT_FINGERPRINT,
+	OPT_LEDGER,
+	OPT_BENCH,
+	OPT_DROP_CACHES,
+	OPT_STRESS,
+	OPT_ASYNC,
+	OPT_RECOVER,
+};
+
+static const struct option long_options[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "verbose", no_argument, NULL, 'v' },
+	{ "ufs-info", no_argument, NULL, OPT_UFS_INFO },
+	{ "no-cache", no_argument, NULL, OPT_NO_CACHE },
+	{ "ufs-timeout", required_argument, NULL, OPT_UFS_TIMEOUT },
+	{ "ufs-retries", required_argument, NULL, OPT_UFS_RETRIES },
+	{ "ufs-host", required_argument, NULL, OPT_UFS_HOST },
+	{ "dry-run", no_argument, NULL, OPT_DRY_RUN },
+	{ "snapshot", required_argument, NULL, OPT_SNAPSHOT },
+	{ "restore", required_argument, NULL, OPT_RESTORE },
+	{ "verify", no_argument, NULL, OPT_VERIFY },
+	{ "repair", no_argument, NULL, OPT_REPAIR },
+	{ "audit", no_argument, NULL, OPT_AUDIT },
+	{ "durability", required_argument, NULL, OPT_DURABILITY },
+	{ "profile", required_argument, NULL, OPT_PROFILE },
+	{ "no-udev", no_argument, NULL, OPT_NO_UDEV },
+	{ "loop", no_argument, NULL, OPT_LOOP },
+	{ "metrics", no_argument, NULL, OPT_METRICS },
+	{ "metrics-file", required_argument, NULL, OPT_METRICS_FILE },
+	{ "fingerprint", no_argument, NULL, OPT_FINGERPRINT },
+	{ "ledger", no_argument, NULL, OPT_LEDGER },
+	{ "bench", required_argument, NULL, OPT_BENCH },
+	{ "drop-caches", no_argument, NULL, OPT_DROP_CACHES },
+	{ "stress", required_argument, NULL, OPT_STRESS },
+	{ "async", no_argument, NULL, OPT_ASYNC },
+	{ "recover", no_argument, NULL, OPT_RECOVER },
+	{ 0 },
+};
+
 bool isslot(const char* str)
 {
 	return strspn(str, "01abAB") == strlen(str);
@@ -66,18 +145,31 @@ unsigned parseSlot(const char* arg)
 	return (unsigned)slot;
 
 fail:
-	fprintf(stderr,
-		"Expected slot not '%s'\n",
-		arg);
+	LOGE("Expected slot not '%s'\n", arg);
 	exit(1);
 }
 
+unsigned parseUInt(const char *arg)
+{
+	char *end;
+	unsigned long val;
+
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+	if (end == arg || *end || errno || val > UINT32_MAX) {
+		LOGE("Expected a number not '%s'\n", arg);
+		exit(1);
+	}
+
+	return (unsigned)val;
+}
+
 int usage()
 {
 	// clang-format off
 	fprintf(stderr, "qbootctl: qcom bootctrl HAL port for Linux\n");
 	fprintf(stderr, "-------------------------------------------\n");
-	fprintf(stderr, "qbootctl [-c|-m|-s|-u|-b|-n|-x] [SLOT]\n\n");
+	fprintf(stderr, "qbootctl [-v] [-c|-m|-s|-u|-b|-n|-x] [SLOT]\n\n");
 	fprintf(stderr, "    <no args>        dump slot info (default)\n");
 	fprintf(stderr, "    -h               this help text\n");
 	fprintf(stderr, "    -c               get the current slot\n");
@@ -89,6 +181,32 @@ int usage()
 	fprintf(stderr, "    -m [SLOT]        mark a boot as successful (default: current)\n");
 	fprintf(stderr, "    -u [SLOT]        mark SLOT as unbootable (default: current)\n");
 	fprintf(stderr, "    -i               still write the GPT headers even if the UFS bLun can't be changed (default: false)\n");
+	fprintf(stderr, "    --recover        finish a slot switch that was interrupted, e.g. by a power loss\n");
+	fprintf(stderr, "    --snapshot FILE  save the slot attributes of all partitions and the boot LUN to FILE\n");
+	fprintf(stderr, "    --restore FILE   write back everything that differs from the snapshot in FILE\n");
+	fprintf(stderr, "    --verify         check that both GPT copies of every LUN are intact and identical\n");
+	fprintf(stderr, "    --repair         like --verify, and fix whatever is damaged or differs\n");
+	fprintf(stderr, "    --audit          check that all A/B partitions agree on the slot state\n");
+	fprintf(stderr, "    --fingerprint    print a short digest of the slot state of all partitions and the boot LUN\n");
+	fprintf(stderr, "    --ledger         print how much qbootctl has written to every LUN over the device's life\n");
+	fprintf(stderr, "    --bench N OP     time N runs of OP: current, active, dump or verify\n");
+	fprintf(stderr, "    --drop-caches    with --bench: drop the page cache and the cached slot before every run\n");
+	fprintf(stderr, "    --stress R,W,N   run R readers and W writers of N operations each at once (image files only)\n");
+	fprintf(stderr, "    --metrics        print the slot, boot LUN and GPT state as OpenMetrics\n");
+	fprintf(stderr, "    --metrics-file F like --metrics, atomically replacing F (for the textfile collector)\n");
+	fprintf(stderr, "    --dry-run        with -s, -m, -u, --restore or --repair: print what would be written instead of writing it\n");
+	fprintf(stderr, "    --async          with -s, -m or -u: run it on a worker thread and poll for the result\n");
+	fprintf(stderr, "    --durability L   full: fsync every GPT write (default), barrier: once per LUN,\n");
+	fprintf(stderr, "                     none: once per LUN when qbootctl exits\n");
+	fprintf(stderr, "    --profile NAME   partition profile to use, 'auto' (default) or 'list' to show them\n");
+	fprintf(stderr, "    --no-udev        find partitions by reading the GPT of every disk, for early boot\n");
+	fprintf(stderr, "    --loop           like --no-udev, but only read loop devices (e.g. for --stress)\n");
+	fprintf(stderr, "    -v               increase log verbosity, may be repeated (see also $" LOG_LEVEL_ENV ")\n");
+	fprintf(stderr, "    --ufs-info       dump the UFS device, geometry and unit descriptors\n");
+	fprintf(stderr, "    --no-cache       ignore results cached earlier in this boot\n");
+	fprintf(stderr, "    --ufs-timeout MS timeout for a single UFS query (default: 2000)\n");
+	fprintf(stderr, "    --ufs-retries N  retry transient UFS query errors N times (default: 3)\n");
+	fprintf(stderr, "    --ufs-host N     use the UFS host N instead of the one holding xbl\n");
 	// clang-format on
 
 	return 1;
@@ -115,6 +233,21 @@ int get_slot_info(struct slot_info *slots)
 	return 0;
 }
 
+static void print_boot_lun()
+{
+	int lun = impl->getBootLun();
+
+	// Not applicable on eMMC
+	if (lun == -EOPNOTSUPP)
+		return;
+
+	if (lun < 0)
+		printf("Boot LUN: N/A\n");
+	else
+		printf("Boot LUN: %d (%s)\n", lun,
+		       lun == 1 ? "A" : lun == 2 ? "B" : "unknown");
+}
+
 static void dump_info(int current_slot)
 {
 	struct slot_info slots[2] = { { 0 } };
@@ -129,51 +262,1013 @@ static void dump_info(int current_slot)
 		printf("\tSuccessful  : %d\n", slots[i].successful);
 		printf("\tBootable    : %d\n", slots[i].bootable);
 	}
+	print_boot_lun();
+}
+
+static int print_write_plan(const struct gpt_plan *plan)
+{
+	printf("Dry run, nothing was written\n");
+
+	if (plan->nr_entries) {
+		printf("Changed entries:\n");
+		for (unsigned int i = 0; i < plan->nr_entries; i++) {
+			const struct gpt_plan_entry *entry = &plan->entries[i];
+
+			printf("\t%-12s %-16s %-7s attr 0x%02x -> 0x%02x%s\n", entry->devpath,
+			       entry->name, entry->instance == PRIMARY_GPT ? "primary" : "backup",
+			       entry->old_attr, entry->new_attr,
+			       entry->guid_changed ? ", type GUID swapped" : "");
+		}
+	}
+
+	if (plan->nr_writes) {
+		printf("Writes:\n");
+		for (unsigned int i = 0; i < plan->nr_writes && i < GPT_PLAN_MAX_WRITES; i++) {
+			const struct gpt_plan_write *write = &plan->writes[i];
+
+			printf("\t%-12s LBA %" PRIu64 "-%" PRIu64 " (%u bytes) %s\n",
+			       write->devpath, write->lba, write->lba + write->nr_blocks - 1,
+			       write->len, write->what);
+		}
+		if (plan->nr_writes > GPT_PLAN_MAX_WRITES)
+			printf("\t... and %u more\n", plan->nr_writes - GPT_PLAN_MAX_WRITES);
+	}
+
+	printf("Total: %u GPT commits, %u writes, %" PRIu64 " bytes, %u fsyncs\n",
+	       plan->nr_commits, plan->nr_writes, plan->bytes, plan->nr_fsyncs);
+
+	if (!plan->boot_lun_checked)
+		printf("UFS bBootLunEn: not changed\n");
+	else if (plan->boot_lun_cur < 0)
+		printf("UFS bBootLunEn: unknown -> %d (would write)\n", plan->boot_lun_new);
+	else if (plan->boot_lun_cur == plan->boot_lun_new)
+		printf("UFS bBootLunEn: already %d (no write)\n", plan->boot_lun_cur);
+	else
+		printf("UFS bBootLunEn: %d -> %d (would write)\n", plan->boot_lun_cur,
+		       plan->boot_lun_new);
+
+	return 0;
+}
+
+// Check (and optionally repair) the GPT copies of every LUN, returns
+// the number of LUNs that have (or had) a problem or -1 if a LUN
+// couldn't be repaired or the repair couldn't be written.
+static int verify_gpt(bool repair)
+{
+	struct gpt_lun luns[MAX_BLOCK_DEVICES * 4];
+	struct gpt_verify_result result;
+	struct gpt_disk disk = { 0 };
+	int nr, rc, bad = 0;
+	bool unrepaired = false;
+
+	nr = gpt_utils_get_luns(luns, ARRAY_SIZE(luns));
+	if (nr <= 0) {
+		LOGE("No GPT disks found\n");
+		return 1;
+	}
+
+	gpt_utils_lock(repair);
+	for (int i = 0; i < nr; i++) {
+		if (gpt_disk_get_disk_info(luns[i].part, &disk) < 0) {
+			printf("%s: unreadable\n", luns[i].devpath);
+			bad++;
+			continue;
+		}
+
+		if (gpt_disk_verify(&disk, &result)) {
+			printf("%s: ok (%u entries)\n", luns[i].devpath, result.nr_entries);
+			continue;
+		}
+
+		bad++;
+		printf("%s: primary %s, backup %s", luns[i].devpath,
+		       gpt_state_str(result.state[PRIMARY_GPT]),
+		       gpt_state_str(result.state[SECONDARY_GPT]));
+		if (result.nr_divergent)
+			printf(", %u of %u entries differ", result.nr_divergent, result.nr_entries);
+		printf("\n");
+		for (unsigned int j = 0; j < result.nr_divergent && j < GPT_VERIFY_MAX_DIVERGENT; j++)
+			printf("\tentry %u differs\n", result.divergent[j]);
+
+		if (!repair)
+			continue;
+
+		rc = gpt_disk_repair(&disk, &result);
+		if (rc < 0) {
+			printf("\tnot repaired, no intact copy\n");
+			unrepaired = true;
+			continue;
+		}
+		printf("\trepaired %d item(s)\n", rc);
+		if (gpt_disk_commit(&disk)) {
+			LOGE("Failed to write back %s\n", luns[i].devpath);
+			gpt_disk_free(&disk);
+			gpt_utils_unlock();
+			return -1;
+		}
+	}
+
+	gpt_disk_free(&disk);
+	gpt_utils_unlock();
+	return unrepaired ? -1 : bad;
+}
+
+static const char *audit_attr_str(uint8_t attr, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s%s%s", attr & AB_PARTITION_ATTR_SLOT_ACTIVE ? "active " : "",
+		 attr & AB_PARTITION_ATTR_BOOT_SUCCESSFUL ? "successful " : "",
+		 attr & AB_PARTITION_ATTR_UNBOOTABLE ? "unbootable " : "");
+	if (!buf[0])
+		snprintf(buf, len, "- ");
+	buf[strlen(buf) - 1] = '\0';
+
+	return buf;
+}
+
+// Print every A/B pair that disagrees with the rest, returns the
+// number of them or -1 if the audit couldn't run.
+static int audit_slots(void)
+{
+	static struct slot_audit audit;
+	char a[32], b[32];
+	int rc;
+
+	rc = slot_audit_run(&audit);
+	if (rc < 0) {
+		LOGE("Failed to audit slots: %s\n", strerror(-rc));
+		return -1;
+	}
+
+	printf("Active slot: %s\n", audit.active_slot ? "_b" : "_a");
+	printf("Expected _a: %s", audit_attr_str(audit.expect_attr[0], a, sizeof(a)));
+	printf(", _b: %s\n", audit_attr_str(audit.expect_attr[1], b, sizeof(b)));
+
+	for (unsigned int i = 0; i < audit.nr_pairs; i++) {
+		if (!audit.bad[i])
+			continue;
+		printf("%s (%s): _a %s, _b %s:%s%s%s%s\n", audit.name[i], audit.devpath[i],
+		       audit_attr_str(audit.attr[0][i], a, sizeof(a)),
+		       audit_attr_str(audit.attr[1][i], b, sizeof(b)),
+		       audit.bad[i] & SLOT_AUDIT_ACTIVE ? " active" : "",
+		       audit.bad[i] & SLOT_AUDIT_SUCCESSFUL ? " successful" : "",
+		       audit.bad[i] & SLOT_AUDIT_UNBOOTABLE ? " unbootable" : "",
+		       audit.bad[i] & SLOT_AUDIT_GUID ? " type-guid" : "");
+	}
+
+	printf("%u of %u A/B pairs disagree\n", audit.nr_bad, audit.nr_pairs);
+
+	return audit.nr_bad;
+}
+
+static int print_fingerprint(void)
+{
+	static struct slot_audit audit;
+	int rc, lun;
+
+	rc = slot_audit_run(&audit);
+	if (rc < 0) {
+		LOGE("Failed to load the slot state: %s\n", strerror(-rc));
+		return -1;
+	}
+
+	// A failed read would make the digest look like a state change,
+	// only eMMC has no boot LUN to go by
+	lun = impl->getBootLun();
+	if (lun < 0 && lun != -EOPNOTSUPP) {
+		LOGE("Failed to read the boot LUN: %s\n", strerror(-lun));
+		return -1;
+	}
+
+	printf("v%d:%08" PRIx32 "\n", SLOT_FINGERPRINT_VERSION, slot_audit_fingerprint(&audit, lun));
+
+	return 0;
+}
+
+static void list_profiles(void)
+{
+	static const char *const xbl[] = { "auto", "ufs", "emmc" };
+	const struct ptn_profile *prof;
+
+	for (unsigned int p = 0; p < ptn_nr_profiles; p++) {
+		prof = &ptn_profiles[p];
+		printf("%-12s xbl: %-4s %2u A/B partitions%s\n", prof->name, xbl[prof->xbl],
+		       prof->nr_ptns, prof->flags & PTN_PROFILE_FALLBACK ? " (fallback)" : "");
+	}
+}
+
+static int print_ledger(void)
+{
+	static struct ledger_total totals[MAX_BLOCK_DEVICES * 4 + 1];
+	char since[32];
+	int nr;
+
+	nr = ledger_read(totals, ARRAY_SIZE(totals));
+	if (nr < 0) {
+		LOGE("Failed to read %s: %s\n", LEDGER_PATH, strerror(-nr));
+		return -1;
+	}
+	if (!nr) {
+		printf("Nothing written yet\n");
+		return 0;
+	}
+
+	printf("%-20s %-10s %6s %8s %12s %7s %10s\n", "Device", "Since", "Runs", "Commits",
+	       "Bytes", "Fsyncs", "UFS writes");
+	for (int i = 0; i < nr; i++) {
+		time_t t = totals[i].since;
+
+		strftime(since, sizeof(since), "%Y-%m-%d", localtime(&t));
+		printf("%-20s %-10s %6u %8u %12" PRIu64 " %7u %10u\n", totals[i].dev, since,
+		       totals[i].runs, totals[i].commits, totals[i].bytes, totals[i].fsyncs,
+		       totals[i].ufs_writes);
+	}
+
+	return 0;
+}
+
+static int bench_current(void)
+{
+	return impl->getCurrentSlot() < 0 ? -1 : 0;
+}
+
+static int bench_active(void)
+{
+	impl->getActiveBootSlot();
+	return 0;
+}
+
+// Everything dump_info() reads, without the printing
+static int bench_dump(void)
+{
+	struct slot_info slots[2] = { { 0 } };
+
+	if (impl->getCurrentSlot() < 0 || get_slot_info(slots))
+		return -1;
+	impl->getBootLun();
+
+	return 0;
+}
+
+// Like verify_gpt() without the printing
+static int bench_verify(void)
+{
+	struct gpt_lun luns[MAX_BLOCK_DEVICES * 4];
+	struct gpt_verify_result result;
+	struct gpt_disk disk = { 0 };
+	int nr, rc = 0;
+
+	nr = gpt_utils_get_luns(luns, ARRAY_SIZE(luns));
+	if (nr <= 0)
+		return -1;
+
+	for (int i = 0; i < nr && !rc; i++) {
+		rc = gpt_disk_get_disk_info(luns[i].part, &disk);
+		if (!rc)
+			gpt_disk_verify(&disk, &result);
+	}
+	gpt_disk_free(&disk);
+
+	return rc;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(void);
+} bench_ops[] = {
+	{ "current", bench_current },
+	{ "active", bench_active },
+	{ "dump", bench_dump },
+	{ "verify", bench_verify },
+};
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Drop clean pages so the next run reads from the device again
+static void drop_page_cache(void)
+{
+	int fd;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+	if (fd < 0 || write(fd, "1", 1) != 1)
+		LOGW("Failed to drop the page cache: %s\n", strerror(errno));
+	if (fd >= 0)
+		close(fd);
+}
+
+// Sorts samples
+static void print_bench_stats(const char *what, uint64_t *samples, unsigned int n)
+{
+	qsort(samples, n, sizeof(*samples), cmp_u64);
+	printf("%-8s min %9.1f  median %9.1f  p99 %9.1f  max %9.1f us\n", what,
+	       samples[0] / 1e3, samples[n / 2] / 1e3, samples[(n * 99 + 99) / 100 - 1] / 1e3,
+	       samples[n - 1] / 1e3);
+}
+
+// Run op n times and print the latency of the runs and of every phase
+// of loading the GPTs
+static int run_bench(const char *name, unsigned int n, bool drop_caches)
+{
+	static const char *const phases[] = { "resolve", "header", "entries", "crc" };
+	uint64_t phase_nsec[GPT_NR_PHASES], start;
+	uint64_t *samples;
+	int (*op)(void) = NULL;
+	int rc = 0;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(bench_ops); i++)
+		if (name && !strcmp(name, bench_ops[i].name))
+			op = bench_ops[i].run;
+	if (!op || !n)
+		return usage();
+
+	samples = calloc((size_t)n * (GPT_NR_PHASES + 1), sizeof(*samples));
+	if (!samples) {
+		LOGE("Out of memory\n");
+		return 1;
+	}
+
+	gpt_utils_set_phase_timing(true);
+	for (unsigned int i = 0; i < n && !rc; i++) {
+		if (drop_caches) {
+			boot_context_invalidate();
+			drop_page_cache();
+		}
+		gpt_utils_take_phase_times(phase_nsec);
+
+		start = now_nsec();
+		rc = op();
+		samples[i] = now_nsec() - start;
+
+		gpt_utils_take_phase_times(phase_nsec);
+		for (int p = 0; p < GPT_NR_PHASES; p++)
+			samples[(p + 1) * n + i] = phase_nsec[p];
+	}
+	gpt_utils_set_phase_timing(false);
+
+	if (rc) {
+		LOGE("%s failed, not benchmarking it\n", name);
+		free(samples);
+		return 1;
+	}
+
+	printf("%u runs of %s%s\n", n, name, drop_caches ? ", dropping caches" : "");
+	print_bench_stats("total", samples, n);
+	for (int p = 0; p < GPT_NR_PHASES; p++)
+		print_bench_stats(phases[p], samples + (p + 1) * n, n);
+
+	free(samples);
+	return 0;
+}
+
+// Shared between the --stress processes. The writers update the slot
+// state a serial run would have left behind while still holding the GPT
+// lock, so its history follows the order they took the lock in.
+struct stress_state {
+	unsigned int failed;
+	int last_writer;
+	unsigned int active_slot;
+	uint8_t attr[2];
+};
+
+// Every LUN has to be an image file or a loop device, --stress keeps
+// switching slots
+static bool luns_are_images(void)
+{
+	struct gpt_lun luns[MAX_BLOCK_DEVICES * 4];
+	struct stat st;
+	int nr;
+
+	nr = gpt_utils_get_luns(luns, ARRAY_SIZE(luns));
+	if (nr <= 0) {
+		LOGE("No GPT disks found\n");
+		return false;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		if (stat(luns[i].devpath, &st)) {
+			LOGE("Failed to stat %s: %s\n", luns[i].devpath, strerror(errno));
+			return false;
+		}
+		if (!S_ISREG(st.st_mode) && !(S_ISBLK(st.st_mode) && major(st.st_rdev) == 7)) {
+			LOGE("%s is not an image file or loop device\n", luns[i].devpath);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Switch slots or mark the active one successful, and apply the same
+// change to the expected state
+static int stress_write(struct stress_state *state, int writer, unsigned int i)
+{
+	unsigned int slot;
+	int rc;
+
+	gpt_utils_lock(true);
+	if (i % 4 == 3) {
+		slot = impl->getActiveBootSlot();
+		rc = impl->markBootSuccessful(slot);
+		if (!rc) {
+			state->attr[slot] |= AB_PARTITION_ATTR_BOOT_SUCCESSFUL;
+			state->attr[slot] &= ~AB_PARTITION_ATTR_UNBOOTABLE;
+		}
+	} else {
+		slot = (writer + i) % 2;
+		rc = impl->setActiveBootSlot(slot, true);
+		if (!rc) {
+			state->attr[slot] = AB_SLOT_ACTIVE_VAL;
+			state->attr[!slot] &= ~AB_PARTITION_ATTR_SLOT_ACTIVE;
+			state->active_slot = slot;
+			state->last_writer = writer;
+		}
+	}
+	gpt_utils_unlock();
+
+	return rc;
+}
+
+// Readers alternate between the slot dump and -a, writers switch slots
+// and mark every fourth one successful
+static void stress_child(struct stress_state *state, uint64_t *samples, unsigned int n,
+			 int writer)
+{
+	uint64_t start;
+	int rc;
+
+	for (unsigned int i = 0; i < n; i++) {
+		start = now_nsec();
+		if (writer < 0)
+			rc = i & 1 ? bench_active() : bench_dump();
+		else
+			rc = stress_write(state, writer, i);
+		samples[i] = now_nsec() - start;
+
+		if (rc)
+			__atomic_add_fetch(&state->failed, 1, __ATOMIC_RELAXED);
+	}
+
+	// _exit() skips record_ledger()
+	ledger_append();
+	log_flush();
+	_exit(0);
+}
+
+// Check that the GPTs are intact and the slot state is the one the
+// writes leave behind when run one after another in lock order
+static int stress_check(const struct stress_state *state)
+{
+	static struct slot_audit audit;
+	int rc, lun, bad = 0;
+
+	rc = slot_audit_run(&audit);
+	if (rc < 0) {
+		LOGE("Failed to audit slots: %s\n", strerror(-rc));
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < audit.nr_luns; i++) {
+		if (audit.lun_state[i][PRIMARY_GPT] == GPT_OK &&
+		    audit.lun_state[i][SECONDARY_GPT] == GPT_OK)
+			continue;
+		printf("check: %s: primary %s, backup %s\n", audit.lun[i],
+		       gpt_state_str(audit.lun_state[i][PRIMARY_GPT]),
+		       gpt_state_str(audit.lun_state[i][SECONDARY_GPT]));
+		bad++;
+	}
+
+	if (audit.nr_bad) {
+		printf("check: %u of %u A/B pairs disagree\n", audit.nr_bad, audit.nr_pairs);
+		bad++;
+	}
+
+	if (audit.active_slot != state->active_slot) {
+		printf("check: active slot %s, but writer %d set %s last\n",
+		       impl->getSuffix(audit.active_slot), state->last_writer,
+		       impl->getSuffix(state->active_slot));
+		bad++;
+	}
+
+	for (unsigned int s = 0; s < 2; s++) {
+		if (audit.expect_attr[s] == (state->attr[s] & SLOT_AUDIT_ATTR_MASK))
+			continue;
+		printf("check: slot %s has attributes %#x instead of %#x\n", impl->getSuffix(s),
+		       audit.expect_attr[s], state->attr[s] & SLOT_AUDIT_ATTR_MASK);
+		bad++;
+	}
+
+	lun = impl->getBootLun();
+	if (lun > 0 && lun != (int)audit.active_slot + 1) {
+		printf("check: boot LUN %d doesn't match active slot %s\n", lun,
+		       impl->getSuffix(audit.active_slot));
+		bad++;
+	}
+
+	printf("check: %s\n", bad ? "FAILED" : "ok");
+	return bad ? 1 : 0;
+}
+
+// Run readers and writers as separate processes at once against the
+// same LUNs, print their throughput and latency and check the result
+static int run_stress(const char *spec)
+{
+	unsigned int readers, writers, n, procs;
+	static struct slot_audit audit;
+	struct stress_state *state;
+	uint64_t *samples, start, elapsed;
+	size_t size;
+	int status, rc = 0;
+	pid_t pid;
+
+	if (sscanf(spec, "%u,%u,%u", &readers, &writers, &n) != 3 || !n ||
+	    !(readers + writers) || readers + writers > 256)
+		return usage();
+
+	if (!luns_are_images())
+		return 1;
+	// The writers switch the boot LUN as well, which has to be the
+	// mock's. Mock builds never run on a device, so the intent record
+	// they write isn't the device's either.
+	if (!ufs_bsg_is_mock()) {
+		LOGE("--stress needs a build with -Dufs_mock=true and $%s set\n", UFS_MOCK_ENV);
+		return 1;
+	}
+
+	// The writers start from the state most pairs agree on
+	rc = slot_audit_run(&audit);
+	if (rc < 0) {
+		LOGE("Failed to audit slots: %s\n", strerror(-rc));
+		return 1;
+	}
+	if (rc) {
+		LOGE("%d A/B pairs disagree, not starting from a known state\n", rc);
+		return 1;
+	}
+	rc = 0;
+
+	procs = readers + writers;
+	size = (size_t)procs * n * sizeof(*samples) + sizeof(*state);
+	samples = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (samples == MAP_FAILED) {
+		LOGE("Failed to map %zu bytes: %s\n", size, strerror(errno));
+		return 1;
+	}
+	state = (struct stress_state *)(samples + (size_t)procs * n);
+	state->last_writer = -1;
+	state->active_slot = audit.active_slot;
+	state->attr[0] = audit.expect_attr[0];
+	state->attr[1] = audit.expect_attr[1];
+
+	// Record what finishing an interrupted switch wrote, so the
+	// children only append their own writes
+	ledger_append();
+	// Don't let the children flush the parent's buffered log records
+	log_flush();
+	start = now_nsec();
+	for (unsigned int p = 0; p < procs; p++) {
+		pid = fork();
+		if (pid < 0) {
+			LOGE("Failed to fork: %s\n", strerror(errno));
+			rc = 1;
+			break;
+		}
+		if (!pid)
+			stress_child(state, samples + (size_t)p * n, n,
+				     p < readers ? -1 : (int)(p - readers));
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			rc = 1;
+	elapsed = now_nsec() - start;
+
+	if (rc) {
+		LOGE("A stress process died\n");
+		munmap(samples, size);
+		return 1;
+	}
+
+	printf("%u readers, %u writers, %u operations each in %.1f ms\n", readers, writers, n,
+	       elapsed / 1e6);
+	if (readers) {
+		printf("reads:  %.0f ops/s\n", readers * n / (elapsed / 1e9));
+		print_bench_stats("read", samples, readers * n);
+	}
+	if (writers) {
+		printf("writes: %.0f ops/s\n", writers * n / (elapsed / 1e9));
+		print_bench_stats("write", samples + (size_t)readers * n, writers * n);
+	}
+	if (state->failed) {
+		printf("%u operations failed\n", state->failed);
+		rc = 1;
+	}
+
+	rc |= stress_check(state);
+	munmap(samples, size);
+	return rc;
+}
+
+// Run op through the async API the way an event loop would, waking up
+// every 10 ms to show the caller isn't blocked meanwhile
+static int run_async(enum bootctl_async_op op, unsigned int slot, bool ignore_missing_bsg)
+{
+	struct bootctl_async_result res;
+	struct pollfd pfd = { .events = POLLIN };
+	unsigned int ticks = 0;
+	uint64_t start;
+	int rc;
+
+	pfd.fd = bootctl_async_start();
+	if (pfd.fd < 0)
+		return pfd.fd;
+
+	start = now_nsec();
+	rc = bootctl_async_submit(op, slot, ignore_missing_bsg, NULL);
+	while (!rc) {
+		if (poll(&pfd, 1, 10) < 0 && errno != EINTR) {
+			rc = -errno;
+			break;
+		}
+		if (bootctl_async_collect(&res, 1) == 1) {
+			rc = res.rc;
+			break;
+		}
+		ticks++;
+	}
+	bootctl_async_stop();
+
+	LOGI("Completed in %.1f ms, woke up %u times meanwhile\n", (now_nsec() - start) / 1e6,
+	     ticks);
+	return rc;
+}
+
+// Commands that change the slots or the GPTs, an interrupted slot
+// switch is finished before they run
+static bool is_write_action(int action)
+{
+	return action == 's' || action == 'm' || action == 'u' || action == OPT_RESTORE ||
+	       action == OPT_REPAIR || action == OPT_STRESS;
+}
+
+// Read only commands don't touch an interrupted slot switch, but the
+// state they show is half way between two slots
+static void report_pending_switch(void)
+{
+	unsigned slot;
+
+	if (get_pending_slot_switch(&slot) > 0)
+		LOGW("An interrupted switch to slot %s is pending, run qbootctl --recover\n",
+		     impl->getSuffix(slot));
+}
+
+// Runs after flush_gpt() so its fsyncs are counted
+static void record_ledger(void)
+{
+	if (ledger_append())
+		log_flush();
+}
+
+// GPT_DURABILITY_NONE leaves syncing the written LUNs until the end
+static void flush_gpt(void)
+{
+	if (!gpt_utils_flush())
+		return;
+
+	LOGE("Failed to sync the GPT changes\n");
+	log_flush();
+	_exit(1);
+}
+
+static int dump_ufs_info(bool use_cache)
+{
+	struct ufs_info info;
+	int rc;
+
+	rc = ufs_get_info(&info, use_cache);
+	if (rc < 0) {
+		LOGE("Failed to read UFS descriptors\n");
+		return 1;
+	}
+
+	printf("UFS device %s%s:\n", info.bsg_dev, rc == 1 ? " (cached)" : "");
+	printf("\tSpec version      : %x.%02x\n", info.spec_version >> 8,
+	       info.spec_version & 0xff);
+	printf("\tManufacturer ID   : 0x%04x\n", info.manufacturer_id);
+	printf("\tManufacture date  : 0x%04x\n", info.manufacture_date);
+	printf("\tRaw capacity      : %" PRIu64 " MiB\n", info.total_raw_capacity / 2048);
+	printf("\tLUs               : %u (max %u, %u well known)\n", info.number_lu,
+	       info.max_number_lu, info.number_wlu);
+	printf("\tBoot enable       : %u\n", info.boot_enable);
+	printf("\tBoot LUN (bBootLunEn): %u\n", info.boot_lun_en);
+	printf("\tPower mode        : 0x%x\n", info.current_power_mode);
+	printf("\tActive ICC level  : %u\n", info.active_icc_level);
+	for (int i = 0; i < info.nr_units; i++) {
+		struct ufs_unit_info *unit = &info.units[i];
+
+		if (!unit->lu_enable)
+			continue;
+		printf("LU %d:\n", i);
+		printf("\tBoot LUN ID       : %u%s\n", unit->boot_lun_id,
+		       unit->boot_lun_id && unit->boot_lun_id == info.boot_lun_en ? " (active)" : "");
+		printf("\tBlock size        : %u\n", 1U << unit->log2_block_size);
+		printf("\tBlocks            : %" PRIu64 "\n", unit->block_count);
+		printf("\tWrite protect     : %u\n", unit->write_protect);
+		printf("\tMemory type       : %u\n", unit->memory_type);
+		printf("\tProvisioning type : %u\n", unit->provisioning_type);
+	}
+	if (rc == 0)
+		LOGI("Read UFS info with %u queries in %" PRIu64 " us\n", info.nr_queries,
+		     info.query_usec);
+
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
-	int optflag;
+	int optflag, action = 0;
 	int slot = -1, current_slot;
-	int rc;
+	const char *snapshot = NULL;
+	const char *metrics_file = NULL;
+	const char *bench_op = NULL;
+	const char *stress = NULL;
+	unsigned int bench_runs = 0;
+	bool drop_caches = false;
+	const char *profile = NULL;
+	int rc, verbosity = 0;
 	bool ignore_missing_bsg = false;
+	bool use_cache = true;
+	bool dry_run = false;
+	bool use_async = false;
+	int durability = GPT_DURABILITY_FULL;
+	static struct gpt_plan plan;
+	struct ufs_query_policy ufs_policy = UFS_QUERY_POLICY_DEFAULT;
+
+	while ((optflag = getopt_long(argc, argv, "hcmas:ub:n:xiv", long_options, NULL)) != -1) {
+		switch (optflag) {
+		case 'v':
+			verbosity++;
+			break;
+		case 'i':
+			ignore_missing_bsg = true;
+			break;
+		case OPT_NO_CACHE:
+			use_cache = false;
+			break;
+		case OPT_DRY_RUN:
+			dry_run = true;
+			break;
+		case OPT_ASYNC:
+			use_async = true;
+			break;
+		case OPT_NO_UDEV:
+			partlabel_set_source(PARTLABEL_SCAN);
+			break;
+		case OPT_LOOP:
+			partlabel_set_source(PARTLABEL_SCAN_LOOP);
+			break;
+		case OPT_UFS_TIMEOUT:
+			ufs_policy.timeout_ms = parseUInt(optarg);
+			if (!ufs_policy.timeout_ms)
+				return usage();
+			break;
+		case OPT_UFS_RETRIES:
+			ufs_policy.max_retries = parseUInt(optarg);
+			break;
+		case OPT_UFS_HOST:
+			ufs_bsg_set_host(parseUInt(optarg));
+			break;
+		case OPT_PROFILE:
+			profile = optarg;
+			if (!strcmp(profile, "list")) {
+				list_profiles();
+				return 0;
+			}
+			break;
+		case OPT_DURABILITY:
+			durability = gpt_utils_parse_durability(optarg);
+			if (durability < 0)
+				return usage();
+			break;
+		case OPT_DROP_CACHES:
+			drop_caches = true;
+			break;
+		case OPT_BENCH:
+			bench_runs = parseUInt(optarg);
+			if (action)
+				return usage();
+			action = OPT_BENCH;
+			break;
+		case OPT_STRESS:
+			stress = optarg;
+			if (action)
+				return usage();
+			action = OPT_STRESS;
+			break;
+		case OPT_METRICS_FILE:
+			metrics_file = optarg;
+			/* fallthrough */
+		case OPT_METRICS:
+			if (action)
+				return usage();
+			action = OPT_METRICS;
+			break;
+		case OPT_SNAPSHOT:
+		case OPT_RESTORE:
+			snapshot = optarg;
+			/* fallthrough */
+		case 's':
+		case 'b':
+		case 'n':
+			if (!snapshot)
+				slot = parseSlot(optarg);
+			/* fallthrough */
+		case 'c':
+		case 'a':
+		case 'm':
+		case 'u':
+		case 'x':
+		case OPT_UFS_INFO:
+		case OPT_VERIFY:
+		case OPT_REPAIR:
+		case OPT_AUDIT:
+		case OPT_FINGERPRINT:
+		case OPT_LEDGER:
+		case OPT_RECOVER:
+			if (action)
+				return usage();
+			action = optflag;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			return usage();
+		}
+	}
+
+	if (argc - optind > 1)
+		return usage();
+	// --bench takes the operation instead of a slot
+	if (action == OPT_BENCH)
+		bench_op = optind < argc ? argv[optind] : NULL;
+	else if (optind < argc)
+		slot = parseSlot(argv[optind]);
+	if (drop_caches && action != OPT_BENCH)
+		return usage();
+	if (use_async && action != 's' && action != 'm' && action != 'u')
+		return usage();
+	// Only the commands that write anything can be dry run
+	if (dry_run && action != 's' && action != 'm' && action != 'u' && action != OPT_RESTORE &&
+	    action != OPT_REPAIR)
+		return usage();
+
+	log_init(verbosity);
+	ufs_bsg_set_policy(&ufs_policy);
+	gpt_utils_set_durability(durability);
+	// Appends nothing unless something was written
+	atexit(record_ledger);
+	// Runs before the log is flushed at exit
+	if (durability == GPT_DURABILITY_NONE)
+		atexit(flush_gpt);
+	if (!use_cache) {
+		ufs_bsg_discover(false);
+		boot_context_get(false);
+	}
 
 	if(geteuid() != 0) {
-		fprintf(stderr, "This program must be run as root!\n");
+		LOGE("This program must be run as root!\n");
 		return 1;
 	}
 
+	// Otherwise detected when it's first needed
+	if (profile && ptn_profile_select(profile))
+		return 1;
+
+	if (action == OPT_RECOVER) {
+		rc = recover_slot_switch();
+		if (rc < 0) {
+			LOGE("Failed to finish an interrupted slot switch\n");
+			return 1;
+		}
+		printf("%s\n", rc ? "Finished an interrupted slot switch" :
+				     "No interrupted slot switch");
+		return 0;
+	}
+
+	// Before changing anything, finish a switch that a power loss
+	// interrupted. Commands that only read leave it alone and say so.
+	if (dry_run || !is_write_action(action))
+		report_pending_switch();
+	else if (recover_slot_switch() < 0)
+		LOGE("Failed to finish an interrupted slot switch\n");
+
+	// Doesn't need slots
+	if (action == OPT_UFS_INFO)
+		return dump_ufs_info(use_cache);
+
+	if (action == OPT_VERIFY)
+		return verify_gpt(false) ? 1 : 0;
+
+	if (action == OPT_AUDIT)
+		return audit_slots() ? 1 : 0;
+
+	if (action == OPT_BENCH)
+		return run_bench(bench_op, bench_runs, drop_caches);
+
+	if (action == OPT_STRESS)
+		return run_stress(stress);
+
+	if (action == OPT_LEDGER)
+		return print_ledger() ? 1 : 0;
+
+	if (action == OPT_FINGERPRINT)
+		return print_fingerprint() ? 1 : 0;
+
+	if (action == OPT_METRICS) {
+		if (metrics_file)
+			return metrics_write_file(metrics_file, impl->getBootLun()) ? 1 : 0;
+		return metrics_write(stdout, impl->getBootLun()) ? 1 : 0;
+	}
+
+	// Recorded for --metrics, unless it's a dry run
+	metrics_op_begin();
+
+	if (action == OPT_REPAIR) {
+		if (dry_run)
+			gpt_utils_set_dry_run(&plan);
+		rc = verify_gpt(true);
+		if (!dry_run)
+			metrics_op_end("repair", rc);
+		if (rc < 0)
+			return 1;
+		if (dry_run)
+			return print_write_plan(&plan);
+		return 0;
+	}
+
+	if (action == OPT_SNAPSHOT) {
+		rc = slot_snapshot_save(snapshot);
+		if (rc < 0) {
+			LOGE("Failed to save snapshot to %s\n", snapshot);
+			return 1;
+		}
+		printf("Saved snapshot to %s\n", snapshot);
+		return 0;
+	}
+
+	if (action == OPT_RESTORE) {
+		if (dry_run)
+			gpt_utils_set_dry_run(&plan);
+		rc = slot_snapshot_restore(snapshot);
+		if (!dry_run)
+			metrics_op_end("restore", rc);
+		if (rc < 0) {
+			LOGE("Failed to restore snapshot from %s\n", snapshot);
+			return 1;
+		}
+		if (dry_run)
+			return print_write_plan(&plan);
+		printf("Restored snapshot from %s\n", snapshot);
+		return 0;
+	}
+
 	current_slot = impl->getCurrentSlot();
 	if (current_slot < 0) {
-		fprintf(stderr, "No slots found, is this an A/B device?\n");
+		LOGE("No slots found, is this an A/B device?\n");
 		return 1;
 	}
 
-	switch (argc) {
-	case 1:
+	if (!action) {
 		dump_info(current_slot);
 		return 0;
-	case 2:
-		break;
-	case 3:
-		slot = parseSlot(argv[2]);
-		break;
-	default:
-		return usage();
 	}
 
-	optflag = getopt(argc, argv, "hcmas:ub:n:x");
-
-	if (slot < 0 || optflag == 'c')
+	if (slot < 0 || action == 'c')
 		slot = current_slot;
 
-	switch (optflag) {
+	if (dry_run)
+		gpt_utils_set_dry_run(&plan);
+
+	switch (action) {
 	case 'c':
 		printf("Current slot: %s\n", impl->getSuffix(slot));
 		return 0;
 	case 'a':
 		slot = impl->getActiveBootSlot();
 		printf("Active slot: %s\n", impl->getSuffix(slot));
+		print_boot_lun();
 		return 0;
 	case 'b':
 		printf("SLOT %s: is %smarked bootable\n", impl->getSuffix(slot),
@@ -188,38 +1283,44 @@ int main(int argc, char **argv)
 		printf("%s\n", impl->getSuffix(slot));
 		return 0;
 	case 's':
-		rc = impl->setActiveBootSlot(slot, ignore_missing_bsg);
+		rc = use_async ? run_async(BOOTCTL_ASYNC_SET_ACTIVE, slot, ignore_missing_bsg) :
+				 impl->setActiveBootSlot(slot, ignore_missing_bsg);
+		if (!dry_run)
+			metrics_op_end("set-active", rc);
 		if (rc < 0) {
-			fprintf(stderr, "SLOT %s: Failed to set active\n",
-				impl->getSuffix(slot));
+			LOGE("SLOT %s: Failed to set active\n", impl->getSuffix(slot));
 			return 1;
 		}
+		if (dry_run)
+			return print_write_plan(&plan);
 		printf("SLOT %d: Set as active slot\n", slot);
 		return 0;
 	case 'm':
-		rc = impl->markBootSuccessful(slot);
+		rc = use_async ? run_async(BOOTCTL_ASYNC_MARK_SUCCESSFUL, slot, false) :
+				 impl->markBootSuccessful(slot);
+		if (!dry_run)
+			metrics_op_end("mark-successful", rc);
 		if (rc < 0)
 			return 1;
+		if (dry_run)
+			return print_write_plan(&plan);
 		printf("SLOT %s: Marked boot successful\n",
 		       impl->getSuffix(slot));
 		return 0;
 	case 'u':
-		rc = impl->setSlotAsUnbootable(slot);
+		rc = use_async ? run_async(BOOTCTL_ASYNC_SET_UNBOOTABLE, slot, false) :
+				 impl->setSlotAsUnbootable(slot);
+		if (!dry_run)
+			metrics_op_end("set-unbootable", rc);
 		if (rc < 0) {
-			fprintf(stderr,
-				"SLOT %s: Failed to set as unbootable\n",
-				impl->getSuffix(slot));
+			LOGE("SLOT %s: Failed to set as unbootable\n",
+			     impl->getSuffix(slot));
 			return 1;
 		}
+		if (dry_run)
+			return print_write_plan(&plan);
 		printf("SLOT %s: Set as unbootable\n", impl->getSuffix(slot));
 		return 0;
-	case 'i':
-		ignore_missing_bsg = true;
-		break;
-	case 'h':
-	default:
-		usage();
-		return 0;
 	}
 
 	return 0;
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32.h"
+#include "gpt-utils.h"
+#include "log.h"
+#include "ptn-profile.h"
+#include "slot-audit.h"
+
+typedef uint8_t audit_vec __attribute__((vector_size(16)));
+
+static bool slot_audit_managed(const char *name)
+{
+	for (unsigned int i = 0; i < ptn_profile_count(); i++)
+		if (!strcmp(name, ptn_profile_ptn(i)))
+			return true;
+
+	return false;
+}
+
+// Collect every managed A/B pair from the primary table of disk
+static void slot_audit_add_disk(struct slot_audit *audit, struct gpt_disk *disk)
+{
+	uint32_t count = disk->pentry_arr_size / disk->pentry_size;
+	char name[MAX_GPT_NAME_SIZE / 2 + 1];
+	uint8_t *pentry, *pentry_b;
+	unsigned int n, j;
+
+	for (uint32_t i = 0; i < count; i++) {
+		pentry = disk->pentry_arr + i * disk->pentry_size;
+		/* UTF-16, ignoring the 2nd byte like gpt_pentry_seek() */
+		for (j = 0; j < sizeof(name) - 1; j++)
+			name[j] = pentry[PARTITION_NAME_OFFSET + j * 2];
+		name[j] = '\0';
+
+		if (!name[0] || !slot_audit_managed(name))
+			continue;
+
+		name[strlen(name) - 1] = 'b';
+		pentry_b = gpt_disk_get_pentry(disk, name, PRIMARY_GPT);
+		if (!pentry_b) {
+			LOGW("%s: %s has no B partition\n", disk->devpath, name);
+			continue;
+		}
+
+		if (audit->nr_pairs == SLOT_AUDIT_MAX) {
+			LOGW("%s: Too many A/B pairs, not auditing %s\n", __func__, name);
+			continue;
+		}
+
+		n = audit->nr_pairs++;
+		name[strlen(name) - 2] = '\0';
+		snprintf(audit->name[n], sizeof(audit->name[n]), "%.*s",
+			 (int)sizeof(audit->name[n]) - 1, name);
+		snprintf(audit->devpath[n], sizeof(audit->devpath[n]), "%.*s",
+			 (int)sizeof(audit->devpath[n]) - 1, disk->devpath);
+		audit->attr[0][n] = pentry[AB_FLAG_OFFSET];
+		audit->attr[1][n] = pentry_b[AB_FLAG_OFFSET];
+		memcpy(audit->type_guid[0][n], pentry + TYPE_GUID_OFFSET, TYPE_GUID_SIZE);
+		memcpy(audit->type_guid[1][n], pentry_b + TYPE_GUID_OFFSET, TYPE_GUID_SIZE);
+	}
+}
+
+// The type GUID given to inactive partitions is the only one that's
+// shared between partitions, every real type GUID is unique. Pick the
+// one that shows up most often.
+static void slot_audit_find_inactive_guid(struct slot_audit *audit)
+{
+	const uint8_t *guid, *best = NULL;
+	unsigned int count, best_count = 1;
+
+	for (unsigned int i = 0; i < audit->nr_pairs * 2; i++) {
+		guid = audit->type_guid[i & 1][i / 2];
+		count = 0;
+		for (unsigned int j = 0; j < audit->nr_pairs * 2; j++)
+			count += !memcmp(guid, audit->type_guid[j & 1][j / 2], TYPE_GUID_SIZE);
+		if (count > best_count) {
+			best = guid;
+			best_count = count;
+		}
+	}
+
+	audit->have_inactive_guid = best != NULL;
+	for (unsigned int s = 0; best && s < 2; s++)
+		for (unsigned int i = 0; i < audit->nr_pairs; i++)
+			audit->inactive_guid[s][i] =
+				!memcmp(best, audit->type_guid[s][i], TYPE_GUID_SIZE);
+}
+
+// Majority vote over every pair for the active slot and every
+// attribute bit of both slots. On a tie the boot partition decides.
+static void slot_audit_consensus(struct slot_audit *audit)
+{
+	unsigned int bits[2][8] = { { 0 } }, guids[2] = { 0 };
+	unsigned int half = audit->nr_pairs / 2, boot = 0;
+
+	for (unsigned int i = 0; i < audit->nr_pairs; i++) {
+		if (!strcmp(audit->name[i], "boot"))
+			boot = i;
+		for (unsigned int s = 0; s < 2; s++) {
+			for (unsigned int b = 0; b < 8; b++)
+				bits[s][b] += (audit->attr[s][i] >> b) & 1;
+			guids[s] += audit->inactive_guid[s][i];
+		}
+	}
+
+	for (unsigned int s = 0; s < 2; s++) {
+		audit->expect_attr[s] = 0;
+		for (unsigned int b = 0; b < 8; b++)
+			if (bits[s][b] > half ||
+			    (bits[s][b] == audit->nr_pairs - bits[s][b] &&
+			     (audit->attr[s][boot] >> b) & 1))
+				audit->expect_attr[s] |= 1 << b;
+		audit->expect_attr[s] &= SLOT_AUDIT_ATTR_MASK;
+		audit->expect_inactive_guid[s] = guids[s] > half;
+	}
+
+	// Exactly one slot is active
+	audit->active_slot = !(audit->expect_attr[0] & AB_PARTITION_ATTR_SLOT_ACTIVE) &&
+			     (audit->expect_attr[1] & AB_PARTITION_ATTR_SLOT_ACTIVE);
+	audit->expect_attr[!audit->active_slot] &= ~AB_PARTITION_ATTR_SLOT_ACTIVE;
+	audit->expect_attr[audit->active_slot] |= AB_PARTITION_ATTR_SLOT_ACTIVE;
+}
+
+// Compare 16 pairs at a time against the expected state, mapping the
+// differing attribute bits to SLOT_AUDIT_* reasons.
+static void slot_audit_scan(struct slot_audit *audit)
+{
+	const audit_vec mask = (audit_vec){} + SLOT_AUDIT_ATTR_MASK;
+	const audit_vec expect_a = (audit_vec){} + audit->expect_attr[0];
+	const audit_vec expect_b = (audit_vec){} + audit->expect_attr[1];
+	const audit_vec guid_a = (audit_vec){} + audit->expect_inactive_guid[0];
+	const audit_vec guid_b = (audit_vec){} + audit->expect_inactive_guid[1];
+	audit_vec a, b, ga, gb, diff, bad;
+
+	audit->nr_bad = 0;
+	for (unsigned int i = 0; i < audit->nr_pairs; i += sizeof(audit_vec)) {
+		memcpy(&a, &audit->attr[0][i], sizeof(a));
+		memcpy(&b, &audit->attr[1][i], sizeof(b));
+		memcpy(&ga, &audit->inactive_guid[0][i], sizeof(ga));
+		memcpy(&gb, &audit->inactive_guid[1][i], sizeof(gb));
+
+		diff = ((a & mask) ^ expect_a) | ((b & mask) ^ expect_b);
+		bad = ((diff >> 2) & 1) * SLOT_AUDIT_ACTIVE;
+		bad |= ((diff >> 6) & 1) * SLOT_AUDIT_SUCCESSFUL;
+		bad |= ((diff >> 7) & 1) * SLOT_AUDIT_UNBOOTABLE;
+		if (audit->have_inactive_guid)
+			bad |= ((ga ^ guid_a) | (gb ^ guid_b)) * SLOT_AUDIT_GUID;
+
+		memcpy(&audit->bad[i], &bad, sizeof(bad));
+	}
+
+	// The padding after the last pair doesn't count
+	memset(&audit->bad[audit->nr_pairs], 0, SLOT_AUDIT_MAX - audit->nr_pairs);
+	for (unsigned int i = 0; i < audit->nr_pairs; i++)
+		audit->nr_bad += !!audit->bad[i];
+}
+
+uint32_t slot_audit_fingerprint(const struct slot_audit *audit, int boot_lun)
+{
+	static uint8_t buf[SLOT_AUDIT_MAX * (MAX_GPT_NAME_SIZE / 2 + 2 * (TYPE_GUID_SIZE + 1)) + 4];
+	unsigned int order[SLOT_AUDIT_MAX], n, len = 0;
+	int32_t lun = boot_lun;
+
+	// Insertion sort, there are only a few dozen pairs
+	for (unsigned int i = 0; i < audit->nr_pairs; i++) {
+		for (n = i; n > 0 && strcmp(audit->name[order[n - 1]], audit->name[i]) > 0; n--)
+			order[n] = order[n - 1];
+		order[n] = i;
+	}
+
+	for (unsigned int i = 0; i < audit->nr_pairs; i++) {
+		n = order[i];
+		// slot_audit_run() zeroes the names, every pair takes the same space
+		memcpy(buf + len, audit->name[n], sizeof(audit->name[n]));
+		len += sizeof(audit->name[n]);
+		for (unsigned int s = 0; s < 2; s++) {
+			memcpy(buf + len, audit->type_guid[s][n], TYPE_GUID_SIZE);
+			len += TYPE_GUID_SIZE;
+			buf[len++] = audit->attr[s][n];
+		}
+	}
+
+	buf[len++] = lun;
+	buf[len++] = lun >> 8;
+	buf[len++] = lun >> 16;
+	buf[len++] = lun >> 24;
+
+	return efi_crc32(buf, len);
+}
+
+int slot_audit_run(struct slot_audit *audit)
+{
+	struct gpt_lun luns[SLOT_AUDIT_MAX_LUNS];
+	struct gpt_verify_result result;
+	struct gpt_disk disk = { 0 };
+	struct timespec start, end;
+	int nr;
+
+	memset(audit, 0, sizeof(*audit));
+
+	nr = gpt_utils_get_luns(luns, ARRAY_SIZE(luns));
+	if (nr < 0)
+		return nr;
+
+	gpt_utils_lock(false);
+	for (int i = 0; i < nr; i++) {
+		if (gpt_disk_get_disk_info(luns[i].part, &disk) < 0) {
+			gpt_disk_free(&disk);
+			gpt_utils_unlock();
+			return -EIO;
+		}
+		slot_audit_add_disk(audit, &disk);
+
+		gpt_disk_verify(&disk, &result);
+		snprintf(audit->lun[i], sizeof(audit->lun[i]), "%.*s",
+			 (int)sizeof(audit->lun[i]) - 1, luns[i].devpath);
+		audit->lun_state[i][PRIMARY_GPT] = result.state[PRIMARY_GPT];
+		audit->lun_state[i][SECONDARY_GPT] = result.state[SECONDARY_GPT];
+		audit->nr_luns++;
+	}
+	gpt_disk_free(&disk);
+	gpt_utils_unlock();
+
+	if (!audit->nr_pairs)
+		return -ENOENT;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	slot_audit_find_inactive_guid(audit);
+	slot_audit_consensus(audit);
+	slot_audit_scan(audit);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	audit->scan_nsec = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec -
+			   start.tv_nsec;
+	LOGI("Audited %u A/B pairs in %llu ns\n", audit->nr_pairs,
+	     (unsigned long long)audit->scan_nsec);
+
+	return audit->nr_bad;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SLOT_AUDIT_H__
+#define __SLOT_AUDIT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gpt-utils.h"
+
+// Multiple of 16 so the scan never needs a scalar tail
+#define SLOT_AUDIT_MAX 64
+#define SLOT_AUDIT_MAX_LUNS (MAX_BLOCK_DEVICES * 4)
+
+// Reasons an A/B pair disagrees with the rest of the slot
+#define SLOT_AUDIT_ACTIVE     (1 << 0)
+#define SLOT_AUDIT_SUCCESSFUL (1 << 1)
+#define SLOT_AUDIT_UNBOOTABLE (1 << 2)
+#define SLOT_AUDIT_GUID	      (1 << 3)
+
+// The attribute bits that are compared, the rest are the priority and retry count
+#define SLOT_AUDIT_ATTR_MASK                                                                       \
+	(AB_PARTITION_ATTR_SLOT_ACTIVE | AB_PARTITION_ATTR_BOOT_SUCCESSFUL |                       \
+	 AB_PARTITION_ATTR_UNBOOTABLE)
+
+/*
+ * Slot state of every A/B partition of the profile, gathered from the
+ * primary GPT of every LUN. Indexed by [slot][pair] so the attributes
+ * of all partitions of one slot are contiguous.
+ */
+struct slot_audit {
+	unsigned int nr_pairs;
+	char name[SLOT_AUDIT_MAX][MAX_GPT_NAME_SIZE / 2];
+	char devpath[SLOT_AUDIT_MAX][GPT_PTN_PATH_MAX];
+	uint8_t attr[2][SLOT_AUDIT_MAX];
+	// 1 if the entry has the type GUID of an inactive partition
+	uint8_t inactive_guid[2][SLOT_AUDIT_MAX];
+	uint8_t type_guid[2][SLOT_AUDIT_MAX][TYPE_GUID_SIZE];
+
+	// The state most pairs agree on
+	unsigned int active_slot;
+	uint8_t expect_attr[2];
+	uint8_t expect_inactive_guid[2];
+	bool have_inactive_guid;
+
+	// SLOT_AUDIT_* bits for every pair
+	uint8_t bad[SLOT_AUDIT_MAX];
+	unsigned int nr_bad;
+	uint64_t scan_nsec;
+
+	// enum gpt_state of both GPT copies of every LUN
+	unsigned int nr_luns;
+	char lun[SLOT_AUDIT_MAX_LUNS][GPT_PTN_PATH_MAX];
+	uint8_t lun_state[SLOT_AUDIT_MAX_LUNS][2];
+};
+
+// Load every LUN once, check all A/B pairs against the consensus and
+// verify both GPT copies.
+// Returns the number of pairs that disagree or -errno.
+int slot_audit_run(struct slot_audit *audit);
+
+// Bumped whenever the fingerprint input changes
+#define SLOT_FINGERPRINT_VERSION 1
+
+// CRC32 over the name, type GUIDs and AB attribute bytes of every pair in
+// name order and the boot LUN (-EOPNOTSUPP on eMMC). Doesn't depend on
+// which LUN a partition is on or the order the LUNs were found in.
+uint32_t slot_audit_fingerprint(const struct slot_audit *audit, int boot_lun);
+
+#endif // __SLOT_AUDIT_H__
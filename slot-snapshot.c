@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "gpt-utils.h"
+#include "log.h"
+#include "partlabel.h"
+#include "slot-snapshot.h"
+#include "ufs-bsg.h"
+
+struct snapshot_item {
+	struct slot_snapshot_entry entry;
+	char devpath[GPT_PTN_PATH_MAX];
+	unsigned int order;
+};
+
+// Group the entries by LUN so a restore loads every LUN only once,
+// keeping the profile order within a LUN.
+static int snapshot_item_cmp(const void *a, const void *b)
+{
+	const struct snapshot_item *ia = a, *ib = b;
+	int rc = strcmp(ia->devpath, ib->devpath);
+
+	return rc ?: (int)ia->order - (int)ib->order;
+}
+
+// Fill in entry from both GPT copies of the partition name on disk
+static int snapshot_read_entry(struct gpt_disk *disk, const char *name,
+			       struct slot_snapshot_entry *entry)
+{
+	uint8_t *pentry;
+
+	if (gpt_disk_get_disk_info(name, disk) < 0)
+		return -EIO;
+
+	memset(entry, 0, sizeof(*entry));
+	snprintf(entry->name, sizeof(entry->name), "%.*s", (int)sizeof(entry->name) - 1, name);
+	for (int i = PRIMARY_GPT; i <= SECONDARY_GPT; i++) {
+		pentry = gpt_disk_get_pentry(disk, name, i);
+		if (!pentry) {
+			LOGE("%s: No %s GPT entry for %s\n", __func__,
+			     i == PRIMARY_GPT ? "primary" : "backup", name);
+			return -ENOENT;
+		}
+		memcpy(entry->type_guid[i], pentry + TYPE_GUID_OFFSET, TYPE_GUID_SIZE);
+		entry->attr[i] = pentry[AB_FLAG_OFFSET];
+	}
+
+	return 0;
+}
+
+int slot_snapshot_save(const char *path)
+{
+	static struct snapshot_item items[SLOT_SNAPSHOT_MAX];
+	struct slot_snapshot_entry entries[SLOT_SNAPSHOT_MAX];
+	struct slot_snapshot_hdr hdr = {
+		.magic = htole32(SLOT_SNAPSHOT_MAGIC),
+		.version = htole16(SLOT_SNAPSHOT_VERSION),
+	};
+	struct gpt_disk disk = { 0 };
+	char name[MAX_GPT_NAME_SIZE + 1];
+	char tmp[PATH_MAX];
+	struct iovec iov[2];
+	unsigned int nr = 0;
+	uint8_t boot_lun;
+	int fd, rc = 0;
+
+	// Don't capture a slot switch that's half done
+	gpt_utils_lock(false);
+	for (unsigned int i = 0; i < ptn_profile_count(); i++) {
+		if (!ptn_profile_present(i, 0) || !ptn_profile_present(i, 1))
+			continue;
+		snprintf(name, sizeof(name), "%s", ptn_profile_ptn(i));
+
+		for (int slot = 0; slot < 2; slot++) {
+			name[strlen(name) - 1] = slot ? 'b' : 'a';
+			rc = snapshot_read_entry(&disk, name, &items[nr].entry);
+			if (rc)
+				goto unlock;
+			snprintf(items[nr].devpath, sizeof(items[nr].devpath), "%.*s",
+				 (int)sizeof(items[nr].devpath) - 1, disk.devpath);
+			items[nr].order = nr;
+			nr++;
+		}
+	}
+
+	qsort(items, nr, sizeof(items[0]), snapshot_item_cmp);
+	for (unsigned int i = 0; i < nr; i++)
+		entries[i] = items[i].entry;
+
+	if (!ptn_profile_is_emmc()) {
+		rc = get_boot_lun(&boot_lun);
+		if (rc) {
+			LOGE("%s: Failed to read the boot LUN: %d\n", __func__, rc);
+			goto unlock;
+		}
+		hdr.boot_lun = boot_lun;
+	}
+
+unlock:
+	gpt_disk_free(&disk);
+	gpt_utils_unlock();
+	if (rc)
+		return rc;
+
+	hdr.nr_entries = htole16(nr);
+	hdr.crc = htole32(efi_crc32((uint8_t *)entries, nr * sizeof(entries[0])));
+
+	iov[0] = (struct iovec){ .iov_base = &hdr, .iov_len = sizeof(hdr) };
+	iov[1] = (struct iovec){ .iov_base = entries, .iov_len = nr * sizeof(entries[0]) };
+
+	// Replace the snapshot atomically, a half written one is useless
+	// when it's needed most.
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		rc = -errno;
+		LOGE("%s: Failed to open %s: %s\n", __func__, tmp, strerror(-rc));
+		return rc;
+	}
+	if (writev(fd, iov, 2) != (ssize_t)(iov[0].iov_len + iov[1].iov_len) || fsync(fd)) {
+		rc = -EIO;
+		LOGE("%s: Failed to write %s: %s\n", __func__, tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return rc;
+	}
+	close(fd);
+
+	if (rename(tmp, path)) {
+		rc = -errno;
+		LOGE("%s: Failed to rename %s: %s\n", __func__, tmp, strerror(-rc));
+		unlink(tmp);
+		return rc;
+	}
+
+	LOGI("Saved %u entries and boot LUN %u to %s\n", nr, hdr.boot_lun, path);
+	return 0;
+}
+
+static int snapshot_load(const char *path, struct slot_snapshot_hdr *hdr,
+			 struct slot_snapshot_entry *entries)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = hdr, .iov_len = sizeof(*hdr) },
+		{ .iov_base = entries, .iov_len = SLOT_SNAPSHOT_MAX * sizeof(*entries) },
+	};
+	ssize_t len;
+	int fd, rc;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		rc = -errno;
+		LOGE("%s: Failed to open %s: %s\n", __func__, path, strerror(-rc));
+		return rc;
+	}
+	len = readv(fd, iov, 2);
+	close(fd);
+
+	hdr->magic = le32toh(hdr->magic);
+	hdr->version = le16toh(hdr->version);
+	hdr->nr_entries = le16toh(hdr->nr_entries);
+	hdr->crc = le32toh(hdr->crc);
+
+	if (len < (ssize_t)sizeof(*hdr) || hdr->magic != SLOT_SNAPSHOT_MAGIC ||
+	    hdr->version != SLOT_SNAPSHOT_VERSION || hdr->nr_entries > SLOT_SNAPSHOT_MAX ||
+	    len != (ssize_t)(sizeof(*hdr) + hdr->nr_entries * sizeof(*entries)) ||
+	    hdr->crc != efi_crc32((uint8_t *)entries, hdr->nr_entries * sizeof(*entries))) {
+		LOGE("%s: %s is not a valid snapshot\n", __func__, path);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int slot_snapshot_restore(const char *path)
+{
+	struct slot_snapshot_entry entries[SLOT_SNAPSHOT_MAX];
+	struct slot_snapshot_hdr hdr;
+	struct gpt_disk disk = { 0 };
+	unsigned int changed = 0;
+	uint8_t *pentry;
+	int rc;
+
+	rc = snapshot_load(path, &hdr, entries);
+	if (rc)
+		return rc;
+
+	// Don't start writing unless every partition is still there
+	for (unsigned int i = 0; i < hdr.nr_entries; i++) {
+		entries[i].name[sizeof(entries[i].name) - 1] = '\0';
+		if (!partlabel_exists(entries[i].name)) {
+			LOGE("%s: Partition %s from the snapshot doesn't exist\n", __func__,
+			     entries[i].name);
+			return -ENOENT;
+		}
+	}
+
+	gpt_utils_lock(true);
+	for (unsigned int i = 0; i < hdr.nr_entries; i++) {
+		struct slot_snapshot_entry *entry = &entries[i];
+
+		// Commits the previous LUN when moving on to the next one
+		if (gpt_disk_get_disk_info(entry->name, &disk) < 0) {
+			rc = -EIO;
+			goto out;
+		}
+
+		for (int inst = PRIMARY_GPT; inst <= SECONDARY_GPT; inst++) {
+			pentry = gpt_disk_get_pentry(&disk, entry->name, inst);
+			if (!pentry) {
+				rc = -ENOENT;
+				goto out;
+			}
+			if (!memcmp(pentry + TYPE_GUID_OFFSET, entry->type_guid[inst],
+				    TYPE_GUID_SIZE) &&
+			    pentry[AB_FLAG_OFFSET] == entry->attr[inst])
+				continue;
+
+			LOGI("%s (%s): attr 0x%02x -> 0x%02x\n", entry->name,
+			     inst == PRIMARY_GPT ? "primary" : "backup", pentry[AB_FLAG_OFFSET],
+			     entry->attr[inst]);
+			memcpy(pentry + TYPE_GUID_OFFSET, entry->type_guid[inst], TYPE_GUID_SIZE);
+			pentry[AB_FLAG_OFFSET] = entry->attr[inst];
+			changed++;
+		}
+	}
+
+	if (gpt_disk_is_valid(&disk) && gpt_disk_commit(&disk)) {
+		rc = -EIO;
+		goto out;
+	}
+
+	if (hdr.boot_lun) {
+		rc = gpt_utils_set_xbl_boot_partition(hdr.boot_lun == 2 ? BACKUP_BOOT :
+									 NORMAL_BOOT);
+		if (rc) {
+			LOGE("%s: Failed to restore boot LUN %u\n", __func__, hdr.boot_lun);
+			goto out;
+		}
+	}
+
+	LOGI("Restored %u of %u entries from %s\n", changed, hdr.nr_entries * 2, path);
+
+out:
+	gpt_disk_free(&disk);
+	gpt_utils_unlock();
+	return rc;
+}
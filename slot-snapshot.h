@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SLOT_SNAPSHOT_H__
+#define __SLOT_SNAPSHOT_H__
+
+#include <stdint.h>
+
+#include "gpt-utils.h"
+#include "ptn-profile.h"
+
+/*
+ * A snapshot holds the slot relevant state of every A/B partition of
+ * the partition profile: the type GUID and AB attribute byte from both GPT copies,
+ * plus the UFS boot LUN. All fields are little endian.
+ */
+#define SLOT_SNAPSHOT_MAGIC   0x4e534251 // "QBSN"
+#define SLOT_SNAPSHOT_VERSION 1
+#define SLOT_SNAPSHOT_MAX     (PTN_PROFILE_MAX * 2)
+
+struct slot_snapshot_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t nr_entries;
+	// bBootLunEn, 0 if there is none (eMMC)
+	uint8_t boot_lun;
+	uint8_t reserved[3];
+	// CRC32 of the entries
+	uint32_t crc;
+} __attribute__((packed));
+
+struct slot_snapshot_entry {
+	char name[MAX_GPT_NAME_SIZE / 2];
+	uint8_t type_guid[2][TYPE_GUID_SIZE];
+	uint8_t attr[2];
+} __attribute__((packed));
+
+// Save the current state to path. Returns 0 on success, -errno on error.
+int slot_snapshot_save(const char *path);
+
+// Write back every entry (and the boot LUN) that differs from the
+// snapshot at path, LUNs without any differences aren't written to.
+// Returns 0 on success, -errno on error.
+int slot_snapshot_restore(const char *path);
+
+#endif // __SLOT_SNAPSHOT_H__
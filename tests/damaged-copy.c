@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * With the backup entry array of one LUN damaged, everything that only
+ * reads has to leave every LUN as it is, whichever order the LUNs are
+ * visited in. The next write to that LUN brings the backup copy back.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bootctrl.h"
+#include "gpt-utils.h"
+#include "log.h"
+#include "ptn-profile.h"
+#include "slot-audit.h"
+#include "test-images.h"
+
+static const char *const lun_paths[] = { "dev/sda", "dev/sdb", "dev/sdc", "dev/sde" };
+
+#define IMG_SIZE (256 * 512)
+
+static void read_luns(uint8_t (*imgs)[IMG_SIZE])
+{
+	int fd;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(lun_paths); i++) {
+		fd = open(lun_paths[i], O_RDONLY);
+		CHECK(fd >= 0);
+		CHECK(read(fd, imgs[i], IMG_SIZE) == IMG_SIZE);
+		close(fd);
+	}
+}
+
+static uint32_t total_commits(void)
+{
+	const struct gpt_io_stats *stats;
+	unsigned int nr = gpt_utils_io_stats(&stats);
+	uint32_t commits = 0;
+
+	for (unsigned int i = 0; i < nr; i++)
+		commits += stats[i].commits;
+
+	return commits;
+}
+
+// Like --verify, which visits the damaged LUN first and commits
+// nothing when moving on to the next one
+static unsigned int verify_luns(void)
+{
+	struct gpt_lun luns[MAX_BLOCK_DEVICES * 4];
+	struct gpt_verify_result result;
+	struct gpt_disk disk = { 0 };
+	unsigned int bad = 0;
+	int nr;
+
+	nr = gpt_utils_get_luns(luns, ARRAY_SIZE(luns));
+	CHECK(nr == ARRAY_SIZE(lun_paths));
+
+	gpt_utils_lock(false);
+	for (int i = 0; i < nr; i++) {
+		CHECK(gpt_disk_get_disk_info(luns[i].part, &disk) == 0);
+		bad += !gpt_disk_verify(&disk, &result);
+	}
+	gpt_disk_free(&disk);
+	gpt_utils_unlock();
+
+	return bad;
+}
+
+int main(void)
+{
+	static uint8_t before[ARRAY_SIZE(lun_paths)][IMG_SIZE];
+	static uint8_t after[ARRAY_SIZE(lun_paths)][IMG_SIZE];
+	static struct slot_audit audit;
+	uint32_t commits;
+
+	log_init(0);
+	CHECK(test_images_create() == 0);
+	CHECK(ptn_profile_select("generic") == 0);
+	CHECK(test_images_damage_backup("sda") == 0);
+
+	read_luns(before);
+	commits = total_commits();
+
+	CHECK(verify_luns() == 1);
+	CHECK(slot_audit_run(&audit) == 0);
+	CHECK(audit.nr_luns == ARRAY_SIZE(lun_paths));
+	CHECK(bootctl.getActiveBootSlot() == 0);
+	CHECK(bootctl.isSlotMarkedSuccessful(0) == 1);
+
+	read_luns(after);
+	CHECK(total_commits() == commits);
+	CHECK(!memcmp(before, after, sizeof(before)));
+
+	// Writing to the LUN repairs the damaged copy along the way
+	CHECK(bootctl.setSlotAsUnbootable(1) == 0);
+	CHECK(verify_luns() == 0);
+	CHECK(bootctl.isSlotBootable(1) == 0);
+
+	test_images_remove();
+	return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Apply the same attribute updates once call by call and once through
+ * bootctl_update_attributes(). Both have to end in the same slot state
+ * with the same result for every request, but the batch may only
+ * commit each LUN once.
+ */
+
+#include <string.h>
+
+#include "bootctrl.h"
+#include "gpt-utils.h"
+#include "log.h"
+#include "ptn-profile.h"
+#include "slot-audit.h"
+#include "test-images.h"
+
+#define NR_LUNS 26
+
+static const struct bootctl_attr_req updates[] = {
+	{ .slot = 1, .op = BOOTCTL_ATTR_SET_UNBOOTABLE },
+	{ .slot = 1, .op = BOOTCTL_ATTR_MARK_SUCCESSFUL },
+	{ .slot = 0, .op = BOOTCTL_ATTR_SET_UNBOOTABLE },
+	{ .slot = 0, .op = BOOTCTL_ATTR_MARK_SUCCESSFUL },
+	{ .slot = 1, .op = BOOTCTL_ATTR_SET_UNBOOTABLE },
+	// No such slots, only these may fail
+	{ .slot = 2, .op = BOOTCTL_ATTR_MARK_SUCCESSFUL },
+	{ .slot = 3, .op = BOOTCTL_ATTR_MARK_SUCCESSFUL },
+};
+
+struct io_count {
+	unsigned int nr;
+	uint32_t commits[NR_LUNS];
+	uint32_t fsyncs[NR_LUNS];
+};
+
+static void io_count_take(struct io_count *count)
+{
+	const struct gpt_io_stats *stats;
+
+	count->nr = gpt_utils_io_stats(&stats);
+	CHECK(count->nr <= NR_LUNS);
+	for (unsigned int i = 0; i < count->nr; i++) {
+		count->commits[i] = stats[i].commits;
+		count->fsyncs[i] = stats[i].fsyncs;
+	}
+}
+
+// Turn the totals in after into what happened since before
+static void io_count_since(struct io_count *after, const struct io_count *before)
+{
+	for (unsigned int i = 0; i < before->nr; i++) {
+		after->commits[i] -= before->commits[i];
+		after->fsyncs[i] -= before->fsyncs[i];
+	}
+}
+
+static uint32_t io_count_sum(const uint32_t *vals, unsigned int nr)
+{
+	uint32_t sum = 0;
+
+	for (unsigned int i = 0; i < nr; i++)
+		sum += vals[i];
+
+	return sum;
+}
+
+int main(void)
+{
+	static struct slot_audit serial, grouped;
+	struct bootctl_attr_req reqs[ARRAY_SIZE(updates)];
+	int serial_rc[ARRAY_SIZE(updates)];
+	struct io_count before, serial_io, grouped_io;
+	unsigned int touched = 0;
+
+	log_init(0);
+	CHECK(test_images_create() == 0);
+	CHECK(ptn_profile_select("generic") == 0);
+
+	io_count_take(&before);
+	for (unsigned int i = 0; i < ARRAY_SIZE(updates); i++) {
+		if (updates[i].op == BOOTCTL_ATTR_MARK_SUCCESSFUL)
+			serial_rc[i] = bootctl.markBootSuccessful(updates[i].slot);
+		else
+			serial_rc[i] = bootctl.setSlotAsUnbootable(updates[i].slot);
+	}
+	io_count_take(&serial_io);
+	io_count_since(&serial_io, &before);
+	CHECK(slot_audit_run(&serial) == 0);
+
+	CHECK(test_images_reset() == 0);
+	memcpy(reqs, updates, sizeof(reqs));
+	io_count_take(&before);
+	CHECK(bootctl_update_attributes(reqs, ARRAY_SIZE(reqs)) == 2);
+	io_count_take(&grouped_io);
+	io_count_since(&grouped_io, &before);
+	CHECK(slot_audit_run(&grouped) == 0);
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(updates); i++) {
+		CHECK(reqs[i].rc == serial_rc[i]);
+		CHECK(reqs[i].rc == (updates[i].slot > 1 ? -1 : 0));
+	}
+
+	CHECK(grouped.nr_pairs == serial.nr_pairs);
+	CHECK(!memcmp(grouped.attr, serial.attr, sizeof(grouped.attr)));
+	CHECK(slot_audit_fingerprint(&grouped, 0) == slot_audit_fingerprint(&serial, 0));
+	CHECK(grouped.expect_attr[1] & AB_PARTITION_ATTR_UNBOOTABLE);
+
+	// Once per LUN holding A/B partitions, however many requests
+	// there are
+	for (unsigned int i = 0; i < grouped_io.nr; i++) {
+		CHECK(grouped_io.commits[i] <= 1);
+		touched += grouped_io.commits[i];
+	}
+	CHECK(touched == 2);
+	CHECK(io_count_sum(serial_io.commits, serial_io.nr) == 5 * touched);
+	CHECK(io_count_sum(grouped_io.fsyncs, grouped_io.nr) <
+	      io_count_sum(serial_io.fsyncs, serial_io.nr));
+
+	printf("%u updates: %u commits, %u fsyncs serially, %u commits, %u fsyncs grouped\n",
+	       (unsigned int)ARRAY_SIZE(updates), io_count_sum(serial_io.commits, serial_io.nr),
+	       io_count_sum(serial_io.fsyncs, serial_io.nr), touched,
+	       io_count_sum(grouped_io.fsyncs, grouped_io.nr));
+
+	test_images_remove();
+	return 0;
+}
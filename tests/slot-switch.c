@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Switch slots back and forth on image files, with the boot LUN on the
+ * mock UFS device. The mock is slow and fails some queries, which the
+ * retries have to absorb; a device that fails every query has to fail
+ * the switch before any GPT is written.
+ */
+
+#include <errno.h>
+
+#include "bootctrl.h"
+#include "log.h"
+#include "ptn-profile.h"
+#include "slot-audit.h"
+#include "test-images.h"
+#include "ufs-bsg.h"
+
+static void check_slot(unsigned int slot)
+{
+	static struct slot_audit audit;
+	uint32_t boot_lun;
+
+	CHECK(bootctl.getActiveBootSlot() == slot);
+	CHECK(ufs_mock_get_attr(QUERY_ATTR_IDN_BOOT_LU_EN, &boot_lun) == 0);
+	CHECK(boot_lun == slot + 1);
+	CHECK(slot_audit_run(&audit) == 0);
+	CHECK(audit.nr_bad == 0);
+	CHECK(audit.active_slot == slot);
+}
+
+static unsigned int injected_errors(void)
+{
+	const struct ufs_mock_record *records;
+	unsigned int nr, errors = 0;
+
+	records = ufs_mock_get_records(&nr);
+	for (unsigned int i = 0; i < nr; i++)
+		errors += records[i].injected_error;
+
+	return errors;
+}
+
+int main(void)
+{
+	struct ufs_mock_config config = {
+		.latency_us = 500,
+		.error_rate = 0.3,
+		.seed = 1,
+		// Keeps the boot LUN across ufs_mock_configure()
+		.state_path = "ufs.state",
+	};
+	struct ufs_query_policy policy = {
+		.timeout_ms = 100,
+		.max_retries = 8,
+		.backoff_ms = 1,
+	};
+
+	log_init(0);
+	CHECK(test_images_create() == 0);
+	CHECK(ptn_profile_select("generic") == 0);
+	ufs_bsg_set_transport(&ufs_bsg_transport_mock);
+	ufs_bsg_set_host(0);
+	ufs_bsg_set_policy(&policy);
+
+	ufs_mock_configure(&config);
+	check_slot(0);
+	for (unsigned int i = 0; i < 6; i++) {
+		CHECK(bootctl.setActiveBootSlot(!(i % 2), false) == 0);
+		check_slot(!(i % 2));
+	}
+	CHECK(injected_errors() > 0);
+
+	// Nothing may be written if the device doesn't answer
+	config.error_rate = 1;
+	policy.max_retries = 1;
+	ufs_bsg_set_policy(&policy);
+	ufs_mock_configure(&config);
+	CHECK(bootctl.setActiveBootSlot(1, false) < 0);
+	config.error_rate = 0;
+	ufs_mock_configure(&config);
+	check_slot(0);
+
+	test_images_remove();
+	return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "gpt-utils.h"
+#include "partlabel.h"
+#include "test-images.h"
+
+#define IMG_BLOCK_SIZE 512
+#define IMG_BLOCKS     256
+#define IMG_ENTRIES    128
+#define IMG_ARR_BLOCKS (IMG_ENTRIES * PTN_ENTRY_SIZE / IMG_BLOCK_SIZE)
+
+static const struct {
+	const char *lun;
+	const char *parts[12];
+} test_luns[] = {
+	{ "sda", { "system_a", "system_b", "vendor_a", "vendor_b", "userdata" } },
+	{ "sdb", { "xbl_a", "xbl_config_a" } },
+	{ "sdc", { "xbl_b", "xbl_config_b" } },
+	{ "sde", { "boot_a", "boot_b", "dtbo_a", "dtbo_b", "abl_a", "abl_b", "tz_a", "tz_b",
+		   "modem_a", "modem_b", "devinfo" } },
+};
+
+static void put_le32(uint8_t *p, uint32_t val)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = val >> (i * 8);
+}
+
+static void put_le64(uint8_t *p, uint64_t val)
+{
+	put_le32(p, val);
+	put_le32(p + 4, val >> 32);
+}
+
+static void test_fill_entry(uint8_t *pentry, const char *name, unsigned int nr, uint64_t lba)
+{
+	size_t len = strlen(name);
+	bool slot_b = len > 2 && !strcmp(name + len - 2, AB_SLOT_B_SUFFIX);
+	bool slot_a = len > 2 && !strcmp(name + len - 2, AB_SLOT_A_SUFFIX);
+
+	// Both halves of a pair share their type GUID, except that the
+	// inactive one has its first byte flipped
+	for (unsigned int i = 0; i < TYPE_GUID_SIZE; i++)
+		pentry[TYPE_GUID_OFFSET + i] = name[i % (len - (slot_a || slot_b ? 2 : 0))] + i;
+	if (slot_b)
+		pentry[TYPE_GUID_OFFSET] ^= 0xff;
+	memset(pentry + UNIQUE_GUID_OFFSET, nr + 1, TYPE_GUID_SIZE);
+	put_le64(pentry + FIRST_LBA_OFFSET, lba);
+	put_le64(pentry + LAST_LBA_OFFSET, lba + 3);
+	if (slot_a)
+		pentry[AB_FLAG_OFFSET] = AB_SLOT_ACTIVE_VAL | AB_PARTITION_ATTR_SLOT_ACTIVE |
+					 AB_PARTITION_ATTR_BOOT_SUCCESSFUL;
+	for (unsigned int i = 0; i < len; i++)
+		pentry[PARTITION_NAME_OFFSET + i * 2] = name[i];
+}
+
+static void test_fill_header(uint8_t *hdr, uint64_t lba, uint64_t alt_lba, uint64_t arr_lba,
+			     uint32_t arr_crc)
+{
+	memset(hdr, 0, IMG_BLOCK_SIZE);
+	memcpy(hdr, GPT_SIGNATURE, strlen(GPT_SIGNATURE));
+	put_le32(hdr + 8, 0x10000);
+	put_le32(hdr + HEADER_SIZE_OFFSET, 92);
+	put_le64(hdr + PRIMARY_HEADER_OFFSET, lba);
+	put_le64(hdr + BACKUP_HEADER_OFFSET, alt_lba);
+	put_le64(hdr + FIRST_USABLE_LBA_OFFSET, 2 + IMG_ARR_BLOCKS);
+	put_le64(hdr + LAST_USABLE_LBA_OFFSET, IMG_BLOCKS - 2 - IMG_ARR_BLOCKS);
+	put_le64(hdr + PENTRIES_OFFSET, arr_lba);
+	put_le32(hdr + PARTITION_COUNT_OFFSET, IMG_ENTRIES);
+	put_le32(hdr + PENTRY_SIZE_OFFSET, PTN_ENTRY_SIZE);
+	put_le32(hdr + PARTITION_CRC_OFFSET, arr_crc);
+	put_le32(hdr + HEADER_CRC_OFFSET, efi_crc32(hdr, 92));
+}
+
+static int test_write_lun(unsigned int lun)
+{
+	static uint8_t img[IMG_BLOCKS * IMG_BLOCK_SIZE];
+	uint8_t *arr = img + 2 * IMG_BLOCK_SIZE;
+	uint64_t last = IMG_BLOCKS - 1, lba = 2 + IMG_ARR_BLOCKS;
+	char path[64];
+	uint32_t crc;
+	int fd;
+
+	memset(img, 0, sizeof(img));
+	for (unsigned int i = 0; test_luns[lun].parts[i]; i++, lba += 4)
+		test_fill_entry(arr + i * PTN_ENTRY_SIZE, test_luns[lun].parts[i], i, lba);
+	crc = efi_crc32(arr, IMG_ENTRIES * PTN_ENTRY_SIZE);
+	memcpy(img + (last - IMG_ARR_BLOCKS) * IMG_BLOCK_SIZE, arr, IMG_ENTRIES * PTN_ENTRY_SIZE);
+	test_fill_header(img + IMG_BLOCK_SIZE, 1, last, 2, crc);
+	test_fill_header(img + last * IMG_BLOCK_SIZE, last, 1, last - IMG_ARR_BLOCKS, crc);
+
+	snprintf(path, sizeof(path), "dev/%s", test_luns[lun].lun);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, img, sizeof(img)) != sizeof(img))
+		return -1;
+	close(fd);
+
+	return 0;
+}
+
+static int test_create_lun(unsigned int lun)
+{
+	char path[64];
+	int fd;
+
+	if (test_write_lun(lun))
+		return -1;
+
+	// partlabel.c only scans disks with a device link
+	snprintf(path, sizeof(path), "sys/block/%s", test_luns[lun].lun);
+	if (mkdir(path, 0755))
+		return -1;
+	snprintf(path, sizeof(path), "sys/block/%s/device", test_luns[lun].lun);
+	fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+	close(fd);
+
+	return 0;
+}
+
+static char test_dir[] = "/tmp/qbootctl-test-XXXXXX";
+
+static int test_remove_one(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	return remove(path);
+}
+
+void test_images_remove(void)
+{
+	if (nftw(test_dir, test_remove_one, 16, FTW_DEPTH | FTW_PHYS))
+		fprintf(stderr, "Failed to remove %s: %s\n", test_dir, strerror(errno));
+}
+
+int test_images_create(void)
+{
+	char *dir = test_dir;
+
+	if (!mkdtemp(dir) || chdir(dir) || mkdir("dev", 0755) || mkdir("sys", 0755) ||
+	    mkdir("sys/block", 0755)) {
+		fprintf(stderr, "Failed to set up %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(test_luns); i++) {
+		if (test_create_lun(i)) {
+			fprintf(stderr, "Failed to create %s: %s\n", test_luns[i].lun,
+				strerror(errno));
+			return -1;
+		}
+	}
+
+	partlabel_set_source(PARTLABEL_SCAN);
+
+	return 0;
+}
+
+int test_images_damage_backup(const char *lun)
+{
+	off_t off = (IMG_BLOCKS - 1 - IMG_ARR_BLOCKS) * IMG_BLOCK_SIZE + AB_FLAG_OFFSET;
+	char path[64];
+	uint8_t byte;
+	int fd, rc = -1;
+
+	snprintf(path, sizeof(path), "dev/%s", lun);
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return -1;
+	if (pread(fd, &byte, 1, off) == 1) {
+		byte ^= AB_PARTITION_ATTR_SLOT_ACTIVE;
+		if (pwrite(fd, &byte, 1, off) == 1)
+			rc = 0;
+	}
+	close(fd);
+
+	return rc;
+}
+
+int test_images_reset(void)
+{
+	for (unsigned int i = 0; i < ARRAY_SIZE(test_luns); i++) {
+		if (test_write_lun(i)) {
+			fprintf(stderr, "Failed to rewrite %s: %s\n", test_luns[i].lun,
+				strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
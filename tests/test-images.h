@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TEST_IMAGES_H__
+#define __TEST_IMAGES_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * The tests are built with PARTLABEL_SYS_BLOCK, PARTLABEL_DEV_DIR and
+ * every state path pointing below the current directory.
+ * test_images_create() moves to a fresh temporary directory and lays
+ * out a small UFS device there: LUN images with 512 byte blocks under
+ * dev/, found by scanning sys/block/ like in early boot. Slot _a is
+ * active and marked successful.
+ */
+int test_images_create(void);
+// Write the initial LUN images again
+int test_images_reset(void);
+// Flip a bit of the first entry in the backup array of lun (e.g. "sda"),
+// which breaks its CRC
+int test_images_damage_backup(const char *lun);
+// Delete the directory again, only done once a test passed
+void test_images_remove(void);
+
+#define CHECK(cond)                                                                                \
+	do {                                                                                       \
+		if (!(cond)) {                                                                     \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);   \
+			exit(1);                                                                   \
+		}                                                                                  \
+	} while (0)
+
+#endif // __TEST_IMAGES_H__
@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2023 Caleb Connolly <caleb@connolly.tech>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * In-process stand-in for a UFS device behind the BSG node, used to
+ * exercise the query and boot LUN paths without hardware. It models
+ * the attribute and flag space plus the device, geometry and unit
+ * descriptors of a typical 8 LU phone layout (LU 1 and 2 being the
+ * boot LUNs A and B).
+ */
+
+#include <linux/bsg.h>
+#include <scsi/scsi_bsg_ufs.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "ufs-bsg.h"
+
+#define MOCK_HANDLE	  0x4d4f
+#define MOCK_NR_LUS	  8
+#define MOCK_STATE_MAGIC  0x4b434f4d // "MOCK"
+
+struct ufs_mock_state {
+	uint32_t magic;
+	uint32_t attrs[256];
+	uint8_t flags[256];
+};
+
+static struct ufs_mock_config mock_config;
+static bool mock_configured;
+static struct ufs_mock_state mock_state;
+static bool mock_state_loaded;
+static struct ufs_mock_record *mock_records;
+static unsigned int mock_nr_records;
+static unsigned int mock_records_size;
+static FILE *mock_trace;
+
+static void mock_parse_env(void)
+{
+	static char buf[512];
+	char *opt, *saveptr = NULL;
+	const char *env = getenv(UFS_MOCK_ENV);
+
+	if (!env)
+		return;
+
+	snprintf(buf, sizeof(buf), "%s", env);
+	for (opt = strtok_r(buf, ",", &saveptr); opt; opt = strtok_r(NULL, ",", &saveptr)) {
+		char *val = strchr(opt, '=');
+
+		if (!val) {
+			// e.g. QBOOTCTL_UFS_MOCK=1
+			continue;
+		}
+		*val++ = '\0';
+		if (!strcmp(opt, "latency_us"))
+			mock_config.latency_us = strtoul(val, NULL, 10);
+		else if (!strcmp(opt, "error_rate"))
+			mock_config.error_rate = strtod(val, NULL);
+		else if (!strcmp(opt, "seed"))
+			mock_config.seed = strtoul(val, NULL, 10);
+		else if (!strcmp(opt, "state"))
+			mock_config.state_path = val;
+		else if (!strcmp(opt, "trace"))
+			mock_config.trace_path = val;
+		else
+			LOGW("%s: Unknown option '%s'\n", UFS_MOCK_ENV, opt);
+	}
+}
+
+void ufs_mock_configure(const struct ufs_mock_config *config)
+{
+	mock_config = *config;
+	mock_configured = true;
+	mock_state_loaded = false;
+	srand(mock_config.seed);
+}
+
+static void mock_init(void)
+{
+	int fd;
+
+	if (!mock_configured) {
+		mock_parse_env();
+		mock_configured = true;
+		srand(mock_config.seed);
+	}
+
+	if (mock_state_loaded)
+		return;
+
+	memset(&mock_state, 0, sizeof(mock_state));
+	mock_state.magic = MOCK_STATE_MAGIC;
+	// Fresh devices boot from LUN A
+	mock_state.attrs[QUERY_ATTR_IDN_BOOT_LU_EN] = 1;
+	mock_state.attrs[QUERY_ATTR_IDN_POWER_MODE] = 0x11;
+	mock_state.attrs[QUERY_ATTR_IDN_ACTIVE_ICC_LVL] = 0xf;
+
+	if (mock_config.state_path) {
+		fd = open(mock_config.state_path, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			struct ufs_mock_state saved;
+
+			if (read(fd, &saved, sizeof(saved)) == sizeof(saved) &&
+			    saved.magic == MOCK_STATE_MAGIC)
+				mock_state = saved;
+			close(fd);
+		}
+	}
+
+	mock_state_loaded = true;
+}
+
+static void mock_save_state(void)
+{
+	int fd;
+
+	if (!mock_config.state_path)
+		return;
+
+	fd = open(mock_config.state_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		LOGW("%s: Failed to save state to %s: %s\n", __func__, mock_config.state_path,
+		     strerror(errno));
+		return;
+	}
+	if (write(fd, &mock_state, sizeof(mock_state)) != sizeof(mock_state))
+		LOGW("%s: Short write to %s\n", __func__, mock_config.state_path);
+	close(fd);
+}
+
+static void mock_record(const struct ufs_mock_record *rec)
+{
+	if (mock_nr_records == mock_records_size) {
+		unsigned int size = mock_records_size ? mock_records_size * 2 : 32;
+		struct ufs_mock_record *records;
+
+		records = realloc(mock_records, size * sizeof(*records));
+		if (!records)
+			return;
+		mock_records = records;
+		mock_records_size = size;
+	}
+	mock_records[mock_nr_records++] = *rec;
+
+	if (!mock_config.trace_path)
+		return;
+	if (!mock_trace) {
+		mock_trace = fopen(mock_config.trace_path, "ae");
+		if (!mock_trace)
+			return;
+	}
+	fprintf(mock_trace,
+		"func=0x%02x opcode=0x%x idn=0x%02x index=%u selector=%u length=%u value=0x%x%s\n",
+		rec->func, rec->opcode, rec->idn, rec->index, rec->selector, rec->length,
+		rec->value, rec->injected_error ? " error" : "");
+	fflush(mock_trace);
+}
+
+const struct ufs_mock_record *ufs_mock_get_records(unsigned int *count)
+{
+	*count = mock_nr_records;
+	return mock_records;
+}
+
+int ufs_mock_get_attr(uint8_t idn, uint32_t *value)
+{
+	mock_init();
+	*value = mock_state.attrs[idn];
+	return 0;
+}
+
+int ufs_mock_set_attr(uint8_t idn, uint32_t value)
+{
+	mock_init();
+	mock_state.attrs[idn] = value;
+	mock_save_state();
+	return 0;
+}
+
+static void put_be16(uint8_t *p, uint16_t val)
+{
+	p[0] = val >> 8;
+	p[1] = val;
+}
+
+static void put_be32(uint8_t *p, uint32_t val)
+{
+	put_be16(p, val >> 16);
+	put_be16(p + 2, val);
+}
+
+static void put_be64(uint8_t *p, uint64_t val)
+{
+	put_be32(p, val >> 32);
+	put_be32(p + 4, val);
+}
+
+// Fill buf with descriptor idn/index, returns its length or -1
+static int mock_get_desc(uint8_t idn, uint8_t index, uint8_t *buf, size_t len)
+{
+	uint8_t desc[QUERY_DESC_SIZE_GEOMETRY] = { 0 };
+	int desc_len;
+
+	switch (idn) {
+	case QUERY_DESC_IDN_DEVICE:
+		desc_len = QUERY_DESC_SIZE_DEVICE;
+		desc[0x06] = MOCK_NR_LUS; // bNumberLU
+		desc[0x07] = 4;		  // bNumberWLU
+		desc[0x08] = 1;		  // bBootEnable
+		desc[0x0a] = 1;		  // bInitPowerMode
+		desc[0x0b] = 0x7f;	  // bHighPriorityLUN
+		desc[0x0f] = 0xf;	  // bInitActiveICCLevel
+		put_be16(desc + 0x10, 0x0310); // wSpecVersion
+		put_be16(desc + 0x12, 0x0123); // wManufactureDate
+		put_be16(desc + 0x18, 0x01ce); // wManufacturerID
+		break;
+	case QUERY_DESC_IDN_GEOMETRY:
+		desc_len = QUERY_DESC_SIZE_GEOMETRY;
+		put_be64(desc + 0x04, 128ULL * 1024 * 1024 * 2); // 128 GiB
+		desc[0x0c] = 0;					  // 8 LUs
+		put_be32(desc + 0x0d, 0x400);			  // dSegmentSize
+		desc[0x11] = 8;					  // bAllocationUnitSize
+		desc[0x12] = 8;					  // bMinAddrBlockSize
+		break;
+	case QUERY_DESC_IDN_UNIT:
+		if (index >= MOCK_NR_LUS)
+			return -1;
+		desc_len = QUERY_DESC_SIZE_UNIT;
+		desc[0x02] = index;
+		desc[0x03] = index < 6; // bLUEnable
+		// bBootLunID, LU 1 and 2 hold xbl_a/xbl_b
+		desc[0x04] = index == 1 ? 1 : index == 2 ? 2 : 0;
+		desc[0x0a] = 12; // 4096 byte blocks
+		put_be64(desc + 0x0b, index == 0 ? 0x1d00000 : 0x2000);
+		put_be32(desc + 0x13, 0x400);
+		break;
+	default:
+		return -1;
+	}
+
+	desc[0x00] = desc_len;
+	desc[0x01] = idn;
+	memcpy(buf, desc, len < (size_t)desc_len ? len : (size_t)desc_len);
+	return desc_len;
+}
+
+static bool mock_present(const char *path)
+{
+	(void)path;
+	return true;
+}
+
+static int mock_open(const char *path)
+{
+	mock_init();
+	LOGD("%s: Opened mock UFS device for %s\n", __func__, path);
+	return MOCK_HANDLE;
+}
+
+static void mock_close(int handle)
+{
+	(void)handle;
+	if (mock_trace) {
+		fclose(mock_trace);
+		mock_trace = NULL;
+	}
+}
+
+static void mock_sleep_us(uint32_t us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000L,
+	};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+static int mock_sg_io(int handle, struct sg_io_v4 *sg_io)
+{
+	struct ufs_bsg_request *req = (struct ufs_bsg_request *)(uintptr_t)sg_io->request;
+	struct ufs_bsg_reply *rsp = (struct ufs_bsg_reply *)(uintptr_t)sg_io->response;
+	const struct utp_upiu_query *qr = &req->upiu_req.qr;
+	struct ufs_mock_record rec = {
+		.func = (be32toh(req->upiu_req.header.dword_1) >> 16) & 0xff,
+		.opcode = qr->opcode,
+		.idn = qr->idn,
+		.index = qr->index,
+		.selector = qr->selector,
+		.length = be16toh(qr->length),
+		.value = be32toh(qr->value),
+	};
+	uint32_t latency_us = mock_config.latency_us;
+	bool write_state = false;
+	int len;
+
+	if (handle != MOCK_HANDLE || sg_io->guard != 'Q' || req->msgcode != UTP_UPIU_QUERY_REQ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sg_io->info = 0;
+	rsp->result = 0;
+
+	// A request slower than its timeout is aborted by the host
+	if (sg_io->timeout && latency_us > sg_io->timeout * 1000U) {
+		mock_sleep_us(sg_io->timeout * 1000U);
+		rec.injected_error = true;
+		sg_io->info = 1;
+		sg_io->driver_status = 0x6; // DRIVER_TIMEOUT
+		mock_record(&rec);
+		return 0;
+	}
+
+	if (latency_us)
+		mock_sleep_us(latency_us);
+
+	if (mock_config.error_rate > 0 && rand() < mock_config.error_rate * ((double)RAND_MAX + 1)) {
+		rec.injected_error = true;
+		sg_io->info = 1;
+		sg_io->transport_status = 0x1;
+		mock_record(&rec);
+		return 0;
+	}
+
+	rsp->upiu_rsp.qr = *qr;
+
+	switch (qr->opcode) {
+	case QUERY_REQ_OP_READ_DESC:
+		len = mock_get_desc(qr->idn, qr->index, (uint8_t *)(uintptr_t)sg_io->din_xferp,
+				    sg_io->din_xfer_len);
+		if (len < 0) {
+			rsp->result = -EINVAL;
+			break;
+		}
+		rsp->reply_payload_rcv_len = len;
+		break;
+	case QUERY_REQ_OP_READ_ATTR:
+		rsp->upiu_rsp.qr.value = htobe32(mock_state.attrs[qr->idn]);
+		break;
+	case QUERY_REQ_OP_WRITE_ATTR:
+		mock_state.attrs[qr->idn] = rec.value;
+		write_state = true;
+		break;
+	case QUERY_REQ_OP_READ_FLAG:
+		rsp->upiu_rsp.qr.value = htobe32(mock_state.flags[qr->idn]);
+		break;
+	case QUERY_REQ_OP_SET_FLAG:
+		mock_state.flags[qr->idn] = 1;
+		write_state = true;
+		break;
+	case QUERY_REQ_OP_CLEAR_FLAG:
+		mock_state.flags[qr->idn] = 0;
+		write_state = true;
+		break;
+	case QUERY_REQ_OP_TOGGLE_FLAG:
+		mock_state.flags[qr->idn] ^= 1;
+		write_state = true;
+		break;
+	default:
+		// Descriptor writes aren't supported by the mock
+		rsp->result = -EINVAL;
+		break;
+	}
+
+	mock_record(&rec);
+	if (write_state)
+		mock_save_state();
+
+	return 0;
+}
+
+const struct ufs_bsg_transport ufs_bsg_transport_mock = {
+	.name = "mock",
+	.present = mock_present,
+	.open = mock_open,
+	.close = mock_close,
+	.sg_io = mock_sg_io,
+};
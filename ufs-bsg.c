@@ -31,6 +31,7 @@
 #include <scsi/scsi_bsg_ufs.h>
 #include <endian.h>
 #include <dirent.h>
+#include <limits.h>
 #include <string.h>
 
 #include <stdio.h>
@@ -41,46 +42,274 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <time.h>
 
-#include "utils.h"
+#include "boot-cache.h"
+#include "gpt-utils.h"
+#include "log.h"
+#include "partlabel.h"
 #include "ufs-bsg.h"
 
-/* UFS BSG device node */
-static char ufs_bsg_dev[FNAME_SZ] = "/dev/bsg/ufs-bsg0";
+/* UFS BSG device node, found by ufs_bsg_discover() unless set explicitly */
+static char ufs_bsg_dev[FNAME_SZ];
 
-static int fd_ufs_bsg = 0;
+/* Session used by the boot LUN helpers, kept open until ufs_bsg_dev_close() */
+static struct ufs_bsg_session ufs_session = UFS_BSG_SESSION_INIT;
 
-int ufs_bsg_dev_open()
+static const struct ufs_bsg_transport *ufs_transport;
+
+/* Successful attribute writes by this process */
+static unsigned int ufs_attr_writes;
+
+/* Longest we'll ever sleep between two attempts of the same query */
+#define UFS_BACKOFF_MAX_MS 1000
+
+static uint64_t ufs_now_usec(void)
 {
-	if (fd_ufs_bsg)
-		return 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool sg_io_present(const char *path)
+{
+	return !access(path, F_OK);
+}
+
+static int sg_io_open(const char *path)
+{
+	return open(path, O_RDWR | O_CLOEXEC);
+}
+
+static void sg_io_close(int fd)
+{
+	close(fd);
+}
+
+static int sg_io_ioctl(int fd, struct sg_io_v4 *sg_io)
+{
+	return ioctl(fd, SG_IO, sg_io);
+}
+
+const struct ufs_bsg_transport ufs_bsg_transport_sg_io = {
+	.name = "sg_io",
+	.present = sg_io_present,
+	.open = sg_io_open,
+	.close = sg_io_close,
+	.sg_io = sg_io_ioctl,
+};
+
+void ufs_bsg_set_transport(const struct ufs_bsg_transport *transport)
+{
+	ufs_transport = transport;
+}
 
-	fd_ufs_bsg = open(ufs_bsg_dev, O_RDWR);
-	if (fd_ufs_bsg < 0) {
-		fprintf(stderr, "Unable to open '%s': %s\n", ufs_bsg_dev,
-			strerror(errno));
-		fprintf(stderr,
-			"Is CONFIG_SCSI_UFS_BSG is enabled in your kernel?\n");
-		fd_ufs_bsg = 0;
+static const struct ufs_bsg_transport *ufs_bsg_get_transport(void)
+{
+	if (!ufs_transport) {
+#ifdef HAVE_UFS_MOCK
+		if (getenv(UFS_MOCK_ENV)) {
+			LOGW("Using mock UFS transport\n");
+			ufs_transport = &ufs_bsg_transport_mock;
+			return ufs_transport;
+		}
+#endif
+		ufs_transport = &ufs_bsg_transport_sg_io;
+	}
+
+	return ufs_transport;
+}
+
+bool ufs_bsg_is_mock(void)
+{
+#ifdef HAVE_UFS_MOCK
+	return ufs_bsg_get_transport() == &ufs_bsg_transport_mock;
+#else
+	return false;
+#endif
+}
+
+// Find the index of the SCSI host in a sysfs device path like
+// /sys/devices/platform/soc@0/1d84000.ufshc/host0/target0:0:0/0:0:0:1/block/sdb/sdb1
+static int ufs_sysfs_host_no(const char *syspath)
+{
+	const char *p = syspath;
+	unsigned int host;
+
+	while ((p = strstr(p, "/host"))) {
+		p += strlen("/host");
+		if (sscanf(p, "%u/", &host) == 1)
+			return host;
+	}
+
+	return -1;
+}
+
+// Map the LUN holding the partition part back to its UFS host
+// and the matching ufs-bsg node.
+static int ufs_bsg_dev_for_partition(const char *part, char *path, size_t len)
+{
+	char link[PATH_MAX], real[PATH_MAX];
+	int host, rc;
+
+	rc = partlabel_resolve(part, real, sizeof(real), NULL, 0);
+	if (rc)
+		return rc;
+
+	snprintf(link, sizeof(link), "/sys/class/block/%s", strrchr(real, '/') + 1);
+	if (!realpath(link, real))
+		return -errno;
+
+	host = ufs_sysfs_host_no(real);
+	if (host < 0) {
+		LOGD("%s: No SCSI host in %s\n", __func__, real);
+		return -ENODEV;
+	}
+
+	snprintf(path, len, UFS_BSG_DEV_FMT, host);
+	if (!ufs_bsg_get_transport()->present(path)) {
+		LOGD("%s: %s is on host%d but %s doesn't exist\n", __func__, part, host, path);
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+void ufs_bsg_set_host(unsigned int host)
+{
+	snprintf(ufs_bsg_dev, sizeof(ufs_bsg_dev), UFS_BSG_DEV_FMT, host);
+}
+
+const char *ufs_bsg_discover(bool use_cache)
+{
+	static const char *const parts[] = { PTN_XBL AB_SLOT_A_SUFFIX, PTN_XBL };
+	char path[FNAME_SZ] = { 0 };
+
+	if (ufs_bsg_dev[0])
+		return ufs_bsg_dev;
+
+	if (use_cache && !boot_cache_read(UFS_BSG_DEV_CACHE, path, sizeof(path)) && path[0]) {
+		memcpy(ufs_bsg_dev, path, sizeof(ufs_bsg_dev));
+		return ufs_bsg_dev;
+	}
+
+	for (unsigned int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+		if (ufs_bsg_dev_for_partition(parts[i], path, sizeof(path)))
+			continue;
+
+		LOGD("%s: %s is on %s\n", __func__, parts[i], path);
+		memcpy(ufs_bsg_dev, path, sizeof(ufs_bsg_dev));
+		boot_cache_write(UFS_BSG_DEV_CACHE, ufs_bsg_dev, sizeof(ufs_bsg_dev));
+		return ufs_bsg_dev;
+	}
+
+	// Fall back to the first host, this is right on almost
+	// every device with a single UFS controller.
+	LOGD("%s: Couldn't find the UFS host for xbl, assuming host 0\n", __func__);
+	ufs_bsg_set_host(0);
+	return ufs_bsg_dev;
+}
+
+// The decoded info is cached separately for every host
+static const char *ufs_info_cache_name(void)
+{
+	static char name[FNAME_SZ + sizeof(UFS_INFO_CACHE)];
+
+	snprintf(name, sizeof(name), "%s-%s", UFS_INFO_CACHE, strrchr(ufs_bsg_discover(true), '/') + 1);
+	return name;
+}
+
+int ufs_bsg_session_open(struct ufs_bsg_session *session, const char *path)
+{
+	if (!path)
+		path = ufs_bsg_discover(true);
+
+	if (session->fd >= 0) {
+		if (!strcmp(session->path, path))
+			return 0;
+		ufs_bsg_session_close(session);
+	}
+
+	session->transport = ufs_bsg_get_transport();
+	session->fd = session->transport->open(path);
+	if (session->fd < 0) {
+		LOGE("Unable to open '%s': %s\n", path, strerror(errno));
+		LOGE("Is CONFIG_SCSI_UFS_BSG is enabled in your kernel?\n");
+		session->fd = -1;
 		return -1;
 	}
 
+	snprintf(session->path, sizeof(session->path), "%s", path);
+	if (!session->policy.timeout_ms)
+		session->policy = (struct ufs_query_policy)UFS_QUERY_POLICY_DEFAULT;
+	session->nr_queries = 0;
+	session->nr_retries = 0;
+	session->total_usec = 0;
+	LOGD("Opened ufs bsg dev: %s\n", session->path);
+
 	return 0;
 }
 
-void ufs_bsg_dev_close()
+void ufs_bsg_session_close(struct ufs_bsg_session *session)
+{
+	if (session->fd < 0)
+		return;
+
+	LOGD("Closing ufs bsg dev %s after %u queries, %u retries (%" PRIu64 " us)\n",
+	     session->path, session->nr_queries, session->nr_retries, session->total_usec);
+	session->transport->close(session->fd);
+	session->fd = -1;
+}
+
+void ufs_bsg_set_policy(const struct ufs_query_policy *policy)
+{
+	ufs_session.policy = *policy;
+}
+
+// Errors that are worth trying again, anything else (e.g. -EINVAL
+// from a malformed request or -ENOTTY) will fail the same way.
+static bool ufs_error_is_transient(int err)
 {
-	if (fd_ufs_bsg) {
-		close(fd_ufs_bsg);
-		fd_ufs_bsg = 0;
+	switch (err) {
+	case -EAGAIN:
+	case -EBUSY:
+	case -EINTR:
+	case -EIO:
+	case -ETIMEDOUT:
+		return true;
+	default:
+		return false;
 	}
 }
 
-static int ufs_bsg_ioctl(int fd, struct ufs_bsg_request *req,
+static void ufs_sleep_ms(uint32_t ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L,
+	};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+int ufs_bsg_dev_open()
+{
+	return ufs_bsg_session_open(&ufs_session, NULL);
+}
+
+void ufs_bsg_dev_close()
+{
+	ufs_bsg_session_close(&ufs_session);
+}
+
+static int ufs_bsg_ioctl(struct ufs_bsg_session *session, struct ufs_bsg_request *req,
 			 struct ufs_bsg_reply *rsp, __u8 *buf, __u32 buf_len,
-			 enum bsg_ioctl_dir dir)
+			 enum bsg_ioctl_dir dir, __u32 timeout_ms)
 {
-	int ret;
+	int ret, err;
 	struct sg_io_v4 sg_io = {
 		.guard = 'Q',
 		.protocol = BSG_PROTOCOL_SCSI,
@@ -89,6 +318,7 @@ static int ufs_bsg_ioctl(int fd, struct ufs_bsg_request *req,
 		.request = (__u64)req,
 		.response = (__u64)rsp,
 		.max_response_len = sizeof(*rsp),
+		.timeout = timeout_ms,
 	};
 
 	if (dir == BSG_IOCTL_DIR_FROM_DEV) {
@@ -99,17 +329,19 @@ static int ufs_bsg_ioctl(int fd, struct ufs_bsg_request *req,
 		sg_io.dout_xferp = (__u64)(buf);
 	}
 
-	ret = ioctl(fd, SG_IO, &sg_io);
-	if (ret)
-		fprintf(stderr,
-			"%s: Error from sg_io ioctl (return value: %d, error no: %d, reply result from LLD: %d\n)",
-			__func__, ret, errno, rsp->result);
+	ret = session->transport->sg_io(session->fd, &sg_io);
+	if (ret) {
+		// Logging may clobber errno, ufs_error_is_transient() goes by it
+		err = errno;
+		LOGW("%s: Error from sg_io ioctl (return value: %d, error no: %d, reply result from LLD: %d)\n",
+		     __func__, ret, err, rsp->result);
+		return -err;
+	}
 
 	if (sg_io.info || rsp->result) {
-		fprintf(stderr,
-			"%s: Error from sg_io info (check sg info: device_status: 0x%x, transport_status: 0x%x, driver_status: 0x%x, reply result from LLD: %d\n)",
-			__func__, sg_io.device_status, sg_io.transport_status,
-			sg_io.driver_status, rsp->result);
+		LOGW("%s: Error from sg_io info (check sg info: device_status: 0x%x, transport_status: 0x%x, driver_status: 0x%x, reply result from LLD: %d)\n",
+		     __func__, sg_io.device_status, sg_io.transport_status,
+		     sg_io.driver_status, rsp->result);
 		ret = -EAGAIN;
 	}
 
@@ -134,52 +366,316 @@ static void compose_ufs_bsg_query_req(struct ufs_bsg_request *req, __u8 func,
 	qr->length = htobe16(length);
 }
 
-static int ufs_query_attr(int fd, __u32 value, __u8 func, __u8 opcode, __u8 idn,
-			  __u8 index, __u8 sel)
+int ufs_bsg_query(struct ufs_bsg_session *session, struct ufs_query *query)
 {
 	struct ufs_bsg_request req = { 0 };
 	struct ufs_bsg_reply rsp = { 0 };
 	enum bsg_ioctl_dir dir = BSG_IOCTL_DIR_FROM_DEV;
-	int ret = 0;
+	__u8 func = QUERY_REQ_FUNC_STD_READ;
+	__u16 length = 0;
+	uint32_t timeout_ms, backoff_ms;
+	uint64_t start;
+
+	if (session->fd < 0) {
+		query->ret = -EBADF;
+		return query->ret;
+	}
 
-	if (opcode == QUERY_REQ_OP_WRITE_DESC ||
-	    opcode == QUERY_REQ_OP_WRITE_ATTR)
+	switch (query->opcode) {
+	case QUERY_REQ_OP_WRITE_DESC:
+		length = query->len;
+		/* fallthrough */
+	case QUERY_REQ_OP_WRITE_ATTR:
 		dir = BSG_IOCTL_DIR_TO_DEV;
+		/* fallthrough */
+	case QUERY_REQ_OP_SET_FLAG:
+	case QUERY_REQ_OP_CLEAR_FLAG:
+	case QUERY_REQ_OP_TOGGLE_FLAG:
+		func = QUERY_REQ_FUNC_STD_WRITE;
+		break;
+	case QUERY_REQ_OP_READ_DESC:
+		length = query->len;
+		break;
+	case QUERY_REQ_OP_READ_ATTR:
+	case QUERY_REQ_OP_READ_FLAG:
+		break;
+	}
+
+	req.upiu_req.qr.value = htobe32(query->value);
+
+	compose_ufs_bsg_query_req(&req, func, query->opcode, query->idn, query->index,
+				  query->selector, length);
+
+	timeout_ms = query->timeout_ms ?: session->policy.timeout_ms;
+	backoff_ms = session->policy.backoff_ms;
+	query->retries = 0;
+
+	start = ufs_now_usec();
+	for (;;) {
+		memset(&rsp, 0, sizeof(rsp));
+		query->ret = ufs_bsg_ioctl(session, &req, &rsp, query->buf, length, dir,
+					   timeout_ms);
+		if (!query->ret || !ufs_error_is_transient(query->ret) ||
+		    query->retries >= session->policy.max_retries)
+			break;
+
+		query->retries++;
+		LOGW("%s: opcode 0x%x idn 0x%x failed (%d), retry %u/%u in %u ms\n", __func__,
+		     query->opcode, query->idn, query->ret, query->retries,
+		     session->policy.max_retries, backoff_ms);
+		ufs_sleep_ms(backoff_ms);
+		backoff_ms = backoff_ms * 2 > UFS_BACKOFF_MAX_MS ? UFS_BACKOFF_MAX_MS : backoff_ms * 2;
+	}
+	query->latency_usec = ufs_now_usec() - start;
+
+	session->nr_queries++;
+	session->nr_retries += query->retries;
+	session->total_usec += query->latency_usec;
+
+	if (query->ret) {
+		LOGE("%s: Error from ufs_bsg_ioctl for opcode 0x%x idn 0x%x (return value: %d, %u retries)\n",
+		     __func__, query->opcode, query->idn, query->ret, query->retries);
+		return query->ret;
+	}
+
+	if (dir == BSG_IOCTL_DIR_FROM_DEV)
+		query->value = be32toh(rsp.upiu_rsp.qr.value);
+
+	LOGD("%s: opcode 0x%x idn 0x%x index %u: value 0x%x in %" PRIu64 " us (%u retries)\n",
+	     __func__, query->opcode, query->idn, query->index, query->value, query->latency_usec,
+	     query->retries);
+
+	return 0;
+}
 
-	req.upiu_req.qr.value = htobe32(value);
+int ufs_bsg_query_batch(struct ufs_bsg_session *session, struct ufs_query *queries,
+			unsigned int count)
+{
+	int failed = 0;
+
+	for (unsigned int i = 0; i < count; i++)
+		if (ufs_bsg_query(session, &queries[i]))
+			failed++;
 
-	compose_ufs_bsg_query_req(&req, func, opcode, idn, index, sel, 0);
+	return failed;
+}
 
-	ret = ufs_bsg_ioctl(fd, &req, &rsp, 0, 0, dir);
+static int ufs_read_boot_lun(__u32 *boot_lun_id)
+{
+	struct ufs_query query = {
+		.opcode = QUERY_REQ_OP_READ_ATTR,
+		.idn = QUERY_ATTR_IDN_BOOT_LU_EN,
+	};
+	int ret;
+
+	ret = ufs_bsg_query(&ufs_session, &query);
 	if (ret)
-		fprintf(stderr,
-			"%s: Error from ufs_bsg_ioctl (return value: %d, error no: %d\n)",
-			__func__, ret, errno);
+		LOGE("Error reading ufs attr idn %d via query ioctl: %s\n",
+		     QUERY_ATTR_IDN_BOOT_LU_EN, strerror(-ret));
+	else
+		*boot_lun_id = query.value;
 
 	return ret;
 }
 
-int32_t set_boot_lun(__u8 lun_id)
+int32_t get_boot_lun(uint8_t *lun_id)
 {
+	int32_t ret;
+	__u32 boot_lun_id = 0;
+
+	// Don't complain about a missing BSG node, this is only
+	// used to report the current state.
+	if (ufs_session.fd < 0 && !ufs_bsg_get_transport()->present(ufs_bsg_discover(true)))
+		return -ENODEV;
+
+	ret = ufs_bsg_dev_open();
+	if (ret)
+		return ret;
+
+	ret = ufs_read_boot_lun(&boot_lun_id);
+	if (!ret)
+		*lun_id = boot_lun_id;
+
+	return ret;
+}
+
+unsigned int ufs_bsg_attr_writes(void)
+{
+	return ufs_attr_writes;
+}
+
+int32_t set_boot_lun(uint8_t lun_id)
+{
+	struct ufs_query query = {
+		.opcode = QUERY_REQ_OP_WRITE_ATTR,
+		.idn = QUERY_ATTR_IDN_BOOT_LU_EN,
+		.value = lun_id,
+	};
 	int32_t ret;
 	__u32 boot_lun_id = lun_id;
+	__u32 cur_lun_id = 0;
 
-	LOGD("Using UFS bsg device: %s\n", ufs_bsg_dev);
+	LOGD("Using UFS bsg device: %s\n", ufs_bsg_discover(true));
 
 	ret = ufs_bsg_dev_open();
 	if (ret)
 		return ret;
-	LOGD("Opened ufs bsg dev: %s\n", ufs_bsg_dev);
 
-	ret = ufs_query_attr(fd_ufs_bsg, boot_lun_id, QUERY_REQ_FUNC_STD_WRITE,
-			     QUERY_REQ_OP_WRITE_ATTR, QUERY_ATTR_IDN_BOOT_LU_EN,
-			     0, 0);
+	// Avoid a needless attribute write if the device already
+	// boots from the requested LUN. If the read fails just try
+	// the write anyway.
+	ret = ufs_read_boot_lun(&cur_lun_id);
+	if (!ret && cur_lun_id == boot_lun_id) {
+		LOGI("Boot LUN is already %u, not writing bBootLunEn\n", boot_lun_id);
+		return 0;
+	}
+	LOGD("Changing boot LUN %u -> %u\n", cur_lun_id, boot_lun_id);
+
+	ret = ufs_bsg_query(&ufs_session, &query);
+	if (ret) {
+		LOGE("Error requesting ufs attr idn %d via query ioctl: %s\n",
+		     QUERY_ATTR_IDN_BOOT_LU_EN, strerror(-ret));
+		return ret;
+	}
+
+	ufs_attr_writes++;
+	LOGI("Wrote boot LUN %u in %" PRIu64 " us (%u retries)\n", boot_lun_id,
+	     query.latency_usec, query.retries);
+
+	// Read back the attribute to make sure the write took effect
+	ret = ufs_read_boot_lun(&cur_lun_id);
 	if (ret)
-		fprintf(stderr,
-			"Error requesting ufs attr idn %d via query ioctl (return value: %d, error no: %d)",
-			QUERY_ATTR_IDN_BOOT_LU_EN, ret, errno);
+		return ret;
+
+	if (cur_lun_id != boot_lun_id) {
+		LOGE("Boot LUN readback mismatch: wrote %u, read %u\n", boot_lun_id, cur_lun_id);
+		return -EIO;
+	}
 
+	boot_cache_invalidate(ufs_info_cache_name());
 
-	ufs_bsg_dev_close();
-	return ret;
+	return 0;
+}
+
+static uint16_t get_be16(const uint8_t *p)
+{
+	return (uint16_t)p[0] << 8 | p[1];
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (uint32_t)get_be16(p) << 16 | get_be16(p + 2);
+}
+
+static uint64_t get_be64(const uint8_t *p)
+{
+	return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static void ufs_decode_device_desc(struct ufs_info *info, const uint8_t *desc)
+{
+	info->number_lu = desc[0x06];
+	info->number_wlu = desc[0x07];
+	info->boot_enable = desc[0x08];
+	info->init_power_mode = desc[0x0a];
+	info->high_priority_lun = desc[0x0b];
+	info->init_active_icc_level = desc[0x0f];
+	info->spec_version = get_be16(desc + 0x10);
+	info->manufacture_date = get_be16(desc + 0x12);
+	info->manufacturer_id = get_be16(desc + 0x18);
+}
+
+static void ufs_decode_geometry_desc(struct ufs_info *info, const uint8_t *desc)
+{
+	info->total_raw_capacity = get_be64(desc + 0x04);
+	// bMaxNumberLU: 0 -> 8 LUs, 1 -> 32 LUs
+	info->max_number_lu = desc[0x0c] ? 32 : 8;
+	info->segment_size = get_be32(desc + 0x0d);
+	info->allocation_unit_size = desc[0x11];
+	info->min_addr_block_size = desc[0x12];
+}
+
+static void ufs_decode_unit_desc(struct ufs_unit_info *unit, const uint8_t *desc)
+{
+	unit->lu_enable = desc[0x03];
+	unit->boot_lun_id = desc[0x04];
+	unit->write_protect = desc[0x05];
+	unit->memory_type = desc[0x08];
+	unit->log2_block_size = desc[0x0a];
+	unit->block_count = get_be64(desc + 0x0b);
+	unit->erase_block_size = get_be32(desc + 0x13);
+	unit->provisioning_type = desc[0x17];
+}
+
+int ufs_get_info(struct ufs_info *info, bool use_cache)
+{
+	uint8_t device_desc[QUERY_DESC_SIZE_DEVICE] = { 0 };
+	uint8_t geometry_desc[QUERY_DESC_SIZE_GEOMETRY] = { 0 };
+	uint8_t unit_desc[UFS_MAX_LUNS][QUERY_DESC_SIZE_UNIT];
+	struct ufs_query queries[UFS_MAX_LUNS] = {
+		{ .opcode = QUERY_REQ_OP_READ_DESC, .idn = QUERY_DESC_IDN_DEVICE,
+		  .buf = device_desc, .len = sizeof(device_desc) },
+		{ .opcode = QUERY_REQ_OP_READ_DESC, .idn = QUERY_DESC_IDN_GEOMETRY,
+		  .buf = geometry_desc, .len = sizeof(geometry_desc) },
+		{ .opcode = QUERY_REQ_OP_READ_ATTR, .idn = QUERY_ATTR_IDN_BOOT_LU_EN },
+		{ .opcode = QUERY_REQ_OP_READ_ATTR, .idn = QUERY_ATTR_IDN_POWER_MODE },
+		{ .opcode = QUERY_REQ_OP_READ_ATTR, .idn = QUERY_ATTR_IDN_ACTIVE_ICC_LVL },
+	};
+	unsigned int nr_queries = 5;
+	int ret;
+
+	if (use_cache && !boot_cache_read(ufs_info_cache_name(), info, sizeof(*info)))
+		return 1;
+
+	memset(info, 0, sizeof(*info));
+	snprintf(info->bsg_dev, sizeof(info->bsg_dev), "%s", ufs_bsg_discover(use_cache));
+
+	ret = ufs_bsg_dev_open();
+	if (ret)
+		return -ENODEV;
+
+	// Device, geometry and attributes first, the geometry tells
+	// us how many unit descriptors there are.
+	if (ufs_bsg_query_batch(&ufs_session, queries, nr_queries)) {
+		LOGE("%s: Failed to read UFS device/geometry descriptors\n", __func__);
+		return -EIO;
+	}
+
+	ufs_decode_device_desc(info, device_desc);
+	ufs_decode_geometry_desc(info, geometry_desc);
+	info->boot_lun_en = queries[2].value;
+	info->current_power_mode = queries[3].value;
+	info->active_icc_level = queries[4].value;
+	for (unsigned int i = 0; i < nr_queries; i++)
+		info->query_usec += queries[i].latency_usec;
+	info->nr_queries = nr_queries;
+
+	nr_queries = info->max_number_lu;
+	memset(queries, 0, sizeof(queries));
+	memset(unit_desc, 0, sizeof(unit_desc));
+	for (unsigned int i = 0; i < nr_queries; i++) {
+		queries[i].opcode = QUERY_REQ_OP_READ_DESC;
+		queries[i].idn = QUERY_DESC_IDN_UNIT;
+		queries[i].index = i;
+		queries[i].buf = unit_desc[i];
+		queries[i].len = QUERY_DESC_SIZE_UNIT;
+	}
+
+	// A unit descriptor read can fail for LUs that don't exist,
+	// those are just reported as disabled.
+	ufs_bsg_query_batch(&ufs_session, queries, nr_queries);
+
+	for (unsigned int i = 0; i < nr_queries; i++) {
+		if (!queries[i].ret)
+			ufs_decode_unit_desc(&info->units[i], unit_desc[i]);
+		info->query_usec += queries[i].latency_usec;
+	}
+	info->nr_units = nr_queries;
+	info->nr_queries += nr_queries;
+
+	ret = boot_cache_write(ufs_info_cache_name(), info, sizeof(*info));
+	if (ret)
+		LOGD("%s: Failed to cache UFS info: %d\n", __func__, ret);
+
+	return 0;
 }
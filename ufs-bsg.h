@@ -30,8 +30,14 @@
  * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #define FNAME_SZ	      64
 
+#define UFS_BSG_DEV_FMT	      "/dev/bsg/ufs-bsg%u"
+#define UFS_BSG_DEV_CACHE     "ufs-bsg-dev"
+
 #define SG_IO		      0x2285
 
 #define DWORD(b3, b2, b1, b0) htobe32((b3 << 24) | (b2 << 16) | (b1 << 8) | b0)
@@ -86,6 +92,209 @@ enum query_attr_idn {
 	QUERY_ATTR_IDN_ACTIVE_ICC_LVL = 0x03,
 };
 
+struct sg_io_v4;
+
+/*
+ * The transport carrying BSG requests to the device. The default is
+ * the kernel's SG_IO ioctl on the ufs-bsg node. The mock transport
+ * (see ufs-bsg-mock.c) is only used by the tests, or when built with
+ * -Dufs_mock=true and $QBOOTCTL_UFS_MOCK is set.
+ */
+struct ufs_bsg_transport {
+	const char *name;
+	// Whether the node at path exists, without opening it
+	bool (*present)(const char *path);
+	// Returns a handle >= 0 or -1 with errno set
+	int (*open)(const char *path);
+	void (*close)(int handle);
+	// Same semantics as ioctl(handle, SG_IO, sg_io)
+	int (*sg_io)(int handle, struct sg_io_v4 *sg_io);
+};
+
+extern const struct ufs_bsg_transport ufs_bsg_transport_sg_io;
+extern const struct ufs_bsg_transport ufs_bsg_transport_mock;
+
+// Override the transport, must be called before opening any session
+void ufs_bsg_set_transport(const struct ufs_bsg_transport *transport);
+// Whether queries go to the mock instead of a UFS device
+bool ufs_bsg_is_mock(void);
+
+#define UFS_MOCK_ENV "QBOOTCTL_UFS_MOCK"
+
+/*
+ * Mock device behaviour. latency_us is added to every request, a
+ * request fails with a transient transport error with probability
+ * error_rate. If state_path is set the attribute and flag space are
+ * loaded from and saved to that file so that state survives across
+ * invocations, trace_path gets a line for every request.
+ */
+struct ufs_mock_config {
+	uint32_t latency_us;
+	double error_rate;
+	unsigned int seed;
+	const char *state_path;
+	const char *trace_path;
+};
+
+// Every request seen by the mock, decoded from the UPIU
+struct ufs_mock_record {
+	uint8_t func;
+	uint8_t opcode;
+	uint8_t idn;
+	uint8_t index;
+	uint8_t selector;
+	uint16_t length;
+	uint32_t value;
+	bool injected_error;
+};
+
+// Configure the mock, by default it's configured from
+// $QBOOTCTL_UFS_MOCK ("latency_us=N,error_rate=F,seed=N,state=PATH,trace=PATH")
+void ufs_mock_configure(const struct ufs_mock_config *config);
+const struct ufs_mock_record *ufs_mock_get_records(unsigned int *count);
+int ufs_mock_get_attr(uint8_t idn, uint32_t *value);
+int ufs_mock_set_attr(uint8_t idn, uint32_t value);
+
+/*
+ * How long to wait for a single query and how often to retry it on
+ * transient (transport/timeout) errors. The delay between attempts
+ * starts at backoff_ms and doubles every retry.
+ */
+struct ufs_query_policy {
+	uint32_t timeout_ms;
+	unsigned int max_retries;
+	uint32_t backoff_ms;
+};
+
+#define UFS_QUERY_POLICY_DEFAULT { .timeout_ms = 2000, .max_retries = 3, .backoff_ms = 10 }
+
+/*
+ * A session keeps the BSG node open so that several queries
+ * only pay for a single open/close.
+ */
+struct ufs_bsg_session {
+	const struct ufs_bsg_transport *transport;
+	int fd;
+	char path[FNAME_SZ];
+	struct ufs_query_policy policy;
+	// Number of queries issued, how often they were retried
+	// and the total time spent on them
+	unsigned int nr_queries;
+	unsigned int nr_retries;
+	uint64_t total_usec;
+};
+
+#define UFS_BSG_SESSION_INIT { .fd = -1, .policy = UFS_QUERY_POLICY_DEFAULT }
+
+/*
+ * A single query request. For attributes and flags value holds the
+ * value to write, and is replaced with the value read from the device.
+ * Descriptors are transferred through buf/len.
+ */
+struct ufs_query {
+	enum query_req_opcode opcode;
+	uint8_t idn;
+	uint8_t index;
+	uint8_t selector;
+	uint32_t value;
+	uint8_t *buf;
+	uint16_t len;
+	// Overrides the session timeout if non-zero
+	uint32_t timeout_ms;
+
+	// Filled in by ufs_bsg_query(), latency includes all retries
+	int ret;
+	unsigned int retries;
+	uint64_t latency_usec;
+};
+
+// Open the BSG node at path (or the default node if NULL). Reopening
+// the same path on an open session is a no-op.
+int ufs_bsg_session_open(struct ufs_bsg_session *session, const char *path);
+void ufs_bsg_session_close(struct ufs_bsg_session *session);
+// Returns 0 on success, the error is also stored in query->ret
+int ufs_bsg_query(struct ufs_bsg_session *session, struct ufs_query *query);
+// Issue every query in order, returns the number of failed queries
+int ufs_bsg_query_batch(struct ufs_bsg_session *session, struct ufs_query *queries,
+			unsigned int count);
+
+#define UFS_MAX_LUNS  32
+#define UFS_INFO_CACHE "ufs-info"
+
+// Decoded unit descriptor
+struct ufs_unit_info {
+	uint8_t lu_enable;
+	uint8_t boot_lun_id;
+	uint8_t write_protect;
+	uint8_t memory_type;
+	uint8_t provisioning_type;
+	// Logical block size is 1 << log2_block_size bytes
+	uint8_t log2_block_size;
+	uint64_t block_count;
+	uint32_t erase_block_size;
+};
+
+// Decoded device/geometry descriptors and the boot related attributes
+struct ufs_info {
+	// BSG node the info was read from
+	char bsg_dev[FNAME_SZ];
+
+	// Device descriptor
+	uint16_t spec_version;
+	uint16_t manufacturer_id;
+	uint16_t manufacture_date;
+	uint8_t number_lu;
+	uint8_t number_wlu;
+	uint8_t boot_enable;
+	uint8_t init_power_mode;
+	uint8_t high_priority_lun;
+	uint8_t init_active_icc_level;
+
+	// Geometry descriptor
+	uint64_t total_raw_capacity; // in 512 byte units
+	uint32_t segment_size;
+	uint8_t max_number_lu;
+	uint8_t allocation_unit_size;
+	uint8_t min_addr_block_size;
+
+	// Attributes
+	uint32_t boot_lun_en;
+	uint32_t current_power_mode;
+	uint32_t active_icc_level;
+
+	uint8_t nr_units;
+	struct ufs_unit_info units[UFS_MAX_LUNS];
+
+	// Cost of reading the above from the device
+	unsigned int nr_queries;
+	uint64_t query_usec;
+};
+
+// Read and decode the UFS descriptors. If use_cache is set, a result
+// cached earlier in this boot is returned without touching the device.
+// Returns 1 if the result came from the cache, 0 if it was read from
+// the device and -errno on error.
+int ufs_get_info(struct ufs_info *info, bool use_cache);
+
+// Use the BSG node of UFS host instead of discovering it
+void ufs_bsg_set_host(unsigned int host);
+// Return the BSG node of the UFS host that XBL lives on. The result
+// is cached for the rest of the boot (unless use_cache is false), if
+// it can't be determined host 0 is assumed.
+const char *ufs_bsg_discover(bool use_cache);
+
+// Set the timeout/retry policy of the default session
+void ufs_bsg_set_policy(const struct ufs_query_policy *policy);
+
+// Open/close the default session used by the boot LUN helpers
 int ufs_bsg_dev_open();
+void ufs_bsg_dev_close();
+
+// Read the current bBootLunEn attribute
+int32_t get_boot_lun(uint8_t *lun_id);
+// Set bBootLunEn to lun_id, skipping the write if it already matches
+int32_t set_boot_lun(uint8_t lun_id);
+// Attribute writes set_boot_lun() made so far
+unsigned int ufs_bsg_attr_writes(void);
 
 #endif /* __RECOVERY_UFS_BSG_H__ */